@@ -0,0 +1,109 @@
+#ifndef _BATCHPACK_HPP_
+#define _BATCHPACK_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <boost/utility/string_view.hpp>
+
+namespace CloudBackup {
+  // 批量上传的打包格式, 把许多小文件放在一个请求体里
+  // 格式(小端):
+  //   "CBPACK1\n"            8字节
+  //   重复: uint32_t 路径长度, uint32_t 标志, uint64_t 内容长度, 路径, 内容
+  // 路径是相对于用户备份根目录的路径(与/upload/之后的部分相同); 标志m_s_Gzip表示内容是单个gzip成员
+  class BatchPack
+  {
+    struct Header
+    {
+      uint32_t m_pathLen;
+      uint32_t m_flags;
+      uint64_t m_size;
+    };
+    public:
+      struct Entry
+      {
+        boost::string_view m_path;
+        uint32_t m_flags;
+        boost::string_view m_data;
+      };
+      static const uint32_t m_s_Gzip = 1;
+
+      BatchPack() {
+        clear();
+      }
+      void clear() {
+        m_buf.assign(_magic(), m_s_MagicLen);
+        m_count = 0;
+      }
+      void add(const std::string &path, const std::string &data, uint32_t flags = 0) {
+        Header header{ static_cast<uint32_t>(path.size()), flags, data.size() };
+        m_buf.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        m_buf.append(path);
+        m_buf.append(data);
+        ++m_count;
+      }
+      size_t count() const {
+        return m_count;
+      }
+      // 打包后的请求体
+      const std::string &data() const {
+        return m_buf;
+      }
+      // 解析请求体, entries指向body内部; 格式错误或路径不合法(绝对路径, 含有..)时返回false
+      static bool parse(const std::string &body, std::vector<Entry> &entries) {
+        entries.clear();
+        if (body.compare(0, m_s_MagicLen, _magic()) != 0) {
+          return false;
+        }
+        for (size_t off = m_s_MagicLen; off < body.size(); ) {
+          Header header;
+          if (body.size() - off < sizeof(header)) {
+            return false;
+          }
+          memcpy(&header, body.data() + off, sizeof(header));
+          off += sizeof(header);
+          if (body.size() - off < header.m_pathLen || body.size() - off - header.m_pathLen < header.m_size) {
+            return false;
+          }
+          Entry entry;
+          entry.m_path = boost::string_view(body.data() + off, header.m_pathLen);
+          entry.m_flags = header.m_flags;
+          entry.m_data = boost::string_view(body.data() + off + header.m_pathLen, header.m_size);
+          if (!_validPath(entry.m_path)) {
+            return false;
+          }
+          off += header.m_pathLen + header.m_size;
+          entries.push_back(entry);
+        }
+        return true;
+      }
+    private:
+      static const char *_magic() {
+        return "CBPACK1\n";
+      }
+      static bool _validPath(boost::string_view path) {
+        if (path.empty() || path.front() == '/' || path.find('\0') != boost::string_view::npos) {
+          return false;
+        }
+        for (size_t begin = 0; begin <= path.size(); ) {
+          size_t end = path.find('/', begin);
+          if (end == boost::string_view::npos) {
+            end = path.size();
+          }
+          if (path.substr(begin, end - begin) == "..") {
+            return false;
+          }
+          begin = end + 1;
+        }
+        return true;
+      }
+    private:
+      std::string m_buf;
+      size_t m_count;
+      static const size_t m_s_MagicLen = 8;
+  };
+}
+
+#endif /* _BATCHPACK_HPP_ */
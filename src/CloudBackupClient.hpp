@@ -3,27 +3,52 @@
 
 #include <vector>
 #include <string>
+#include <sstream>
 #include <iostream>
 #include <sys/stat.h>
+#include <zlib.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <boost/filesystem.hpp>
 #include "httplib.h"
 #include "MyUtil.hpp"
+#include "PathTable.hpp"
+#include "DirScanner.hpp"
+#include "XXHash64.hpp"
+#include "UploadDebouncer.hpp"
+#include "RateLimiter.hpp"
+#include "Metrics.hpp"
+#include "BatchPack.hpp"
 
 namespace CloudBackup {
-	// ļϢ
+	// 本地文件信息管理类
+	// 路径驻留在PathTable中, 每个文件的属性按节点号存放, 不再为每个文件保存一份完整路径
+	// 修改时间(纳秒), ctime, 大小和inode都不变才认为文件没有变化; 只有属性变化而大小不变时, 先比较内容哈希再决定是否上传
 	class LocalFileManager
 	{
 	public:
-		LocalFileManager() {
-      m_filename = MyUtil::getConfig("./CBackup.cnf", "CloudClient")["cliLog"];
+		struct FileMeta
+		{
+			int64_t m_mtime; // 纳秒, 不在表中时为m_s_NoFile
+			int64_t m_ctime; // 纳秒
+			uint64_t m_size;
+			uint64_t m_ino;  // 旧格式的记录只有秒级的修改时间, 其余各项为0
+			uint64_t m_hash; // 上传内容的XXH64, 0表示没有记录
+			uint64_t m_tail; // 上传内容最后m_s_TailSize字节的XXH64, 用于判断之后的变化是不是只在末尾追加, 0表示没有记录
+		};
+		LocalFileManager() : m_count(0) {
+			std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudClient");
+			m_filename = config["cliLog"];
+			m_scanner = DirScanner(atoi(config["scanThreads"].c_str()));
+			m_hashCheck = atoi(config["hashCheck"].c_str()) != 0;
+			m_appendTailOnly = (config["appendCheck"] == "tail");
 			_loadData();
 		}
 		~LocalFileManager() {
 			_storageData();
 		}
 		bool isExistFile(const std::string &filepath) {
-			return m_map.find(filepath) != m_map.end();
+			return _meta(filepath).m_mtime != m_s_NoFile;
 		}
 		bool isNewFile(const std::string &filepath) {
 			struct stat buf;
@@ -32,7 +57,7 @@ namespace CloudBackup {
 				std::cout << "get " << filepath << " stat error" << std::endl;
 				return false;
 			}
-			return !isExistFile(filepath) || (getMtime(filepath) < buf.st_mtime);
+			return _isNew(filepath, buf);
 		}
 		bool insertData(const std::string &filepath) {
 			struct stat buf;
@@ -41,53 +66,251 @@ namespace CloudBackup {
 				std::cout << "get " << filepath << " stat error" << std::endl;
 				return false;
 			}
-			m_map[filepath] = buf.st_mtime;
+			return insertData(filepath, buf);
+		}
+		// 使用扫描时得到的stat结果, 上传期间文件又被修改时记录的是旧的属性, 下一轮扫描会再次检查
+		// hash和tail是实际上传的内容的哈希(见FileMeta), 不知道时为0
+		bool insertData(const std::string &filepath, const struct stat &buf, uint64_t hash = 0, uint64_t tail = 0) {
+			FileMeta meta = _toMeta(buf, hash);
+			meta.m_tail = tail;
+			_set(m_paths.intern(filepath), meta);
+			_storageData();
+			return true;
+		}
+		// 批量登记的一项, 含义同insertData的参数
+		struct Update
+		{
+			std::string m_path;
+			struct stat m_stat;
+			uint64_t m_hash;
+			uint64_t m_tail;
+		};
+		// 一次登记多个文件, 表只重写一次
+		bool insertData(const std::vector<Update> &updates) {
+			for (const Update &update : updates) {
+				FileMeta meta = _toMeta(update.m_stat, update.m_hash);
+				meta.m_tail = update.m_tail;
+				_set(m_paths.intern(update.m_path), meta);
+			}
 			_storageData();
 			return true;
 		}
+		bool getMeta(const std::string &filepath, FileMeta &meta) const {
+			meta = _meta(filepath);
+			return meta.m_mtime != m_s_NoFile;
+		}
+		// 内容最后m_s_TailSize字节的哈希, data至少要包含文件最后的m_s_TailSize字节(文件更小时是整个文件)
+		static uint64_t tailHash(const std::string &data) {
+			size_t len = std::min(data.size(), m_s_TailSize);
+			return XXHash64::hash(data.data() + data.size() - len, len);
+		}
+		// 上次上传之后文件只在末尾追加了内容: inode不变, 变大了, 并且原来的内容没有变
+		// appendCheck=full时读出整个文件, 比较原来部分的哈希, 同时得到新内容的哈希(hash)
+		// appendCheck=tail时只读原来末尾的一块和新追加的部分, 比较末尾块的哈希; 中间被改写的情况发现不了, 之后hash为0
+		// 返回true时data是文件中[meta.m_size - skip, buf.st_size)的内容, 前skip字节是原来的内容, 之后是新追加的内容
+		bool getAppended(const std::string &filepath, const struct stat &buf, FileMeta &meta,
+			std::string &data, size_t &skip, uint64_t &hash) const {
+			if (!getMeta(filepath, meta) || meta.m_ino != buf.st_ino || meta.m_size == 0
+				|| static_cast<uint64_t>(buf.st_size) <= meta.m_size) {
+				return false;
+			}
+			if (!m_appendTailOnly) {
+				skip = meta.m_size;
+				if (meta.m_hash == 0 || !MyUtil::readFile(filepath, data, 0, buf.st_size)) {
+					return false;
+				}
+				XXHash64 state;
+				state.update(data.data(), skip);
+				if (state.digest() != meta.m_hash) {
+					return false;
+				}
+				state.update(data.data() + skip, data.size() - skip);
+				hash = state.digest();
+				return true;
+			}
+			skip = std::min(static_cast<size_t>(meta.m_size), m_s_TailSize);
+			hash = 0;
+			return meta.m_tail != 0
+				&& MyUtil::readFile(filepath, data, meta.m_size - skip, buf.st_size - meta.m_size + skip)
+				&& XXHash64::hash(data.data(), skip) == meta.m_tail;
+		}
 		bool deleteData(const std::string &filepath) {
-			if (!isExistFile(filepath)) {
+			PathTable::Id id;
+			if (!m_paths.find(filepath, id) || id >= m_meta.size() || m_meta[id].m_mtime == m_s_NoFile) {
 				return false;
 			}
-			m_map.erase(m_map.find(filepath));
+			_set(id, _noFile());
 			_storageData();
 			return true;
 		}
 		bool getAllList(std::vector<std::string> &fileList) {
 			fileList.clear();
-			for (auto &it : m_map) {
-				fileList.push_back(it.first);
-			}
+			forEachFile([&fileList](const std::string &filepath, const FileMeta &) {
+				fileList.push_back(filepath);
+			});
 			return false;
 		}
+		// 依次访问每个文件, 路径拼在同一个缓冲区中, 不为每个文件分配内存
+		template <typename Visitor>
+		void forEachFile(Visitor visit) const {
+			std::string filepath;
+			for (PathTable::Id id = 1; id < m_meta.size(); ++id) {
+				if (m_meta[id].m_mtime != m_s_NoFile) {
+					filepath.clear();
+					m_paths.appendPath(id, filepath);
+					visit(filepath, m_meta[id]);
+				}
+			}
+		}
 		std::vector<std::string> getUpdateFileList(std::string Dirname) {
 			std::vector<std::string> files;
-			boost::filesystem::recursive_directory_iterator iter_begin(Dirname), iter_end;
-			for (; iter_begin != iter_end; ++iter_begin) {
-				std::string filepath = iter_begin->path().string();
-				MyUtil::DealPath(filepath);
-				if (!boost::filesystem::is_directory(filepath) && isNewFile(filepath)) {
-					files.push_back(filepath);
-				}
+			std::vector<DirScanner::Entry> entries;
+			getUpdateFiles(MyUtil::DealPath(Dirname), entries);
+			for (auto &entry : entries) {
+				files.push_back(std::move(entry.m_path));
 			}
 			return files;
 		}
+		// 多线程扫描目录, 得到新增和修改过的文件及其stat结果
+		// 扫描期间各线程只读文件信息表, 调用者需要保证此时没有修改
+		// 属性变化但内容哈希相同的文件(例如只是touch过)不放入files, 只更新记录的属性
+		bool getUpdateFiles(const std::string &dirname, std::vector<DirScanner::Entry> &files) {
+			files.clear();
+			bool ret = m_scanner.scan(dirname, [this](const std::string &filepath, const struct stat &buf) {
+				return _isNew(filepath, buf);
+			}, files);
+			if (m_hashCheck) {
+				size_t unchanged = 0;
+				for (size_t i = 0; i < files.size(); ) {
+					if (_sameContent(files[i].m_path, files[i].m_stat)) {
+						std::swap(files[i], files.back());
+						files.pop_back();
+						++unchanged;
+					} else {
+						++i;
+					}
+				}
+				if (unchanged != 0) {
+					std::cout << unchanged << " files touched but unchanged, skip upload" << std::endl;
+					_storageData();
+				}
+			}
+			return ret;
+		}
 		time_t getMtime(std::string filepath) {
-			if (!isExistFile(filepath))
-				return 0;
-			return m_map[filepath];
+			int64_t mtime = _meta(filepath).m_mtime;
+			return mtime == m_s_NoFile ? 0 : static_cast<time_t>(mtime / m_s_NsPerSec);
+		}
+		size_t size() const {
+			return m_count;
 		}
 	private:
+		static int64_t _ns(const struct timespec &ts) {
+			return static_cast<int64_t>(ts.tv_sec) * m_s_NsPerSec + ts.tv_nsec;
+		}
+		static FileMeta _toMeta(const struct stat &buf, uint64_t hash) {
+			FileMeta meta;
+			meta.m_mtime = _ns(buf.st_mtim);
+			meta.m_ctime = _ns(buf.st_ctim);
+			meta.m_size = buf.st_size;
+			meta.m_ino = buf.st_ino;
+			meta.m_hash = hash;
+			meta.m_tail = 0;
+			return meta;
+		}
+		static FileMeta _noFile() {
+			FileMeta meta;
+			memset(&meta, 0, sizeof(meta));
+			meta.m_mtime = m_s_NoFile;
+			return meta;
+		}
+		bool _isNew(const std::string &filepath, const struct stat &buf) const {
+			const FileMeta &meta = _meta(filepath);
+			if (meta.m_mtime == m_s_NoFile) {
+				return true;
+			}
+			if (meta.m_ino == 0) {
+				// 旧格式的记录沿用原来的判断, 文件再次上传后换成完整的记录
+				return meta.m_mtime / m_s_NsPerSec < buf.st_mtime;
+			}
+			return meta.m_mtime != _ns(buf.st_mtim) || meta.m_ctime != _ns(buf.st_ctim)
+				|| meta.m_size != static_cast<uint64_t>(buf.st_size) || meta.m_ino != buf.st_ino;
+		}
+		// 大小没变并且有上次上传内容的哈希时, 读出文件比较哈希; 相同时更新记录的属性并返回true
+		bool _sameContent(const std::string &filepath, const struct stat &buf) {
+			PathTable::Id id;
+			if (!m_paths.find(filepath, id) || id >= m_meta.size()) {
+				return false;
+			}
+			const FileMeta &meta = m_meta[id];
+			if (meta.m_mtime == m_s_NoFile || meta.m_hash == 0 || meta.m_size != static_cast<uint64_t>(buf.st_size)) {
+				return false;
+			}
+			uint64_t hash;
+			if (!_hashFile(filepath, hash) || hash != meta.m_hash) {
+				return false;
+			}
+			_set(id, _toMeta(buf, hash));
+			return true;
+		}
+		static bool _hashFile(const std::string &filepath, uint64_t &hash) {
+			FILE *fp = fopen(filepath.c_str(), "rb");
+			if (fp == nullptr) {
+				return false;
+			}
+			XXHash64 state;
+			std::vector<char> buf(64 * 1024);
+			size_t n;
+			while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0) {
+				state.update(buf.data(), n);
+			}
+			bool ok = !ferror(fp);
+			fclose(fp);
+			hash = state.digest();
+			return ok;
+		}
+		// 文件的属性, 不在表中时m_mtime为m_s_NoFile
+		const FileMeta &_meta(const std::string &filepath) const {
+			static const FileMeta noFile = _noFile();
+			PathTable::Id id;
+			if (!m_paths.find(filepath, id) || id >= m_meta.size()) {
+				return noFile;
+			}
+			return m_meta[id];
+		}
+		void _set(PathTable::Id id, const FileMeta &meta) {
+			if (id >= m_meta.size()) {
+				m_meta.resize(m_paths.size(), _noFile());
+			}
+			if (m_meta[id].m_mtime == m_s_NoFile && meta.m_mtime != m_s_NoFile) {
+				++m_count;
+			} else if (m_meta[id].m_mtime != m_s_NoFile && meta.m_mtime == m_s_NoFile) {
+				--m_count;
+			}
+			m_meta[id] = meta;
+		}
+		// 每行: 路径 修改时间 ctime 大小 inode 哈希 末尾块哈希, 时间单位是纳秒, 末尾块哈希可以没有
+		// 旧格式每行只有路径和秒级的修改时间, 按字段数区分
 		void _loadData() {
 			std::fstream fin;
 			fin.open(m_filename);
 			if (!fin.is_open()) {
 				throw std::runtime_error("open file error!");
 			}
-			time_t mtime;
-			std::string filepath;
-			while (fin >> filepath >> mtime) {
-				m_map[filepath] = mtime;
+			std::string line, filepath;
+			while (std::getline(fin, line)) {
+				std::istringstream ss(line);
+				FileMeta meta = _noFile();
+				if (!(ss >> filepath >> meta.m_mtime)) {
+					continue;
+				}
+				if (!(ss >> meta.m_ctime >> meta.m_size >> meta.m_ino >> meta.m_hash)) {
+					meta.m_mtime *= m_s_NsPerSec;
+					meta.m_ctime = meta.m_size = meta.m_ino = meta.m_hash = 0;
+				} else if (!(ss >> meta.m_tail)) {
+					meta.m_tail = 0;
+				}
+				_set(m_paths.intern(filepath), meta);
 			}
 		}
 		void _storageData() {
@@ -96,15 +319,26 @@ namespace CloudBackup {
 			if (!fout.is_open()) {
 				throw std::runtime_error("open file error!");
 			}
-			for (auto &it : m_map) {
-				fout << it.first << ' ' << it.second << std::endl;
-			}
+			forEachFile([&fout](const std::string &filepath, const FileMeta &meta) {
+				fout << filepath << ' ' << meta.m_mtime << ' ' << meta.m_ctime << ' ' << meta.m_size
+					<< ' ' << meta.m_ino << ' ' << meta.m_hash << ' ' << meta.m_tail << '\n';
+			});
 		}
 	private:
 		std::string m_filename;
-		std::unordered_map<std::string, time_t> m_map;
+		PathTable m_paths;
+		std::vector<FileMeta> m_meta; // 按节点号存放, 目录节点和已删除的文件的m_mtime为m_s_NoFile
+		size_t m_count;
+		DirScanner m_scanner;
+		bool m_hashCheck;
+		bool m_appendTailOnly;
+		static const time_t m_s_NoFile = -1;
+		static const int64_t m_s_NsPerSec = 1000000000;
+		static const size_t m_s_TailSize = 4096;
 	};
-	// httpͻ
+	const time_t LocalFileManager::m_s_NoFile;
+	const size_t LocalFileManager::m_s_TailSize;
+	// http客户端
 	class HttpClientModule
 	{
 	public:
@@ -120,36 +354,243 @@ namespace CloudBackup {
 				}
 				m_listenDirs.push_back(dirpath);
 			}
+			std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudClient");
+			m_debouncer.configure(atoi(config["uploadSettle"].c_str()), atoi(config["uploadMaxDelay"].c_str()));
+			m_compress = (config["uploadCompress"] == "gzip");
+			m_compressLevel = config["uploadCompressLevel"].empty() ? Z_DEFAULT_COMPRESSION : atoi(config["uploadCompressLevel"].c_str());
+			m_limiter.configure(config["uploadRate"], config["uploadRateSchedule"], config["uploadRateAdaptive"] == "1");
+			m_metricsFile = config["metricsFile"];
+			m_batchFileSize = strtoull(config["batchFileSize"].c_str(), nullptr, 10);
+			m_batchMaxSize = config["batchMaxSize"].empty() ? 4 * 1024 * 1024 : strtoull(config["batchMaxSize"].c_str(), nullptr, 10);
+			RateLimiter &limiter = m_limiter;
+			Metrics::callback("cloudbackup_client_upload_rate_limit_bytes", "Current upload rate limit in bytes per second, 0 means unlimited",
+				"gauge", "", [&limiter]() { return limiter.limit(); });
 		}
 		HttpClientModule(const std::string &listenDir, const std::string &host, int port = 9000)
 			: HttpClientModule(std::vector<std::string>(1, listenDir), host, port) {}
 		void start() {
-			std::string path, body;
+			std::vector<DirScanner::Entry> fileList;
 			while (true) {
+				m_debouncer.beginCycle();
+				time_t now = time(nullptr);
+				m_limiter.update(now);
 				for (const auto &dirpath : m_listenDirs) {
-					std::vector<std::string> fileList = m_lfm.getUpdateFileList(dirpath);
-					for (auto &file : fileList) {
-						MyUtil::readFile(file, body);
-						path = "/upload" + file.substr(dirpath.size());
-						auto res = m_cli.Put(path.c_str(), body, "application/octet-stream");
-						if (res && res->status == 200 && m_lfm.insertData(file)) {
-							std::cout << "upload file " << file << " success!" << std::endl;
-						} else {
-							std::cout << "upload file " << file << " failed!" << std::endl;
+					m_lfm.getUpdateFiles(dirpath, fileList);
+					for (auto &entry : fileList) {
+						const std::string &file = entry.m_path;
+						if (!m_debouncer.ready(file, entry.m_stat, now)) {
+							continue;
+						}
+						if (m_batchFileSize > 0 && static_cast<uint64_t>(entry.m_stat.st_size) <= m_batchFileSize) {
+							_addBatch(dirpath, entry);
+							if (m_pack.data().size() >= m_batchMaxSize || m_pack.count() >= m_s_BatchMaxFiles) {
+								_flushBatch(dirpath);
+							}
+							continue;
+						}
+						if (_sync(dirpath, entry)) {
+							m_debouncer.done(file);
 						}
 					}
+					// 包中的路径相对于监听目录, 每个目录的文件单独打包
+					_flushBatch(dirpath);
 				}
+				m_debouncer.endCycle();
+				_writeMetrics();
 				MyUtil::MySleep(IntervalTime);
 			}
 		}
 
+	private:
+		// 上传一个有变化的文件: 只在末尾追加了内容时只发送新的部分, 服务器拒绝(例如两边的大小对不上)或者不是追加时完整上传
+		bool _sync(const std::string &dirpath, const DirScanner::Entry &entry) {
+			const std::string &file = entry.m_path;
+			std::string relpath = file.substr(dirpath.size());
+			LocalFileManager::FileMeta meta;
+			size_t skip;
+			uint64_t hash;
+			if (m_lfm.getAppended(file, entry.m_stat, meta, m_body, skip, hash)) {
+				std::string path = "/append" + relpath + "?offset=" + std::to_string(meta.m_size);
+				auto res = _upload(path, m_body.substr(skip), hash);
+				if (res && res->status == 200) {
+					std::cout << "append " << m_body.size() - skip << " bytes to " << file << " success!" << std::endl;
+					return m_lfm.insertData(file, entry.m_stat, hash, LocalFileManager::tailHash(m_body));
+				}
+				std::cout << "append to " << file << " failed, upload the whole file" << std::endl;
+			}
+			if (!MyUtil::readFile(file, m_body)) {
+				return false;
+			}
+			// 扫描之后又追加的内容留到下一轮, 使服务器上的大小与记录的大小一致, 下一轮可以继续追加
+			if (m_body.size() > static_cast<size_t>(entry.m_stat.st_size)) {
+				m_body.resize(entry.m_stat.st_size);
+			}
+			hash = XXHash64::hash(m_body);
+			auto res = _upload("/upload" + relpath, m_body, hash);
+			if (res && res->status == 200 && m_lfm.insertData(file, entry.m_stat, hash, LocalFileManager::tailHash(m_body))) {
+				std::cout << "upload file " << file << " success!" << std::endl;
+				return true;
+			}
+			std::cout << "upload file " << file << " failed!" << std::endl;
+			return false;
+		}
+		// 小文件不单独上传, 先放进包里, 攒够之后一个请求发送, 服务器一次登记
+		// 压缩的规则与单独上传相同, 每个文件各自压缩, 服务器直接保存
+		void _addBatch(const std::string &dirpath, const DirScanner::Entry &entry) {
+			if (!MyUtil::readFile(entry.m_path, m_body)) {
+				return;
+			}
+			if (m_body.size() > static_cast<size_t>(entry.m_stat.st_size)) {
+				m_body.resize(entry.m_stat.st_size);
+			}
+			// 去掉开头的'/', 与/upload/之后的部分相同
+			std::string relpath = entry.m_path.substr(dirpath.size() + 1);
+			if (m_compress && m_body.size() >= m_s_MinCompressSize && _gzip(m_body, m_zbuf, m_compressLevel)
+				&& m_zbuf.size() < m_body.size() - m_body.size() / 10) {
+				m_pack.add(relpath, m_zbuf, BatchPack::m_s_Gzip);
+			} else {
+				m_pack.add(relpath, m_body);
+			}
+			m_batch.push_back(LocalFileManager::Update{ entry.m_path, entry.m_stat, XXHash64::hash(m_body), LocalFileManager::tailHash(m_body) });
+		}
+		// 发送包中的文件, 服务器返回写入失败的路径(每行一个), 其余的一次登记到本地文件信息表
+		// 服务器不支持批量上传(404)时不再打包, 这些文件下一轮单独上传
+		void _flushBatch(const std::string &dirpath) {
+			static Counter &requests = Metrics::counter("cloudbackup_client_batch_requests_total", "Batch upload requests sent by the client");
+			static Counter &files = Metrics::counter("cloudbackup_client_batch_files_total", "Files uploaded in batches");
+			if (m_pack.count() == 0) {
+				return;
+			}
+			auto res = _put("/batch", httplib::Headers(), m_pack.data());
+			requests.add(1);
+			if (res && res->status == 200) {
+				std::unordered_set<std::string> failed;
+				std::istringstream lines(res->body);
+				for (std::string line; std::getline(lines, line); ) {
+					failed.insert(line);
+				}
+				std::vector<LocalFileManager::Update> updates;
+				updates.reserve(m_batch.size());
+				for (auto &update : m_batch) {
+					if (failed.count(update.m_path.substr(dirpath.size() + 1)) != 0) {
+						std::cout << "upload file " << update.m_path << " failed!" << std::endl;
+						continue;
+					}
+					m_debouncer.done(update.m_path);
+					updates.push_back(std::move(update));
+				}
+				m_lfm.insertData(updates);
+				files.add(updates.size());
+				std::cout << "batch upload " << updates.size() << " files success!" << std::endl;
+			} else if (res && res->status == 404) {
+				std::cout << "server does not support batch upload, upload files one by one" << std::endl;
+				m_batchFileSize = 0;
+			} else {
+				std::cout << "batch upload " << m_pack.count() << " files failed!" << std::endl;
+			}
+			m_pack.clear();
+			m_batch.clear();
+		}
+		// 压缩后明显变小时以Content-Encoding: gzip上传, 服务器直接保存压缩后的内容
+		// 服务器不接受压缩上传(415)时改为不压缩, 之后不再尝试
+		// hash是上传后服务器上整个文件(解压后)的XXH64, 放在Digest头中由服务器校验和记录, 0表示不知道
+		std::shared_ptr<httplib::Response> _upload(const std::string &path, const std::string &body, uint64_t hash) {
+			httplib::Headers headers;
+			if (hash != 0) {
+				headers.emplace("Digest", "xxh64=" + XXHash64::toHex(hash));
+			}
+			if (m_compress && body.size() >= m_s_MinCompressSize && _gzip(body, m_zbuf, m_compressLevel)
+				&& m_zbuf.size() < body.size() - body.size() / 10) {
+				httplib::Headers gzipHeaders(headers);
+				gzipHeaders.emplace("Content-Encoding", "gzip");
+				auto res = _put(path, gzipHeaders, m_zbuf);
+				if (!res || res->status != 415) {
+					return res;
+				}
+				std::cout << "server does not accept compressed uploads, upload uncompressed" << std::endl;
+				m_compress = false;
+			}
+			return _put(path, headers, body);
+		}
+		// 经过限速器分块发送请求体
+		// 每个请求新建一个连接, 从发起请求到第一次要求请求体的时间主要是建立连接的耗时, 作为RTT样本
+		std::shared_ptr<httplib::Response> _put(const std::string &path, const httplib::Headers &headers, const std::string &body) {
+			static Counter &bytes = Metrics::counter("cloudbackup_client_upload_bytes_total", "Request body bytes sent by the client");
+			static Histogram &throttle = Metrics::histogram("cloudbackup_client_throttle_wait_seconds",
+				"Time an upload request spent waiting for the rate limiter", "", 16, 38);
+			static Histogram &rtt = Metrics::histogram("cloudbackup_client_connect_rtt_seconds",
+				"Time from starting a request until its body could be sent", "", 14, 34);
+			auto start = std::chrono::steady_clock::now(), sendStart = start;
+			uint64_t waited = 0, rttNs = 0;
+			auto res = m_cli.Put(path.c_str(), headers, body.size(), [&](size_t offset, size_t length, httplib::DataSink &sink) {
+				if (offset == 0) {
+					sendStart = std::chrono::steady_clock::now();
+					rttNs = std::chrono::duration_cast<std::chrono::nanoseconds>(sendStart - start).count();
+				}
+				size_t len = std::min(length, m_s_SendChunkSize);
+				waited += m_limiter.acquire(len);
+				sink.write(body.data() + offset, len);
+				bytes.add(len);
+			}, "application/octet-stream");
+			uint64_t sendNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sendStart).count();
+			throttle.record(waited);
+			if (rttNs != 0) {
+				rtt.record(rttNs);
+				// 等待限速器的时间不算在发送速度里
+				m_limiter.sample(rttNs, body.size(), sendNs > waited ? sendNs - waited : 0);
+			}
+			return res;
+		}
+		// 客户端没有http服务, 指标以Prometheus文本格式写到文件中(node_exporter的textfile方式), 先写临时文件再rename
+		void _writeMetrics() {
+			if (m_metricsFile.empty()) {
+				return;
+			}
+			std::string tmp = m_metricsFile + ".tmp";
+			if (MyUtil::writeFile(tmp, Metrics::render())) {
+				rename(tmp.c_str(), m_metricsFile.c_str());
+			}
+		}
+		// 压缩成单个gzip成员, 与服务器用gzopen写出的.gz文件格式相同
+		static bool _gzip(const std::string &src, std::string &dst, int level) {
+			z_stream strm;
+			memset(&strm, 0, sizeof(strm));
+			// windowBits加16表示输出gzip格式
+			if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				return false;
+			}
+			dst.resize(deflateBound(&strm, src.size()) + 32);
+			strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+			strm.avail_in = static_cast<uInt>(src.size());
+			strm.next_out = reinterpret_cast<Bytef *>(&dst[0]);
+			strm.avail_out = static_cast<uInt>(dst.size());
+			int ret = deflate(&strm, Z_FINISH);
+			dst.resize(strm.total_out);
+			deflateEnd(&strm);
+			return ret == Z_STREAM_END;
+		}
 	private:
 		LocalFileManager m_lfm;
 		httplib::Client m_cli;
 		std::vector<std::string> m_listenDirs;
+		UploadDebouncer m_debouncer; // 正在写入的文件等写完再上传
+		bool m_compress;
+		int m_compressLevel;
+		std::string m_body; // 读出的文件内容, 在各次上传之间复用
+		std::string m_zbuf; // 压缩结果, 在各次上传之间复用
+		RateLimiter m_limiter;
+		std::string m_metricsFile;
+		BatchPack m_pack; // 正在攒的小文件
+		std::vector<LocalFileManager::Update> m_batch; // 包中各文件上传成功后要登记的属性
+		uint64_t m_batchFileSize; // 不超过这个大小的文件打包上传, 0表示不打包
+		uint64_t m_batchMaxSize;  // 包的大小达到这个值时发送
 		static const time_t IntervalTime = 3;
+		static const size_t m_s_MinCompressSize = 512; // 更小的文件压缩省下的字节不值得
+		static const size_t m_s_SendChunkSize = 16 * 1024; // 每取一次令牌发送的字节数
+		static const size_t m_s_BatchMaxFiles = 1000; // 一个包最多的文件数
 	};
 	const time_t HttpClientModule::IntervalTime;
+	const size_t HttpClientModule::m_s_SendChunkSize;
 }
 
 #endif /* _CLOUDBACKUPCLIENT_HPP_ */ 
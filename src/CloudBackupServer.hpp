@@ -12,10 +12,32 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <algorithm>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <condition_variable>
 #include <unordered_map>
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
 #include "httplib.h"
 #include "MyUtil.hpp"
+#include "Router.hpp"
+#include "EpollServer.hpp"
+#include "UringIO.hpp"
+#include "WorkStealingPool.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+#include "IndexSnapshot.hpp"
+#include "BatchPack.hpp"
+#include "SegmentStore.hpp"
+#include "DurableFile.hpp"
+#include "DirScanner.hpp"
+#include "XXHash64.hpp"
+#include "RateLimiter.hpp"
+#include "ObjectCache.hpp"
+#include "VersionStore.hpp"
 #include "mysqlHelper.hpp"
 
 namespace CloudBackup {
@@ -23,23 +45,27 @@ namespace CloudBackup {
   class CompressUtil
   {
     public:
-      // 将src文件中的内容压缩存储到dst文件中
-      static bool compress(const std::string &src, const std::string &dst) {
-        gzFile file = gzopen(dst.c_str(), "wb");
+      // 将src文件中的内容压缩存储到dst文件中, level为0-9的压缩级别, 默认使用zlib的默认级别
+      static bool compress(const std::string &src, const std::string &dst, int level = Z_DEFAULT_COMPRESSION) {
+        std::string mode = "wb";
+        if (level >= 0 && level <= 9) {
+          mode += static_cast<char>('0' + level);
+        }
+        gzFile file = gzopen(dst.c_str(), mode.c_str());
         if (file == NULL) {
-          std::cout << "open file " + dst + " failed!" << std::endl;
+          CB_LOG(ERROR, "compress.open_failed").str("path", dst);
           return false;
         }
         std::string buf;
         if (!MyUtil::readFile(src, buf)) {
-          std::cout << "data error!" << std::endl;
+          CB_LOG(ERROR, "compress.read_failed").str("path", src);
           gzclose(file);
           return false;
         }
 
         int ret = gzwrite(file, buf.c_str(), buf.length());
         if (ret == 0) {
-          std::cout << "compress " + dst + " failed!" << std::endl;
+          CB_LOG(ERROR, "compress.write_failed").str("path", dst);
           gzclose(file);
           return false;
         }
@@ -50,12 +76,12 @@ namespace CloudBackup {
       static bool decompress(const std::string &src, const std::string &dst) {
         gzFile file = gzopen(src.c_str(), "rb");
         if (file == NULL) {
-          std::cout << "open file " + src + " failed!" << std::endl;
+          CB_LOG(ERROR, "decompress.open_failed").str("path", src);
           return false;
         }
         std::ofstream fout(dst.c_str(), std::ios::binary);
         if (!fout.is_open()) {
-          std::cout << "open file " + dst + " failed!" << std::endl;
+          CB_LOG(ERROR, "decompress.open_failed").str("path", dst);
           gzclose(file);
           return false;
         }
@@ -65,139 +91,644 @@ namespace CloudBackup {
         while (ret == m_s_BufSize) {
           ret = gzread(file, buf, m_s_BufSize);
           if (ret < 0) {
-            std::cout << "decompress " + src + " failed!" << std::endl;
+            CB_LOG(ERROR, "decompress.read_failed").str("path", src);
             gzclose(file);
             return false;
           }
           fout.write(buf, ret);
         }
         gzclose(file);
+        fout.close();
+        if (!fout) {
+          CB_LOG(ERROR, "decompress.write_failed").str("path", dst);
+          return false;
+        }
         return true;
       }
+      // 把src压缩成一个gzip成员, 追加到.gz文件末尾后gzread会把多个成员依次解压成连续的内容
+      static bool compressData(const std::string &src, std::string &dst, int level = Z_DEFAULT_COMPRESSION) {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+          return false;
+        }
+        dst.resize(deflateBound(&strm, src.size()) + 32);
+        strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+        strm.avail_in = static_cast<uInt>(src.size());
+        strm.next_out = reinterpret_cast<Bytef *>(&dst[0]);
+        strm.avail_out = static_cast<uInt>(dst.size());
+        int ret = deflate(&strm, Z_FINISH);
+        dst.resize(strm.total_out);
+        deflateEnd(&strm);
+        return ret == Z_STREAM_END;
+      }
+      // 解压内存中的gzip数据(可以有多个成员), 结果追加到dst
+      static bool decompressData(const std::string &src, std::string &dst) {
+        return _inflate(src, [&dst](const char *data, size_t len) {
+          dst.append(data, len);
+        });
+      }
+      // 校验gzip数据(可以是多个成员)并算出解压后内容的XXH64和长度, 不保存解压结果
+      static bool hashData(const std::string &src, uint64_t &hash, size_t &size) {
+        XXHash64 state;
+        size = 0;
+        bool ok = _inflate(src, [&state, &size](const char *data, size_t len) {
+          state.update(data, len);
+          size += len;
+        });
+        hash = state.digest();
+        return ok;
+      }
     private:
+      // 逐块解压, 每块交给sink(data, len)
+      template <typename Sink>
+      static bool _inflate(const std::string &src, Sink sink) {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+          return false;
+        }
+        strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+        strm.avail_in = static_cast<uInt>(src.size());
+        char buf[m_s_BufSize];
+        int ret;
+        while (true) {
+          strm.next_out = reinterpret_cast<Bytef *>(buf);
+          strm.avail_out = m_s_BufSize;
+          ret = inflate(&strm, Z_NO_FLUSH);
+          if (ret != Z_OK && ret != Z_STREAM_END) {
+            break; // 数据损坏或者不完整
+          }
+          sink(buf, m_s_BufSize - strm.avail_out);
+          if (ret == Z_STREAM_END) {
+            if (strm.avail_in == 0) {
+              break;
+            }
+            inflateReset(&strm);
+          }
+        }
+        inflateEnd(&strm);
+        return ret == Z_STREAM_END;
+      }
       static const int m_s_BufSize = 8192;
   };
   const int CompressUtil::m_s_BufSize;
   // 文件信息管理类
+  // 索引由三部分组成: mmap的只读快照(m_snapshot), 正在合并进快照的冻结增量(m_frozen)和内存中的增量(m_delta),
+  // 查找时依次查增量, 冻结增量和快照, 前者中的项覆盖后者中的同名项
+  // 每次修改追加一行到文件信息表(日志), 日志过长时在锁内冻结增量并换用新的日志, 由后台线程不持锁把快照和冻结增量合并成新的快照,
+  // 完成后再持锁换上新快照并丢弃冻结增量, 合并期间的修改照常进入新的增量和日志
+  // 配置了segmentDir时, 小于segmentFileSize的文件存放在段文件中(SegmentStore), 索引记录它们在段中的位置
   class FileDataManager 
   {
+    public:
     enum status {
-      NORMAL, COMPRESSED
+      NORMAL, COMPRESSED, DELETED, // DELETED只出现在增量和日志中, 表示快照中的项已被删除
+      SEGMENT                      // 内容存放在段文件中, 不压缩
     };
     struct FileData
     {
       status m_fileStatus;
       time_t m_fileATime;
       size_t m_fileSize;
-      FileData(status sta = NORMAL, time_t atime = 0, size_t size = 0)
-        : m_fileStatus(sta), m_fileATime(atime), m_fileSize(size) {}
+      uint32_t m_segment; // 以下两项只对SEGMENT有意义: 段号和内容在段中的偏移
+      uint64_t m_offset;
+      uint64_t m_hash;    // 内容(解压后)的XXH64, 0表示未知(例如追加之后客户端没有给出整个文件的哈希), 由巡检补上
+      FileData(status sta = NORMAL, time_t atime = 0, size_t size = 0, uint32_t segment = 0, uint64_t offset = 0, uint64_t hash = 0)
+        : m_fileStatus(sta), m_fileATime(atime), m_fileSize(size), m_segment(segment), m_offset(offset), m_hash(hash) {}
+    };
+    // scan的过滤条件, 在持锁遍历时就地判断, 不满足的项不会交给visitor
+    struct ScanFilter
+    {
+      bool m_normalOnly;    // 只要未压缩的文件
+      time_t m_atimeBefore; // 只要索引中访问时间早于它的文件, 0表示不限
+      ScanFilter() : m_normalOnly(false), m_atimeBefore(0) {}
+      bool match(const FileData &data) const {
+        return (!m_normalOnly || data.m_fileStatus == NORMAL)
+          && (m_atimeBefore == 0 || data.m_fileATime < m_atimeBefore);
+      }
+    };
+    private:
+    typedef std::map<std::string, FileData> DeltaMap;
+    // 快照, 冻结增量和增量合并后的有序遍历, 跳过已删除的项
+    // path()直接指向快照的映射或增量的键, 不复制路径, 在索引被修改之前有效
+    class Iterator
+    {
+      public:
+        Iterator(const IndexSnapshot &snapshot, const DeltaMap &frozen, const DeltaMap &delta, const std::string &key)
+          : m_snapshot(snapshot), m_frozen(frozen), m_delta(delta) {
+          seek(key);
+        }
+        // 定位到第一个路径不小于key的项
+        void seek(const std::string &key) {
+          m_pos = m_snapshot.lowerBound(key);
+          m_fit = m_frozen.lower_bound(key);
+          m_it = m_delta.lower_bound(key);
+          _settle();
+        }
+        bool valid() const {
+          return m_valid;
+        }
+        boost::string_view path() const {
+          return m_path;
+        }
+        const FileData &data() const {
+          return m_data;
+        }
+        void next() {
+          _advance();
+          _settle();
+        }
+      private:
+        // 当前路径在哪几部分中出现, 各自前进一项
+        void _advance() {
+          if (m_inSnapshot) {
+            ++m_pos;
+          }
+          if (m_inFrozen) {
+            ++m_fit;
+          }
+          if (m_inDelta) {
+            ++m_it;
+          }
+        }
+        void _settle() {
+          for (;;) {
+            bool snap = m_pos < m_snapshot.size(), frozen = (m_fit != m_frozen.end()), delta = (m_it != m_delta.end());
+            m_valid = snap || frozen || delta;
+            if (!m_valid) {
+              return;
+            }
+            // 两个增量中较小的路径, 再与快照比较
+            const std::string *key = nullptr;
+            if (delta) {
+              key = &m_it->first;
+            }
+            if (frozen && (key == nullptr || m_fit->first < *key)) {
+              key = &m_fit->first;
+            }
+            int cmp = (snap && key != nullptr) ? m_snapshot.compare(m_pos, *key) : (snap ? -1 : 1);
+            m_inSnapshot = snap && cmp <= 0;
+            m_inFrozen = frozen && cmp >= 0 && m_fit->first == *key;
+            m_inDelta = delta && cmp >= 0 && m_it->first == *key;
+            if (m_inDelta || m_inFrozen) {
+              const auto &item = m_inDelta ? *m_it : *m_fit;
+              if (item.second.m_fileStatus == DELETED) {
+                _advance();
+                continue;
+              }
+              m_path = item.first;
+              m_data = item.second;
+            } else {
+              const IndexSnapshot::Entry &entry = m_snapshot.entry(m_pos);
+              m_path = boost::string_view(m_snapshot.path(m_pos), entry.m_pathLen);
+              m_data = FileData(static_cast<status>(entry.m_status), entry.m_atime, entry.m_size, entry.m_segment, entry.m_offset, entry.m_hash);
+            }
+            return;
+          }
+        }
+      private:
+        const IndexSnapshot &m_snapshot;
+        const DeltaMap &m_frozen;
+        const DeltaMap &m_delta;
+        size_t m_pos;
+        DeltaMap::const_iterator m_fit;
+        DeltaMap::const_iterator m_it;
+        bool m_valid;
+        bool m_inSnapshot; // 当前项来自哪几部分(同名时都要前进)
+        bool m_inFrozen;
+        bool m_inDelta;
+        boost::string_view m_path;
+        FileData m_data;
     };
     public:
-    FileDataManager() {
-      m_filename = MyUtil::getConfig("./CBackup.cnf", "CloudServer")["srcLog"];
-      // 初始化读写锁
+    // 目录项, 直接由索引生成, 不访问磁盘
+    struct DirEntry
+    {
+      std::string m_name;
+      bool m_isDir;
+      bool m_isCompressed;
+      time_t m_fileATime;
+      size_t m_fileSize;
+      DirEntry() : m_isDir(false), m_isCompressed(false), m_fileATime(0), m_fileSize(0) {}
+    };
+    FileDataManager() : m_segmentFileSize(0), m_startTime(time(nullptr)) {
+      std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudServer");
+      m_filename = config["srcLog"];
+      _loadData();
+      _openSegments(config["segmentDir"], strtoull(config["segmentFileSize"].c_str(), nullptr, 10),
+          strtoull(config["segmentSize"].c_str(), nullptr, 10));
+      // cacheSize: 热点小文件的内存缓存大小, cacheFileSize: 能进入缓存的最大文件, 都可以带K/M/G后缀
+      size_t cacheFileSize = m_s_CacheFileSize;
+      if (!config["cacheFileSize"].empty()) {
+        cacheFileSize = static_cast<size_t>(RateLimiter::parseRate(config["cacheFileSize"]));
+      }
+      m_cache.configure(static_cast<size_t>(RateLimiter::parseRate(config["cacheSize"])), cacheFileSize);
+      // versionDir: 历史版本的存放目录, 为空时覆盖上传不保留旧版本
+      if (!config["versionDir"].empty() && !m_versions.open(config["versionDir"])) {
+        CB_LOG(ERROR, "version.open_failed").str("path", config["versionDir"]);
+      }
+    }
+    // 使用指定的文件信息表, 不读取配置文件, 不使用段存储
+    explicit FileDataManager(const std::string &filename)
+      : m_filename(filename), m_segmentFileSize(0), m_startTime(time(nullptr)) {
       _loadData();
     }
     ~FileDataManager() {
-      // 销毁读写锁
-      _storageData();
+      // 退出时合并一次, 下次启动不需要重放日志
+      std::unique_lock<MeteredMutex> lock(m_mutex);
+      _compact(lock);
+      if (m_compactor.joinable()) {
+        m_compactor.join();
+      }
     }
     bool isCompressedFile(const std::string &filepath) {
-      if (!isExistFile(filepath)) {
-        return false;
-      }
-      return m_map[filepath].m_fileStatus == COMPRESSED;
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      return _find(filepath, data) && data.m_fileStatus == COMPRESSED;
     }
     bool isExistFile(const std::string &filepath) {
-      return m_map.find(filepath) != m_map.end();
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      return _find(filepath, data);
     }
-    bool insertData(const std::string &filepath) {
+    // 按文件的实际状态登记, hash为内容的XXH64
+    bool insertData(const std::string &filepath, uint64_t hash = 0) {
       FileData data;
-      m_mutex.lock();
       if (!getFileData(filepath, data)) {
-        m_mutex.unlock();
-        std::cout << filepath << " insert error" << std::endl;
+        CB_LOG(WARN, "index.insert_failed").str("path", filepath);
         return false;
       }
-      m_map[filepath] = data;
-      m_mutex.unlock();
-      _storageData();
+      data.m_hash = hash;
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      _set(filepath, data);
+      return true;
+    }
+    bool findData(const std::string &filepath, FileData &data) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      return _find(filepath, data);
+    }
+    // 直接写入一项, 用于文件的实际状态无法从stat得到的情况(例如客户端已经压缩过的上传)
+    bool insertData(const std::string &filepath, const FileData &data) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      _set(filepath, data);
+      return true;
+    }
+    // 一次写入多项, 只加一次锁, 日志只刷新一次, 用于批量上传
+    bool insertData(const std::vector<std::pair<std::string, FileData>> &items) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      for (const auto &item : items) {
+        _set(item.first, item.second, false);
+      }
+      _flush();
       return true;
     }
     bool deleteData(const std::string &filepath) {
-      if (!isExistFile(filepath)) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data)) {
         return false;
       }
-      m_mutex.lock();
-      m_map.erase(m_map.find(filepath));
-      m_mutex.unlock();
-      _storageData();
+      data.m_fileStatus = DELETED;
+      _set(filepath, data);
       return true;
     }
     bool changeData(const std::string &filepath) {
-      if (!isExistFile(filepath)) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data)) {
         return false;
       }
-      if (isCompressedFile(filepath)) {
-        m_mutex.lock();
-        m_map[filepath].m_fileStatus = NORMAL;
-        m_mutex.unlock();
-      } else {
-        m_mutex.lock();
-        m_map[filepath].m_fileStatus = COMPRESSED;
-        m_mutex.unlock();
+      data.m_fileStatus = (data.m_fileStatus == COMPRESSED) ? NORMAL : COMPRESSED;
+      _set(filepath, data);
+      return true;
+    }
+    // 把NORMAL/COMPRESSED改为sta, 已经是sta时不修改(并发下载同一个冷文件时各自解压, 只有一次生效)
+    bool changeData(const std::string &filepath, status sta) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data) || (data.m_fileStatus != NORMAL && data.m_fileStatus != COMPRESSED)) {
+        return false;
+      }
+      if (data.m_fileStatus != sta) {
+        data.m_fileStatus = sta;
+        _set(filepath, data);
+      }
+      return true;
+    }
+    // 登记之后, 向客户端返回成功之前调用: 索引日志和dirs(有文件rename进来的目录)落盘
+    bool sync(const std::vector<std::string> &dirs = std::vector<std::string>()) {
+      std::vector<std::string> paths(dirs);
+      paths.push_back(m_filename);
+      if (!DurableFile::syncPaths(paths)) {
+        CB_LOG(ERROR, "index.sync_failed").str("path", m_filename).num("errno", errno);
+        return false;
+      }
+      return true;
+    }
+    // 目录列表的验证器: 目录下(含子目录)任何一项被修改时版本加1并记录修改时间, 返回"启动时间-版本"
+    // 只在内存中计数, 重启后没有修改过的目录版本为0, 修改时间取启动时间(不早于重启前的任何修改)
+    std::string dirTag(const std::string &dirpath, time_t &mtime) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      std::string dir = dirpath;
+      while (!dir.empty() && dir.back() == '/') {
+        dir.pop_back();
+      }
+      uint64_t version = 0;
+      mtime = m_startTime;
+      auto it = m_dirVersions.find(IndexSnapshot::hash(dir.data(), dir.size()));
+      if (it != m_dirVersions.end()) {
+        version = it->second.m_version;
+        mtime = it->second.m_mtime;
+      }
+      char tag[48];
+      snprintf(tag, sizeof(tag), "%llx-%llx", static_cast<unsigned long long>(m_startTime), static_cast<unsigned long long>(version));
+      return tag;
+    }
+    // 巡检算出了以前未知的哈希时记录下来; 巡检期间文件被修改过(与old不同)时不记录
+    bool setHash(const std::string &filepath, const FileData &old, uint64_t hash) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data) || !_sameContent(data, old)) {
+        return false;
+      }
+      data.m_hash = hash;
+      _set(filepath, data);
+      return true;
+    }
+    // 索引中filepath的内容仍是old(没有被上传, 追加, 压缩或解压改变)
+    // 在lockPath之内调用, 用于不持锁做完耗时的IO之后确认结果仍然有效
+    bool unchanged(const std::string &filepath, const FileData &old) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      return _find(filepath, data) && _sameContent(data, old);
+    }
+    // 同一路径的上传, 追加, 压缩和解压互斥: 从检查索引, 替换或追加文件, 登记索引到删除旧文件, 中间不会被另一个修改打断
+    // 按路径的哈希分成m_s_PathLocks把锁; 持有时可以调用其它成员函数(与m_mutex无关), 但不能再锁另一个路径
+    std::unique_lock<std::mutex> lockPath(const std::string &filepath) {
+      return std::unique_lock<std::mutex>(m_pathLocks[_pathLock(filepath)]);
+    }
+    // 一次锁住多个路径(批量上传), 按锁的顺序加锁, 不会与其它请求死锁
+    std::vector<std::unique_lock<std::mutex>> lockPaths(const std::vector<std::string> &paths) {
+      std::set<size_t> indexes;
+      for (const std::string &path : paths) {
+        indexes.insert(_pathLock(path));
+      }
+      std::vector<std::unique_lock<std::mutex>> locks;
+      for (size_t i : indexes) {
+        locks.emplace_back(m_pathLocks[i]);
+      }
+      return locks;
+    }
+    // 这么大的文件应当存放在段中
+    bool useSegment(size_t size) const {
+      return size < m_segmentFileSize && m_segments.enabled();
+    }
+    // 把内容追加到段中, data为登记到索引时使用的项; 不修改索引, 由调用者在syncSegment之后登记(可以和其他项一起批量登记)
+    bool writeSegment(const std::string &filepath, const std::string &content, FileData &data) {
+      uint32_t segment;
+      uint64_t offset;
+      if (!m_segments.append(filepath, content.data(), content.size(), segment, offset)) {
+        CB_LOG(ERROR, "segment.write_failed").str("path", filepath).num("errno", errno);
+        return false;
+      }
+      data = FileData(SEGMENT, time(nullptr), content.size(), segment, offset, XXHash64::hash(content));
+      return true;
+    }
+    bool syncSegment(uint32_t segment) {
+      if (!m_segments.sync(segment)) {
+        CB_LOG(ERROR, "segment.sync_failed").num("segment", segment).num("errno", errno);
+        return false;
+      }
+      return true;
+    }
+    bool readSegment(const FileData &data, std::string &dst) {
+      if (!m_segments.read(data.m_segment, data.m_offset, data.m_fileSize, dst)) {
+        CB_LOG(ERROR, "segment.read_failed").num("segment", data.m_segment).num("offset", data.m_offset);
+        return false;
+      }
+      return true;
+    }
+    // 内容可以放进内存缓存: 未压缩, 不超过cacheFileSize
+    bool cacheable(const FileData &data) const {
+      return m_cache.enabled() && data.m_fileSize <= m_cache.maxObject()
+        && (data.m_fileStatus == NORMAL || data.m_fileStatus == SEGMENT);
+    }
+    // data为刚从索引中查到的项, 缓存的内容属于同一版本时返回, 否则返回空; 不加索引的锁
+    std::shared_ptr<const std::string> cachedContent(const std::string &filepath, const FileData &data) {
+      return m_cache.get(filepath, _version(data));
+    }
+    // 把按data读出的内容放进缓存; 持有索引的锁确认索引仍是data, 与_set中的失效互斥, 读取期间被覆盖的旧内容不会放进去
+    void cacheContent(const std::string &filepath, const FileData &data, std::shared_ptr<const std::string> content) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData now;
+      if (_find(filepath, now) && _version(now) == _version(data)) {
+        m_cache.put(filepath, _version(data), std::move(content));
+      }
+    }
+    // 在缓存中的文件一定是最近频繁访问的, 压缩模块不压缩它们(命中缓存的下载不会更新文件的访问时间)
+    bool isCached(const std::string &filepath) {
+      return m_cache.contains(filepath);
+    }
+    void cacheStats(size_t &count, size_t &bytes) {
+      m_cache.stats(count, bytes);
+    }
+    // 上传即将替换filepath之前调用: 把当前内容保存为一个历史版本, 需要落盘的路径追加到syncs
+    // 内容与新上传的相同(hash相同)时不保存; 没有当前内容或者没有启用版本时什么也不做
+    bool preserveVersion(const std::string &filepath, uint64_t hash, std::vector<std::string> &syncs) {
+      static Counter &failed = Metrics::counter("cloudbackup_versions_preserve_failed_total",
+          "Overwrites that went ahead without keeping the old content as a version");
+      if (!m_versions.enabled()) {
+        return true;
+      }
+      // 与压缩模块并发时文件可能刚被压缩或解压, 按新的状态再试一次
+      for (int retry = 0; retry < 2; ++retry) {
+        FileData data;
+        if (!findData(filepath, data) || (hash != 0 && data.m_hash == hash)) {
+          return true;
+        }
+        VersionStore::Version version;
+        version.m_mtime = data.m_fileATime;
+        version.m_replaced = time(nullptr);
+        version.m_size = data.m_fileSize;
+        version.m_hash = data.m_hash;
+        if (data.m_fileStatus == SEGMENT) {
+          std::string content;
+          if (readSegment(data, content) && m_versions.preserveContent(filepath, content, version, syncs)) {
+            return true;
+          }
+        } else if (m_versions.preserveFile(filepath, data.m_fileStatus == COMPRESSED ? filepath + ".gz" : filepath,
+              data.m_fileStatus == COMPRESSED, version, syncs)) {
+          return true;
+        }
+      }
+      failed.add(1);
+      return false;
+    }
+    // 单个文件的上传: 保存的版本立即落盘
+    bool preserveVersion(const std::string &filepath, uint64_t hash) {
+      std::vector<std::string> syncs;
+      return preserveVersion(filepath, hash, syncs) && (syncs.empty() || DurableFile::syncPaths(syncs));
+    }
+    VersionStore &versions() {
+      return m_versions;
+    }
+    // 回收段: 有效数据比例低于m_s_SegmentLivePercent的段, 把仍被索引引用的记录复制到活动段, 然后删除整个段
+    // 复制出的记录和指向它们的新快照都落盘之后才删除旧段, 中途崩溃时旧段仍然完整; 返回回收的段数
+    size_t compactSegments() {
+      static Counter &reclaimed = Metrics::counter("cloudbackup_segment_compactions_total", "Segments reclaimed by compaction", "");
+      static Counter &moved = Metrics::counter("cloudbackup_segment_moved_bytes_total", "Live bytes copied out of compacted segments", "");
+      std::vector<uint32_t> garbage = m_segments.garbageSegments(m_s_SegmentLivePercent), done;
+      std::set<uint32_t> written;
+      std::string filepath;
+      for (uint32_t segment : garbage) {
+        bool ok = m_segments.forEach(segment, [&](boost::string_view path, uint64_t offset, const std::string &content) {
+          filepath.assign(path.data(), path.size());
+          FileData data;
+          {
+            std::lock_guard<MeteredMutex> lock(m_mutex);
+            if (!_refers(filepath, segment, offset, data)) {
+              return true;
+            }
+          }
+          uint32_t newSegment;
+          uint64_t newOffset;
+          if (!m_segments.append(path, content.data(), content.size(), newSegment, newOffset)) {
+            return false;
+          }
+          written.insert(newSegment);
+          // 复制期间文件可能被重新上传, 此时复制出的记录是垃圾
+          std::lock_guard<MeteredMutex> lock(m_mutex);
+          if (_refers(filepath, segment, offset, data)) {
+            data.m_segment = newSegment;
+            data.m_offset = newOffset;
+            _set(filepath, data);
+            moved.add(content.size());
+          }
+          return true;
+        });
+        if (ok) {
+          done.push_back(segment);
+        }
       }
-      _storageData();
+      if (done.empty()) {
+        return 0;
+      }
+      for (uint32_t segment : written) {
+        if (!m_segments.sync(segment, true)) {
+          CB_LOG(ERROR, "segment.sync_failed").num("segment", segment).num("errno", errno);
+          return 0;
+        }
+      }
+      {
+        std::unique_lock<MeteredMutex> lock(m_mutex);
+        _compact(lock);
+      }
+      for (uint32_t segment : done) {
+        m_segments.remove(segment);
+        reclaimed.add(1);
+      }
+      CB_LOG(INFO, "segment.compacted").num("segments", done.size());
+      return done.size();
+    }
+    // 段数, 段文件总字节数, 其中仍被引用的字节数
+    void segmentStats(size_t &count, uint64_t &bytes, uint64_t &live) {
+      m_segments.stats(count, bytes, live);
+    }
+    // 索引中的文件数
+    size_t size() {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      return m_count;
+    }
+    // 分批遍历索引: 从cursor(包含)开始按路径顺序检查至多batch项, 对满足filter的项调用visit(path, data)
+    // 只在一批之内持锁, visit不能再调用FileDataManager; path只在visit内有效
+    // 返回后cursor是下一批的起点, 返回false表示已经遍历完; 空cursor表示从头开始
+    // 两批之间的修改: cursor之后的变化会被看到, 之前的不会, 每个未被修改的项恰好访问一次
+    template <typename Visitor>
+    bool scan(std::string &cursor, size_t batch, const ScanFilter &filter, Visitor visit) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      Iterator it(m_snapshot, m_frozen, m_delta, cursor);
+      for (size_t n = 0; it.valid() && n < batch; ++n, it.next()) {
+        if (filter.match(it.data())) {
+          visit(it.path(), it.data());
+        }
+      }
+      if (!it.valid()) {
+        cursor.clear();
+        return false;
+      }
+      cursor.assign(it.path().data(), it.path().size());
       return true;
     }
     bool getAllList(std::vector<std::string> &fileList) {
       fileList.clear();
-      m_mutex.lock();
-      for (auto &it : m_map) {
-        fileList.push_back(it.first);
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      for (Iterator it(m_snapshot, m_frozen, m_delta, ""); it.valid(); it.next()) {
+        fileList.emplace_back(it.path().data(), it.path().size());
       }
-      m_mutex.unlock();
       return true;
     }
+    // 获取目录下的子目录和文件(全路径), 子目录在前, 各自按名称排序
     bool getDirList(const std::string &dirpath, std::vector<std::string> &fileList) {
       fileList.clear();
-      if (!boost::filesystem::is_directory(dirpath)) {
-        return false;
+      std::string dir = dirpath, next;
+      if (!dir.empty() && dir.back() == '/') {
+        dir.pop_back();
       }
-      std::string filepath;
+      std::vector<DirEntry> entries;
       std::vector<std::string> tmpList;
-      boost::filesystem::directory_iterator iter_dir(dirpath), iter_file(dirpath), iter_end;
-      m_mutex.lock();
-      for (; iter_dir != iter_end; ++iter_dir) {
-        filepath = iter_dir->path().string();
-        if (boost::filesystem::is_directory(filepath)) {
-          fileList.push_back(filepath);
-        }
+      getDirPage(dir, "", 0, entries, next);
+      for (auto &entry : entries) {
+        (entry.m_isDir ? fileList : tmpList).push_back(dir + "/" + entry.m_name);
       }
       sort(fileList.begin(), fileList.end());
-      for (; iter_file != iter_end; ++iter_file) {
-        filepath = iter_file->path().string();
-        if (m_map.find(filepath) != m_map.end() 
-            && find(tmpList.begin(), tmpList.end(), filepath) == tmpList.end()) {
-          tmpList.push_back(filepath);
-        } else if (filepath.rfind(".gz") == filepath.size() - 3) {
-          filepath.erase(filepath.end() - 3, filepath.end());
-          if (m_map.find(filepath) != m_map.end() 
-              && find(tmpList.begin(), tmpList.end(), filepath) == tmpList.end()) {
-            tmpList.push_back(filepath);
-          }
-        }
-      }
       sort(tmpList.begin(), tmpList.end());
       fileList.insert(fileList.end(), tmpList.begin(), tmpList.end());
-      m_mutex.unlock();
+      return true;
+    }
+    // 从cursor处开始获取目录下至多limit(0表示不限)个目录项, 按索引顺序排列
+    // 子目录由索引中路径的中间部分推导出来, 遇到子目录时直接跳过它的整个子树
+    // nextCursor为下一页的起点, 为空表示已经没有更多的目录项
+    bool getDirPage(const std::string &dirpath, const std::string &cursor, size_t limit,
+        std::vector<DirEntry> &entries, std::string &nextCursor) {
+      entries.clear();
+      nextCursor.clear();
+      std::string prefix = dirpath;
+      if (prefix.empty() || prefix.back() != '/') {
+        prefix += '/';
+      }
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      Iterator it = _seekCursor(prefix, cursor);
+      while (it.valid() && it.path().starts_with(prefix)) {
+        if (limit != 0 && entries.size() == limit) {
+          const DirEntry &last = entries.back();
+          nextCursor = last.m_isDir ? last.m_name + "/" : last.m_name;
+          break;
+        }
+        DirEntry entry;
+        boost::string_view path = it.path();
+        size_t pos = path.find('/', prefix.size());
+        if (pos == boost::string_view::npos) {
+          entry.m_name.assign(path.data() + prefix.size(), path.size() - prefix.size());
+          entry.m_isCompressed = (it.data().m_fileStatus == COMPRESSED);
+          entry.m_fileATime = it.data().m_fileATime;
+          entry.m_fileSize = it.data().m_fileSize;
+          it.next();
+        } else {
+          // '0'是'/'的下一个字符, 以此跳过该子目录下的所有路径
+          entry.m_name.assign(path.data() + prefix.size(), pos - prefix.size());
+          entry.m_isDir = true;
+          it.seek(std::string(path.data(), pos) + '0');
+        }
+        entries.push_back(std::move(entry));
+      }
       return true;
     }
     bool getFileData(const std::string &filepath, FileData &res) {
       struct stat buf;
       int ret = stat(filepath.c_str(), &buf);
       if (ret < 0) {
-        std::cout << "get " << filepath << " stat error" << std::endl;
+        CB_LOG(WARN, "index.stat_failed").str("path", filepath).num("errno", errno);
         return false;
       }
       res.m_fileStatus = NORMAL;
@@ -206,18 +737,253 @@ namespace CloudBackup {
       return true;
     }
     std::string getAtime(std::string filepath) {
-      if (!isExistFile(filepath)) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data)) {
         return "-error data-";
       }
-      return ctime(&m_map[filepath].m_fileATime);
+      return MyUtil::formatTime(data.m_fileATime);
     }
     std::string getFileSize(std::string filepath) {
-      if (!isExistFile(filepath)) {
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      FileData data;
+      if (!_find(filepath, data)) {
         return "-error data-";
       }
-      return std::to_string(m_map[filepath].m_fileSize);
+      return std::to_string(data.m_fileSize);
     }
     private:
+    // 定位到cursor之后的第一个索引项, 以'/'结尾的cursor表示子目录
+    Iterator _seekCursor(const std::string &prefix, const std::string &cursor) {
+      if (cursor.empty()) {
+        return Iterator(m_snapshot, m_frozen, m_delta, prefix);
+      }
+      if (cursor.back() == '/') {
+        return Iterator(m_snapshot, m_frozen, m_delta, prefix + cursor.substr(0, cursor.size() - 1) + '0');
+      }
+      Iterator it(m_snapshot, m_frozen, m_delta, prefix + cursor);
+      if (it.valid() && it.path() == prefix + cursor) {
+        it.next();
+      }
+      return it;
+    }
+    static bool _sameContent(const FileData &a, const FileData &b) {
+      return a.m_fileStatus == b.m_fileStatus && a.m_fileSize == b.m_fileSize && a.m_segment == b.m_segment
+        && a.m_offset == b.m_offset && a.m_hash == b.m_hash;
+    }
+    static size_t _pathLock(const std::string &filepath) {
+      return XXHash64::hash(filepath) % m_s_PathLocks;
+    }
+    // 以下函数在持有m_mutex时调用
+    // 依次查增量, 冻结增量和快照
+    bool _find(const std::string &filepath, FileData &data) const {
+      for (const DeltaMap *delta : { &m_delta, &m_frozen }) {
+        auto it = delta->find(filepath);
+        if (it != delta->end()) {
+          data = it->second;
+          return data.m_fileStatus != DELETED;
+        }
+      }
+      size_t i = m_snapshot.find(filepath);
+      if (i == IndexSnapshot::npos) {
+        return false;
+      }
+      const IndexSnapshot::Entry &entry = m_snapshot.entry(i);
+      data = FileData(static_cast<status>(entry.m_status), entry.m_atime, entry.m_size, entry.m_segment, entry.m_offset, entry.m_hash);
+      return true;
+    }
+    // 索引中的filepath仍然指向段中的这条记录
+    bool _refers(const std::string &filepath, uint32_t segment, uint64_t offset, FileData &data) const {
+      return _find(filepath, data) && data.m_fileStatus == SEGMENT && data.m_segment == segment && data.m_offset == offset;
+    }
+    // 修改一项并写入日志, data为DELETED时删除; flush为false时由调用者在写完一批之后调用_flush
+    void _set(const std::string &filepath, const FileData &data, bool flush = true) {
+      FileData old;
+      bool existed = _find(filepath, old);
+      bool deleted = (data.m_fileStatus == DELETED);
+      if (deleted && m_frozen.count(filepath) == 0 && m_snapshot.find(filepath) == IndexSnapshot::npos) {
+        m_delta.erase(filepath); // 冻结增量和快照中都没有, 不需要留下删除标记
+      } else {
+        m_delta[filepath] = data;
+      }
+      _count(existed, deleted);
+      if (existed && old.m_fileStatus == SEGMENT) {
+        m_segments.addLive(old.m_segment, filepath, old.m_fileSize, false);
+      }
+      if (data.m_fileStatus == SEGMENT) {
+        m_segments.addLive(data.m_segment, filepath, data.m_fileSize, true);
+      }
+      m_journal << filepath << ' ' << data.m_fileStatus << ' ' << data.m_fileATime << ' ' << data.m_fileSize;
+      if (data.m_fileStatus == SEGMENT) {
+        m_journal << ' ' << data.m_segment << ' ' << data.m_offset;
+      }
+      m_journal << ' ' << data.m_hash << '\n';
+      _touchDirs(filepath);
+      m_cache.erase(filepath);
+      if (flush) {
+        _flush();
+      }
+      if (++m_journalLines > _compactThreshold()) {
+        _compactAsync();
+      }
+    }
+    // 缓存项的版本: 索引项的任何变化(上传, 追加, 段回收, 哈希补上)都会改变
+    static uint64_t _version(const FileData &data) {
+      uint64_t fields[] = { static_cast<uint64_t>(data.m_fileStatus), static_cast<uint64_t>(data.m_fileATime),
+        data.m_fileSize, data.m_segment, data.m_offset, data.m_hash };
+      return XXHash64::hash(fields, sizeof(fields));
+    }
+    // 路径的各级上级目录的版本加1; 以目录路径的哈希为键, 冲突只会使无关目录的版本多加1
+    void _touchDirs(const std::string &filepath) {
+      time_t now = time(nullptr);
+      for (size_t pos = filepath.rfind('/'); pos != std::string::npos && pos > 0; pos = filepath.rfind('/', pos - 1)) {
+        DirVersion &dir = m_dirVersions[IndexSnapshot::hash(filepath.data(), pos)];
+        ++dir.m_version;
+        dir.m_mtime = now;
+      }
+    }
+    void _flush() {
+      m_journal.flush();
+      if (!m_journal) {
+        CB_LOG(ERROR, "index.journal_failed").str("path", m_filename);
+        Logger::flush();
+        abort();
+      }
+    }
+    void _count(bool existed, bool deleted) {
+      if (!existed && !deleted) {
+        ++m_count;
+      } else if (existed && deleted) {
+        --m_count;
+      }
+    }
+    // 日志行数超过max(m_s_CompactMin, 快照项数/m_s_CompactRatio)时合并, 合并的开销分摊到每次修改上是常数, 且不在请求线程中
+    size_t _compactThreshold() const {
+      size_t threshold = m_snapshot.size() / m_s_CompactRatio;
+      return threshold > m_s_CompactMin ? threshold : m_s_CompactMin;
+    }
+    // 后台合并, 在请求线程中只做冻结和换日志; 已经有合并在进行时不做任何事, 之后的修改留在增量中由下一次合并处理
+    void _compactAsync() {
+      if (m_compacting) {
+        return;
+      }
+      _freeze();
+      _startBuild();
+    }
+    // 同步合并, 用于退出时和段回收(新快照落盘之后才能删除旧段): 等进行中的合并结束, 再合并当前的增量
+    // 重建快照期间不持锁, 返回时新快照已经落盘
+    void _compact(std::unique_lock<MeteredMutex> &lock) {
+      m_compacted.wait(lock, [this]() { return !m_compacting; });
+      if (m_journalLines == 0) {
+        return;
+      }
+      _freeze();
+      m_compacting = true;
+      lock.unlock();
+      _build();
+      lock.lock();
+      _install();
+    }
+    // 冻结增量并换用新的日志: 旧日志落盘后改名为m_frozenName, 合并完成之前重启时先重放它
+    // 改名之前落盘, 已经写入旧日志的修改不会因为调用者随后只对新日志sync而丢失
+    void _freeze() {
+      m_journal.close();
+      if (!DurableFile::syncPath(m_filename) || rename(m_filename.c_str(), m_frozenName.c_str()) != 0) {
+        CB_LOG(ERROR, "index.compact_failed").str("path", m_filename).num("errno", errno);
+        Logger::flush();
+        abort();
+      }
+      m_journal.open(m_filename, std::ios::trunc);
+      if (!m_journal.is_open() || !DurableFile::syncPath(_dirName(m_filename))) {
+        CB_LOG(ERROR, "index.journal_failed").str("path", m_filename);
+        Logger::flush();
+        abort();
+      }
+      m_frozen.swap(m_delta);
+      m_journalLines = 0;
+    }
+    // 在后台线程中重建快照; 上一个线程已经换上了快照, 正在退出或已经退出
+    void _startBuild() {
+      if (m_compactor.joinable()) {
+        m_compactor.join();
+      }
+      m_compacting = true;
+      m_compactor = std::thread([this]() {
+        _build();
+        std::lock_guard<MeteredMutex> lock(m_mutex);
+        _install();
+      });
+    }
+    // 把快照和冻结增量合并成新的快照并落盘, 不持锁: 合并期间只有_install会修改它们
+    // 先写到临时文件再rename, 已经打开的旧快照仍然可以读
+    void _build() {
+      IndexSnapshot::Writer writer;
+      DeltaMap none;
+      for (Iterator it(m_snapshot, m_frozen, none, ""); it.valid(); it.next()) {
+        const FileData &data = it.data();
+        writer.add(it.path(), data.m_fileStatus, data.m_fileATime, data.m_fileSize, data.m_segment, data.m_offset, data.m_hash);
+      }
+      if (!writer.finish(m_snapshotName) || !DurableFile::syncPath(_dirName(m_snapshotName))) {
+        CB_LOG(ERROR, "index.compact_failed").str("path", m_snapshotName);
+        Logger::flush();
+        abort();
+      }
+    }
+    // 换上新快照, 丢弃冻结增量和冻结的日志; 新快照已经落盘, 在删除冻结的日志之前崩溃时重放它得到的结果相同
+    void _install() {
+      if (!m_snapshot.open(m_snapshotName)) {
+        CB_LOG(ERROR, "index.compact_failed").str("path", m_snapshotName);
+        Logger::flush();
+        abort();
+      }
+      m_frozen.clear();
+      unlink(m_frozenName.c_str());
+      m_compacting = false;
+      m_compacted.notify_all();
+    }
+    static std::string _dirName(const std::string &filename) {
+      std::string dir = boost::filesystem::path(filename).parent_path().string();
+      return dir.empty() ? "." : dir;
+    }
+    // 把一个日志文件重放到delta中, 返回有效的行数; 最后一行不完整时torn为true, valid为之前完整的行的总长度
+    // 每行: 路径 状态 访问时间 大小 [段号 偏移] [哈希], SEGMENT的行才有段号和偏移, 旧版本的行没有哈希
+    size_t _replay(std::ifstream &fin, DeltaMap &delta, uint64_t &valid, bool &torn) {
+      int flag;
+      std::string filepath, line;
+      FileData tmpdata, old;
+      size_t lines = 0;
+      valid = 0;
+      torn = false;
+      while (std::getline(fin, line)) {
+        // 没有换行符的最后一行是崩溃时写了一半的, 丢弃
+        if (fin.eof()) {
+          torn = true;
+          break;
+        }
+        valid += line.size() + 1;
+        std::istringstream ss(line);
+        if (!(ss >> filepath >> flag >> tmpdata.m_fileATime >> tmpdata.m_fileSize)) {
+          CB_LOG(WARN, "index.journal_bad_line").str("line", line);
+          continue;
+        }
+        tmpdata.m_fileStatus = static_cast<status>(flag);
+        tmpdata.m_segment = 0;
+        tmpdata.m_offset = 0;
+        if (tmpdata.m_fileStatus == SEGMENT && !(ss >> tmpdata.m_segment >> tmpdata.m_offset)) {
+          CB_LOG(WARN, "index.journal_bad_line").str("line", line);
+          continue;
+        }
+        if (!(ss >> tmpdata.m_hash)) {
+          tmpdata.m_hash = 0;
+        }
+        bool existed = _find(filepath, old);
+        bool deleted = (tmpdata.m_fileStatus == DELETED);
+        delta[filepath] = tmpdata;
+        _count(existed, deleted);
+        ++lines;
+      }
+      return lines;
+    }
     void _loadData() {
       if (!boost::filesystem::exists(m_filename)) {
         boost::filesystem::create_directories(boost::filesystem::path(m_filename));
@@ -225,37 +991,99 @@ namespace CloudBackup {
       std::ifstream fin;
       fin.open(m_filename);
       if (!fin.is_open()) {
-        std::cout << "open file " << m_filename << " error!" << std::endl;
+        CB_LOG(ERROR, "index.load_failed").str("path", m_filename);
+        Logger::flush();
         abort();
       }
-      int flag;
-      std::string filepath;
-      FileData tmpdata;
-      m_mutex.lock();
-      while (fin >> filepath >> flag >> tmpdata.m_fileATime >> tmpdata.m_fileSize) {
-        tmpdata.m_fileStatus = (flag == 0) ? NORMAL : COMPRESSED;
-        m_map[filepath] = tmpdata;
-      }
-      m_mutex.unlock();
-    }
-    void _storageData() {
-      std::ofstream fout;
-      fout.open(m_filename);
-      if (!fout.is_open()) {
-        std::cout << "open file " << m_filename << " error!" << std::endl;
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      m_snapshotName = m_filename + ".idx";
+      m_frozenName = m_filename + ".frozen";
+      m_snapshot.open(m_snapshotName);
+      m_count = m_snapshot.size();
+      // 重放日志, 旧版本的文件信息表就是一份每个文件一行的日志
+      // 上次的合并没有完成时还有冻结的日志, 它比当前的日志旧, 先重放到冻结增量中, 稍后在后台重新合并
+      uint64_t valid;
+      bool torn;
+      std::ifstream frozen(m_frozenName);
+      if (frozen.is_open()) {
+        _replay(frozen, m_frozen, valid, torn);
+        m_compacting = true;
+      }
+      m_journalLines = _replay(fin, m_delta, valid, torn);
+      fin.close();
+      // 截掉崩溃时写了一半的最后一行, 之后追加的行不会接在它后面
+      if (torn && truncate(m_filename.c_str(), valid) != 0) {
+        CB_LOG(ERROR, "index.load_failed").str("path", m_filename).num("errno", errno);
+        Logger::flush();
+        abort();
+      }
+      m_journal.open(m_filename, std::ios::app);
+      if (!m_journal.is_open()) {
+        CB_LOG(ERROR, "index.load_failed").str("path", m_filename);
+        Logger::flush();
         abort();
       }
-      m_mutex.lock();
-      for (auto &it : m_map) {
-        fout << it.first << ' ' << ((it.second.m_fileStatus == NORMAL) ? 0 : 1) 
-          << ' ' << it.second.m_fileATime << ' ' << it.second.m_fileSize << std::endl;
+      if (m_compacting) {
+        _startBuild();
+      } else if (m_journalLines > _compactThreshold()) {
+        _compactAsync();
+      }
+    }
+    // 打开段存储, 并按索引统计各段的有效字节数
+    // 只配置了segmentDir而segmentFileSize为0时仍然可以读取已有的段, 新文件不再放进段中
+    void _openSegments(const std::string &dir, uint64_t fileSize, uint64_t segmentSize) {
+      if (dir.empty()) {
+        return;
+      }
+      if (!m_segments.open(dir, segmentSize)) {
+        CB_LOG(ERROR, "segment.open_failed").str("path", dir);
+        return;
+      }
+      m_segmentFileSize = fileSize;
+      std::lock_guard<MeteredMutex> lock(m_mutex);
+      for (Iterator it(m_snapshot, m_frozen, m_delta, ""); it.valid(); it.next()) {
+        if (it.data().m_fileStatus == SEGMENT) {
+          m_segments.addLive(it.data().m_segment, it.path(), it.data().m_fileSize, true);
+        }
       }
-      m_mutex.unlock();
     }
     private:
-    std::string m_filename;
-    std::unordered_map<std::string, FileData> m_map;
-    std::mutex m_mutex;
+    std::string m_filename;     // 日志(文件信息表)
+    std::string m_snapshotName; // 快照, 日志文件名加.idx
+    std::string m_frozenName;   // 冻结的日志, 日志文件名加.frozen, 合并完成后删除
+    IndexSnapshot m_snapshot;
+    // 有序存储, 列目录时可以和快照一起按前缀范围扫描
+    DeltaMap m_delta;
+    DeltaMap m_frozen;          // 正在合并进快照的增量, 合并期间不修改
+    bool m_compacting = false;  // 有合并在进行, 此时m_frozen属于合并
+    std::condition_variable_any m_compacted; // 合并结束
+    std::thread m_compactor;    // 后台合并线程
+    size_t m_count;             // 索引中的文件数
+    std::ofstream m_journal;
+    size_t m_journalLines;      // 日志行数
+    static const size_t m_s_CompactMin = 4096;
+    static const size_t m_s_CompactRatio = 8;
+    SegmentStore m_segments;
+    uint64_t m_segmentFileSize; // 小于这个大小的文件放进段中, 0表示不使用段
+    struct DirVersion
+    {
+      uint64_t m_version = 0;
+      time_t m_mtime = 0;
+    };
+    time_t m_startTime;
+    std::unordered_map<uint64_t, DirVersion> m_dirVersions; // 键为目录路径(不带结尾'/')的哈希
+    static const unsigned m_s_SegmentLivePercent = 50; // 有效数据低于这个比例的段被回收
+    ObjectCache m_cache;      // 热点小文件的内容, 由_set失效
+    VersionStore m_versions;  // 被覆盖的旧内容
+    static const size_t m_s_CacheFileSize = 256 * 1024; // cacheFileSize的默认值
+    static const size_t m_s_PathLocks = 256;
+    std::mutex m_pathLocks[m_s_PathLocks];
+    // 统计获取锁的次数和发生竞争时的等待时间
+    MeteredMutex m_mutex{
+      Metrics::counter("cloudbackup_index_lock_acquisitions_total", "FileDataManager lock acquisitions"),
+      Metrics::counter("cloudbackup_index_lock_contended_total", "FileDataManager lock acquisitions that had to wait"),
+      Metrics::histogram("cloudbackup_index_lock_wait_seconds", "FileDataManager lock wait time when contended", "", 6, 30)
+    };
   };
 
   FileDataManager fdManager;
@@ -263,27 +1091,291 @@ namespace CloudBackup {
   {
     public:
       FileManageModule(FileDataManager &fdm = fdManager)
-        : m_fdm(fdm) {}
+        : m_fdm(fdm), m_startTime(time(nullptr)) {}
       void start()
       {
-        std::vector<std::string> fileList;
+        Gauge &queueDepth = Metrics::gauge("cloudbackup_compress_queue_depth",
+            "Non-hot files found by the current scan batch and not yet compressed");
+        Counter &scanned = Metrics::counter("cloudbackup_compress_candidates_total",
+            "Uncompressed index entries old enough to be checked for compression");
+        Counter &files = Metrics::counter("cloudbackup_compress_files_total", "Files compressed");
+        Counter &bytesIn = Metrics::counter("cloudbackup_compress_input_bytes_total", "Bytes read by compression");
+        Counter &bytesOut = Metrics::counter("cloudbackup_compress_output_bytes_total", "Bytes written by compression");
+        Histogram &duration = Metrics::histogram("cloudbackup_compress_duration_seconds",
+            "Time to compress one file", "", 16, 38);
+        std::vector<std::pair<std::string, FileDataManager::FileData>> pending;
+        time_t lastSweep = 0;
         while (true) {
-          m_fdm.getAllList(fileList);
-          for (std::vector<int>::size_type i = 0; i < fileList.size(); ++i) {
-            if (!m_fdm.isCompressedFile(fileList[i]) && MyUtil::isNonHotFile(fileList[i], m_s_IntervalTime)) {
-              CompressUtil::compress(fileList[i], fileList[i] + ".gz");
-              unlink(fileList[i].c_str());
-              m_fdm.changeData(fileList[i]);
+          if (time(nullptr) - lastSweep >= m_s_TempSweepInterval) {
+            lastSweep = time(nullptr);
+            _sweepTemp();
+          }
+          // 索引中的访问时间不晚于文件实际的访问时间, 索引中还很新的文件一定是热点文件, 不需要stat
+          FileDataManager::ScanFilter filter;
+          filter.m_normalOnly = true;
+          filter.m_atimeBefore = time(nullptr) - m_s_IntervalTime;
+          std::string cursor;
+          bool more = true;
+          while (more) {
+            pending.clear();
+            more = m_fdm.scan(cursor, m_s_ScanBatch, filter, [&pending](boost::string_view path, const FileDataManager::FileData &data) {
+              pending.emplace_back(std::string(path.data(), path.size()), data);
+            });
+            scanned.add(pending.size());
+            queueDepth.set(pending.size());
+            for (auto &item : pending) {
+              const std::string &filepath = item.first;
+              queueDepth.add(-1);
+              if (!MyUtil::isNonHotFile(filepath, m_s_IntervalTime) || m_fdm.isCached(filepath)) {
+                continue;
+              }
+              boost::system::error_code ec;
+              uintmax_t size = boost::filesystem::file_size(filepath, ec);
+              // 压缩结果落盘并登记之后才删除原文件, 中途崩溃时原文件仍然完整
+              // 压缩不持路径锁; 完成后在锁内确认索引项没有变化(期间没有追加或上传), 否则压缩结果作废
+              std::string tmp = DurableFile::tempName(filepath + ".gz");
+              bool ok;
+              {
+                MetricTimer timer(duration);
+                ok = CompressUtil::compress(filepath, tmp) && DurableFile::syncPath(tmp);
+              }
+              if (!ok) {
+                unlink(tmp.c_str());
+                continue;
+              }
+              std::unique_lock<std::mutex> lock = m_fdm.lockPath(filepath);
+              if (!m_fdm.unchanged(filepath, item.second)) {
+                unlink(tmp.c_str());
+                continue;
+              }
+              if (!DurableFile::commit(tmp, filepath + ".gz")) {
+                continue;
+              }
+              files.add(1);
+              bytesIn.add(ec ? 0 : size);
+              size = boost::filesystem::file_size(filepath + ".gz", ec);
+              bytesOut.add(ec ? 0 : size);
+              if (m_fdm.changeData(filepath, FileDataManager::COMPRESSED) && m_fdm.sync()) {
+                unlink(filepath.c_str());
+              }
             }
           }
+          m_fdm.compactSegments();
           MyUtil::MySleep(m_s_IntervalTime);
         }
       }
+      // 超过这个时间没有访问的文件视为非热点文件
+      static time_t intervalTime() {
+        return m_s_IntervalTime;
+      }
+    private:
+      // 删除崩溃时残留在数据目录中的临时文件(DurableFile::tempName), 上传, 追加或压缩中途崩溃时留下, 永远不会再被用到
+      // 只删除不在索引中(不是用户上传的同名文件), 并且在本次启动之前或者m_s_TempGrace秒之前修改的, 不影响正在写的临时文件
+      // 以'.'开头的顶层目录(段, 历史版本)由各自的模块清理
+      void _sweepTemp() {
+        static Counter &removed = Metrics::counter("cloudbackup_temp_files_removed_total",
+            "Leftover temporary files removed from the data directory");
+        const std::string root = "/data/CloudBackup";
+        time_t cutoff = std::max(m_startTime, time(nullptr) - m_s_TempGrace);
+        std::vector<DirScanner::Entry> files;
+        DirScanner(1).scan(root, [&root, cutoff](const std::string &path, const struct stat &st) {
+          return st.st_mtime < cutoff && path[root.size() + 1] != '.' && DurableFile::isTempName(path);
+        }, files);
+        for (const DirScanner::Entry &entry : files) {
+          if (!m_fdm.isExistFile(entry.m_path) && unlink(entry.m_path.c_str()) == 0) {
+            removed.add(1);
+            CB_LOG(INFO, "temp.removed").str("path", entry.m_path).num("size", entry.m_stat.st_size);
+          }
+        }
+      }
     private:
       FileDataManager &m_fdm;
+      time_t m_startTime;
       static const time_t m_s_IntervalTime = 30;
+      static const size_t m_s_ScanBatch = 4096; // 每批持锁检查的索引项数
+      static const time_t m_s_TempSweepInterval = 24 * 3600; // 清理残留临时文件的间隔, 启动时先清理一次
+      static const time_t m_s_TempGrace = 3600;
   };
   const time_t FileManageModule::m_s_IntervalTime;
+  const time_t FileManageModule::m_s_TempSweepInterval;
+  const time_t FileManageModule::m_s_TempGrace;
+  // 巡检: 按IO预算依次重新读取冷文件, 与索引中的哈希比较, 发现磁盘上的静默损坏, 不需要每次下载都读整个文件校验
+  // 热点文件不检查(刚上传的内容刚刚算过哈希); 索引中哈希未知的文件(追加过的)算出后补上
+  // 每scrubInterval秒开始一轮, 0表示不巡检; 读取速度不超过scrubRate, 可以用scrubRateSchedule按时段设置(格式与客户端的限速相同)
+  class ScrubModule
+  {
+    public:
+      ScrubModule(FileDataManager &fdm = fdManager)
+        : m_fdm(fdm) {
+        std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudServer");
+        m_interval = strtoul(config["scrubInterval"].c_str(), nullptr, 10);
+        m_limiter.configure(config["scrubRate"], config["scrubRateSchedule"], false);
+      }
+      void start() {
+        static Counter &passes = Metrics::counter("cloudbackup_scrub_passes_total", "Completed scrub passes over the index");
+        if (m_interval == 0) {
+          return;
+        }
+        std::vector<std::pair<std::string, FileDataManager::FileData>> pending;
+        while (true) {
+          time_t begin = time(nullptr);
+          FileDataManager::ScanFilter filter;
+          filter.m_atimeBefore = begin - FileManageModule::intervalTime();
+          std::string cursor;
+          bool more = true;
+          while (more) {
+            pending.clear();
+            more = m_fdm.scan(cursor, m_s_ScanBatch, filter, [&pending](boost::string_view path, const FileDataManager::FileData &data) {
+              pending.emplace_back(std::string(path.data(), path.size()), data);
+            });
+            m_limiter.update(time(nullptr));
+            for (auto &item : pending) {
+              _check(item.first, item.second);
+            }
+          }
+          passes.add(1);
+          CB_LOG(INFO, "scrub.pass_done").num("seconds", time(nullptr) - begin);
+          time_t elapsed = time(nullptr) - begin;
+          if (elapsed < static_cast<time_t>(m_interval)) {
+            MyUtil::MySleep(m_interval - elapsed);
+          }
+        }
+      }
+    private:
+      void _check(const std::string &filepath, const FileDataManager::FileData &data) {
+        static Counter &files = Metrics::counter("cloudbackup_scrub_files_total", "Files whose content matched the index hash");
+        static Counter &bytes = Metrics::counter("cloudbackup_scrub_bytes_total", "Content bytes read by the scrubber");
+        static Counter &learned = Metrics::counter("cloudbackup_scrub_hashes_learned_total",
+            "Index entries without a hash that the scrubber filled in");
+        static Counter &errors = Metrics::counter("cloudbackup_scrub_errors_total", "Files the scrubber could not read");
+        static Counter &corrupt = Metrics::counter("cloudbackup_corrupt_files_total",
+            "Files whose content no longer matches the hash in the index", "source=\"scrub\"");
+        uint64_t hash = 0;
+        size_t size = 0;
+        bool ok;
+        if (data.m_fileStatus == FileDataManager::SEGMENT) {
+          std::string content;
+          ok = m_fdm.readSegment(data, content);
+          m_limiter.acquire(content.size());
+          hash = XXHash64::hash(content);
+          size = content.size();
+        } else {
+          ok = _hashFile(data.m_fileStatus == FileDataManager::COMPRESSED ? filepath + ".gz" : filepath, hash, size);
+        }
+        bytes.add(size);
+        // 读取期间文件被重新上传, 追加, 压缩或者解压时跳过, 下一轮再检查
+        FileDataManager::FileData now;
+        if (!m_fdm.findData(filepath, now) || now.m_fileStatus != data.m_fileStatus || now.m_fileSize != data.m_fileSize
+            || now.m_hash != data.m_hash || now.m_segment != data.m_segment || now.m_offset != data.m_offset) {
+          return;
+        }
+        if (!ok) {
+          CB_LOG(ERROR, "scrub.read_failed").str("path", filepath).num("status", data.m_fileStatus);
+          errors.add(1);
+          return;
+        }
+        if (size == data.m_fileSize && data.m_hash == 0) {
+          if (m_fdm.setHash(filepath, data, hash)) {
+            learned.add(1);
+          }
+          return;
+        }
+        if (size != data.m_fileSize || hash != data.m_hash) {
+          CB_LOG(ERROR, "scrub.corrupt").str("path", filepath).num("status", data.m_fileStatus)
+            .num("size", data.m_fileSize).num("actual_size", size)
+            .str("expected", XXHash64::toHex(data.m_hash)).str("actual", XXHash64::toHex(hash));
+          corrupt.add(1);
+          return;
+        }
+        files.add(1);
+      }
+      // 读出文件(.gz文件读出解压后的内容)算哈希, 读完后丢弃页缓存, 巡检不挤掉热点文件的缓存
+      bool _hashFile(const std::string &path, uint64_t &hash, size_t &size) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          return false;
+        }
+        // gzclose会关闭交给它的fd, 丢弃缓存要用另一个
+        int gzfd = dup(fd);
+        gzFile file = gzfd < 0 ? NULL : gzdopen(gzfd, "rb");
+        if (file == NULL) {
+          if (gzfd >= 0) {
+            ::close(gzfd);
+          }
+          ::close(fd);
+          return false;
+        }
+        gzbuffer(file, m_s_ReadSize);
+        XXHash64 state;
+        std::vector<char> buf(m_s_ReadSize);
+        int n;
+        while ((n = gzread(file, buf.data(), m_s_ReadSize)) > 0) {
+          m_limiter.acquire(n);
+          state.update(buf.data(), n);
+          size += n;
+        }
+        gzclose(file);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+        hash = state.digest();
+        return n == 0;
+      }
+    private:
+      FileDataManager &m_fdm;
+      unsigned long m_interval;
+      RateLimiter m_limiter;
+      static const size_t m_s_ScanBatch = 1024;
+      static const unsigned m_s_ReadSize = 65536;
+  };
+  // 历史版本的后台任务: 每versionInterval秒执行一轮, 每个文件保留最新的versionKeep个版本和versionKeepTime秒内被替换的版本,
+  // 保留的版本切块去重存放, 然后回收不再被引用的块; 上传只做硬链接和追加版本表, 不等待这里的任何操作
+  class VersionModule
+  {
+    public:
+      VersionModule(FileDataManager &fdm = fdManager)
+        : m_fdm(fdm) {
+        std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudServer");
+        m_interval = strtoul(config["versionInterval"].c_str(), nullptr, 10);
+        m_keep = strtoul(config["versionKeep"].c_str(), nullptr, 10);
+        m_keepTime = strtol(config["versionKeepTime"].c_str(), nullptr, 10);
+      }
+      void start() {
+        static Counter &passes = Metrics::counter("cloudbackup_version_passes_total", "Completed version retention passes");
+        static Counter &chunked = Metrics::counter("cloudbackup_versions_chunked_total", "Versions moved into the chunk store");
+        static Counter &expired = Metrics::counter("cloudbackup_versions_expired_total", "Versions removed by the retention policy");
+        static Counter &newChunks = Metrics::counter("cloudbackup_version_chunks_total", "Chunks handled by the retention job", "result=\"new\"");
+        static Counter &sharedChunks = Metrics::counter("cloudbackup_version_chunks_total", "Chunks handled by the retention job", "result=\"shared\"");
+        static Counter &removedChunks = Metrics::counter("cloudbackup_version_chunks_total", "Chunks handled by the retention job", "result=\"removed\"");
+        static Counter &chunkBytes = Metrics::counter("cloudbackup_version_chunk_bytes_total", "Compressed bytes written to the chunk store");
+        static Counter &sharedBytes = Metrics::counter("cloudbackup_version_shared_bytes_total",
+            "Version bytes not written because an identical chunk already existed");
+        if (m_interval == 0 || !m_fdm.versions().enabled()) {
+          return;
+        }
+        while (true) {
+          MyUtil::MySleep(m_interval);
+          time_t begin = time(nullptr);
+          VersionStore::Stats stats;
+          m_fdm.versions().maintain(m_keep, m_keepTime, stats);
+          passes.add(1);
+          chunked.add(stats.m_chunked);
+          expired.add(stats.m_expired);
+          newChunks.add(stats.m_newChunks);
+          sharedChunks.add(stats.m_sharedChunks);
+          removedChunks.add(stats.m_removedChunks);
+          chunkBytes.add(stats.m_chunkBytes);
+          sharedBytes.add(stats.m_sharedBytes);
+          CB_LOG(INFO, "version.pass_done").num("seconds", time(nullptr) - begin).num("chunked", stats.m_chunked)
+            .num("expired", stats.m_expired).num("new_chunks", stats.m_newChunks).num("shared_chunks", stats.m_sharedChunks)
+            .num("removed_chunks", stats.m_removedChunks);
+        }
+      }
+    private:
+      FileDataManager &m_fdm;
+      unsigned long m_interval;
+      size_t m_keep;
+      time_t m_keepTime;
+  };
 
   using namespace mysqlhelper;
   class MysqlModule
@@ -297,10 +1389,10 @@ namespace CloudBackup {
       void connect() {
         try {
           m_mysql.connect();
-          std::cout << "数据库连接成功..." << std::endl;
+          CB_LOG(INFO, "mysql.connected");
         }
         catch (mysqlhelper::MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("connect", excep);
           return; // 未处理数据库不存在的情况
         }
       }
@@ -309,24 +1401,28 @@ namespace CloudBackup {
       }
       bool createUser(const std::string &nickname, MysqlHelper::RECORD_DATA &record)
       {
+        static Histogram &latency = _latency("createUser");
+        MetricTimer timer(latency);
         try {
           MysqlHelper::RECORD_DATA user;
           user.insert(std::make_pair("nickname", std::make_pair(MysqlHelper::DB_STR, nickname)));
           int res = m_mysql.insertRecord("user_info", user);
-          std::cout << " |--->用户创建成功..." << std::endl;
+          CB_LOG(DEBUG, "mysql.user_created").str("nickname", nickname);
 
           std::string uid = std::to_string(m_mysql.lastInsertID());
           record.insert(std::make_pair("uid", std::make_pair(MysqlHelper::DB_INT, uid)));
           res = m_mysql.insertRecord("user_auths", record);
-          std::cout << "   |--->用户授权成功..." << std::endl;
+          CB_LOG(DEBUG, "mysql.user_authorized").str("uid", uid);
         }
         catch (mysqlhelper::MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("createUser", excep);
           return false;
         }
         return true;
       }
       bool openidExist(const std::string &openid) {
+        static Histogram &latency = _latency("openidExist");
+        MetricTimer timer(latency);
         try {
           std::stringstream sql;
           sql << "select openid from user_auths"
@@ -334,11 +1430,13 @@ namespace CloudBackup {
           return m_mysql.existRecord(sql.str());
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("openidExist", excep);
           return false;
         }
       }
       bool userCheck(const std::string &openid, const std::string &login_token) {
+        static Histogram &latency = _latency("userCheck");
+        MetricTimer timer(latency);
         try {
           std::stringstream sql;
           sql << "select openid, login_token from user_auths"
@@ -346,11 +1444,13 @@ namespace CloudBackup {
           return m_mysql.existRecord(sql.str());
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("userCheck", excep);
           return false;
         }
       }
       std::string getNickname(const std::string &uid) {
+        static Histogram &latency = _latency("getNickname");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select nickname from user_info where user_id='" + uid + "'";
           MysqlHelper::MysqlData data = m_mysql.queryRecord(sql);
@@ -360,11 +1460,13 @@ namespace CloudBackup {
           return data[0]["nickname"];
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("getNickname", excep);
           return "???getNickname ERROR???";
         }
       }
       std::string getUserId(const std::string &openid) {
+        static Histogram &latency = _latency("getUserId");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select uid from user_auths where openid='" + openid + "'";
           MysqlHelper::MysqlData data = m_mysql.queryRecord(sql);
@@ -374,11 +1476,13 @@ namespace CloudBackup {
           return data[0]["uid"];
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("getUserId", excep);
           return "???getUserId ERROR???";
         }
       }
       std::string getCookie(const std::string &uid) {
+        static Histogram &latency = _latency("getCookie");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select login_token from user_auths where uid='" + uid + "'";
           MysqlHelper::MysqlData data = m_mysql.queryRecord(sql);
@@ -389,7 +1493,7 @@ namespace CloudBackup {
           return "sid=" + md5(password) + "-" + uid;
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("getCookie", excep);
           return "???getCookie ERROR???";
         }
       }
@@ -397,35 +1501,55 @@ namespace CloudBackup {
         return cookie.find(getCookie(uid)) != std::string::npos;
       }
       std::string getUTC() {
+        static Histogram &latency = _latency("getUTC");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select utc_timestamp()";
           return m_mysql.queryRecord(sql)[0]["utc_timestamp()"];
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("getUTC", excep);
           return "???getUTC ERROR???";
         }
       }
       std::string md5(const std::string &code) {
+        static Histogram &latency = _latency("md5");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select md5('" + code + "')";
           return m_mysql.queryRecord(sql)[0][sql.substr(7)];
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("md5", excep);
           return "???MD5 ERROR???";
         }
       }
       std::string password(const std::string &pwd) {
+        static Histogram &latency = _latency("password");
+        MetricTimer timer(latency);
         try {
           std::string sql = "select password('" + pwd + "')";
           return m_mysql.queryRecord(sql)[0][sql.substr(7)];
         }
         catch (MysqlHelper_Exception &excep) {
-          std::cout << excep.errorInfo << std::endl;
+          _error("password", excep, pwd);
           return "???password ERROR???";
         }
       }
+    private:
+      // 出错信息中带有完整的SQL, secret非空时(例如明文密码)先替换掉再写日志
+      static void _error(const char *op, const MysqlHelper_Exception &excep, const std::string &secret = "") {
+        std::string info = excep.errorInfo;
+        for (size_t pos = 0; !secret.empty() && (pos = info.find(secret, pos)) != std::string::npos; pos += 3) {
+          info.replace(pos, secret.size(), "***");
+        }
+        CB_LOG(ERROR, "mysql.error").str("op", op).str("error", info);
+      }
+      // 每种查询一个耗时直方图, 各方法用函数内的静态引用保存, 只在第一次调用时注册
+      static Histogram &_latency(const std::string &op) {
+        return Metrics::histogram("cloudbackup_mysql_query_duration_seconds",
+            "MySQL query latency by operation", "op=\"" + op + "\"", 10, 35);
+      }
     private:
       MysqlHelper m_mysql;
   };
@@ -436,32 +1560,139 @@ namespace CloudBackup {
     public:
       HttpServerModule() {
         std::map<std::string, std::string> config = MyUtil::getConfig("./CBackup.cnf", "CloudServer");
+        Logger::configure(config);
         m_db.init(config["sHost"], config["sUser"], config["sPasswd"], config["sDataBase"], config["sCharSet"], atoi(config["sPort"].c_str()), atoi(config["sFlag"].c_str()));
         m_db.connect();
+        // serverMode=epoll时使用epoll事件循环, 否则使用httplib默认的每连接一个线程
+        if (config["serverMode"] == "epoll") {
+          m_srv.reset(new EpollServer(strtoul(config["reactorNum"].c_str(), nullptr, 10)));
+        } else {
+          m_srv.reset(new httplib::Server);
+        }
+        // taskQueue=pool时使用httplib自带的线程池, 否则使用工作窃取线程池, workerNum为0时按CPU核数决定
+        if (config["taskQueue"] != "pool") {
+          size_t workerNum = strtoul(config["workerNum"].c_str(), nullptr, 10);
+          m_srv->new_task_queue = [workerNum]() -> httplib::TaskQueue * {
+            m_s_pool = new WorkStealingPool(workerNum);
+            return m_s_pool;
+          };
+        }
+        // ioBackend=uring时上传写入和下载读取使用io_uring, directIO=1时非热点文件的读取使用O_DIRECT
+        UringContext::s_enabled = (config["ioBackend"] == "uring");
+        UringContext::s_directIO = (config["directIO"] == "1");
+        // uploadSync: 上传的文件和索引日志落盘的方式, none, fsync 或 group(默认)
+        DurableFile::configure(config["uploadSync"]);
+        // 其他模块维护的状态, 在输出/metrics时读取
+        Metrics::callback("cloudbackup_index_files", "Files in the FileDataManager index", "gauge", "",
+            []() { return static_cast<double>(fdManager.size()); });
+        Metrics::callback("cloudbackup_segments", "Segment files holding small files", "gauge", "",
+            []() { size_t count; uint64_t bytes, live; fdManager.segmentStats(count, bytes, live); return static_cast<double>(count); });
+        Metrics::callback("cloudbackup_segment_bytes", "Total size of the segment files", "gauge", "",
+            []() { size_t count; uint64_t bytes, live; fdManager.segmentStats(count, bytes, live); return static_cast<double>(bytes); });
+        Metrics::callback("cloudbackup_segment_live_bytes", "Bytes in segment files still referenced by the index", "gauge", "",
+            []() { size_t count; uint64_t bytes, live; fdManager.segmentStats(count, bytes, live); return static_cast<double>(live); });
+        Metrics::callback("cloudbackup_cache_objects", "Files held in the hot-file cache", "gauge", "",
+            []() { size_t count, bytes; fdManager.cacheStats(count, bytes); return static_cast<double>(count); });
+        Metrics::callback("cloudbackup_cache_bytes", "Bytes charged to the hot-file cache", "gauge", "",
+            []() { size_t count, bytes; fdManager.cacheStats(count, bytes); return static_cast<double>(bytes); });
+        Metrics::callback("cloudbackup_taskqueue_depth", "Tasks waiting in the work-stealing pool", "gauge", "",
+            []() { return m_s_pool ? static_cast<double>(m_s_pool.load()->depth()) : 0.0; });
+        Metrics::callback("cloudbackup_taskqueue_executed_total", "Tasks run by the work-stealing pool", "counter", "",
+            []() { return m_s_pool ? static_cast<double>(m_s_pool.load()->executed()) : 0.0; });
+        Metrics::callback("cloudbackup_taskqueue_steals_total", "Tasks stolen from another worker's queue", "counter", "",
+            []() { return m_s_pool ? static_cast<double>(m_s_pool.load()->steals()) : 0.0; });
+        Metrics::callback("cloudbackup_taskqueue_overflows_total", "Tasks that went to the overflow list", "counter", "",
+            []() { return m_s_pool ? static_cast<double>(m_s_pool.load()->overflows()) : 0.0; });
       }
       ~HttpServerModule() {
         m_db.disconnect();
       }
       void start(const std::string &host = "0.0.0.0", int port = 9000) {
-        int ret = m_srv.set_mount_point("/", "./www");
+        int ret = m_srv->set_mount_point("/", "./www");
         if (!ret) {
           boost::filesystem::create_directories("./www");
-          m_srv.set_mount_point("/", "./www");
-        }
-        m_srv.Post("/register", _register);
-        m_srv.Post("/login", _login);
-        m_srv.Get("/logout", _logout);
-        m_srv.Get("/profile", _profile);
-        m_srv.Get("/clist/(.*)", _cfileList);
-        m_srv.Get("/list/([0-9]*)/(.*)", _fileList);
-        m_srv.Get("/download/(.*)", _fileDownload);
-        m_srv.Put("/upload/(.*)", _fileUpload);
-        m_srv.listen(host.c_str(), port);
+          m_srv->set_mount_point("/", "./www");
+        }
+        m_router.Post("/register", _metered("register", _register));
+        m_router.Post("/login", _metered("login", _login));
+        m_router.Get("/logout", _metered("logout", _logout));
+        m_router.Get("/profile", _metered("profile", _profile));
+        m_router.Get("/clist/(.*)", _metered("clist", _cfileList));
+        m_router.Get("/list/([0-9]*)/(.*)", _metered("list", _fileList));
+        m_router.Get("/download/(.*)", _metered("download", _fileDownload));
+        m_router.Get("/versions/(.*)", _metered("versions", _versionList));
+        m_router.Put("/upload/(.*)", _metered("upload", _fileUpload));
+        m_router.Put("/append/(.*)", _metered("append", _fileAppend));
+        m_router.Put("/batch", _metered("batch", _batchUpload));
+        m_router.Get("/metrics", _metered("metrics", _metrics));
+        // 路由在启动前注册完毕, 之后只读, 可以被多个工作线程同时使用
+        const Router &router = m_router;
+        m_srv->set_dispatcher([&router](httplib::Request &req, httplib::Response &res) {
+          return router.dispatch(req, res);
+        });
+        m_srv->listen(host.c_str(), port);
       }
     private:
+      // 每个路由的请求统计
+      struct RouteMetrics
+      {
+        Counter *m_requests[4]; // 按状态码分类: 2xx, 3xx, 4xx, 5xx
+        Counter &m_bytesIn;
+        Counter &m_bytesOut;
+        Histogram &m_latency;
+        explicit RouteMetrics(const std::string &route)
+          : m_bytesIn(Metrics::counter("cloudbackup_http_request_bytes_total", "Request body bytes received", "route=\"" + route + "\"")),
+          m_bytesOut(Metrics::counter("cloudbackup_http_response_bytes_total", "Response body bytes sent", "route=\"" + route + "\"")),
+          m_latency(Metrics::histogram("cloudbackup_http_request_duration_seconds",
+                "Time from handler start until the response is sent", "route=\"" + route + "\"", 13, 35)) {
+          for (int i = 0; i < 4; ++i) {
+            m_requests[i] = &Metrics::counter("cloudbackup_http_requests_total", "HTTP requests by route and status class",
+                "route=\"" + route + "\",code=\"" + std::to_string(i + 2) + "xx\"");
+          }
+        }
+      };
+      // 为处理函数加上请求数, 流量和耗时统计
+      // 耗时到Response析构为止, 即包括content provider发送响应体的时间
+      static httplib::Server::Handler _metered(const std::string &route, httplib::Server::Handler handler) {
+        std::shared_ptr<RouteMetrics> metrics = std::make_shared<RouteMetrics>(route);
+        return [metrics, handler](const httplib::Request &req, httplib::Response &res) {
+          auto start = std::chrono::steady_clock::now();
+          handler(req, res);
+          int code = (res.status == -1) ? 2 : res.status / 100; // 未设置的状态码由httplib填为200
+          metrics->m_requests[std::min(std::max(code, 2), 5) - 2]->add(1);
+          metrics->m_bytesIn.add(req.body.size());
+          if (res.content_provider) {
+            // 经过一层DataSink统计实际发送的字节数
+            httplib::ContentProvider provider = std::move(res.content_provider);
+            res.content_provider = [metrics, provider](size_t offset, size_t length, httplib::DataSink &sink) {
+              httplib::DataSink counted;
+              counted.write = [metrics, &sink](const char *data, size_t len) {
+                metrics->m_bytesOut.add(len);
+                sink.write(data, len);
+              };
+              counted.done = [&sink]() { sink.done(); };
+              counted.is_writable = [&sink]() { return sink.is_writable(); };
+              provider(offset, length, counted);
+            };
+          } else {
+            metrics->m_bytesOut.add(res.body.size());
+          }
+          std::function<void()> release = std::move(res.content_provider_resource_releaser);
+          res.content_provider_resource_releaser = [metrics, start, release]() {
+            if (release) {
+              release();
+            }
+            metrics->m_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start).count());
+          };
+        };
+      }
+      // Prometheus文本格式的运行指标
+      static void _metrics(const httplib::Request &req, httplib::Response &res) {
+        res.set_content(Metrics::render(), "text/plain; version=0.0.4");
+      }
       static void _register(const httplib::Request &req, httplib::Response &res) {
-        printf("register:> name[%s] password[%s]\n", 
-            req.get_param_value("username").c_str(), req.get_param_value("password").c_str());
+        CB_LOG(INFO, "http.register").str("username", req.get_param_value("username"));
 
         std::string openid = req.get_param_value("username");
         std::string password = m_db.password(req.get_param_value("password"));
@@ -486,8 +1717,7 @@ namespace CloudBackup {
         }
       }
       static void _login(const httplib::Request &req, httplib::Response &res) {
-        printf("login:> name[%s] password[%s]\n", 
-            req.get_param_value("username").c_str(), req.get_param_value("password").c_str());
+        CB_LOG(INFO, "http.login").str("username", req.get_param_value("username"));
 
         std::string openid = req.get_param_value("username");
         std::string password = m_db.password(req.get_param_value("password"));
@@ -507,7 +1737,7 @@ namespace CloudBackup {
         }
       }
       static void _logout(const httplib::Request &req, httplib::Response &res) {
-        printf("logout:> [%s]\n", req.matches[0].str().c_str());
+        CB_LOG(INFO, "http.logout").str("path", req.path_params[0]);
 
         res.status = 200;
         res.body = "退出成功";
@@ -517,20 +1747,390 @@ namespace CloudBackup {
         res.set_header("Content-Type", "text/plain;charset=utf8");
       }
       static void _fileUpload(const httplib::Request &req, httplib::Response &res) {
-        printf("upload:> [%s]\n", req.matches[0].str().c_str());
-        std::string filepath = "/data/CloudBackup/" + req.matches[1].str();
+        CB_LOG(INFO, "http.upload").str("path", req.path_params[0]).num("size", req.body.size());
+        std::string filepath = "/data/CloudBackup/" + req.path_params[1];
+        uint64_t hash = 0;
+        if (!req.has_header("Content-Encoding")) {
+          hash = XXHash64::hash(req.body);
+          if (!_checkDigest(req, filepath, hash)) {
+            res.status = 400;
+            return;
+          }
+        }
+        // 小文件放进段中, 不需要创建目录和单独的文件
+        if (!req.has_header("Content-Encoding") && fdManager.useSegment(req.body.size())) {
+          std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+          // 旧内容先保存为历史版本; 保存失败时照常上传
+          fdManager.preserveVersion(filepath, hash);
+          res.status = _storeSegment(filepath, req.body) ? 200 : 500;
+          return;
+        }
         std::string dirpath = filepath.substr(0, filepath.find_last_of("/"));
         if (!boost::filesystem::exists(dirpath)) {
           boost::filesystem::create_directories(dirpath);
         }
-        if (!MyUtil::writeFile(filepath, req.body) || !fdManager.insertData(filepath)) {
+        // 客户端已经gzip压缩过的内容直接保存为.gz文件并标记为COMPRESSED, 不再解压和重新压缩
+        if (req.get_header_value("Content-Encoding") == "gzip") {
+          _compressedUpload(req, res, filepath);
+          return;
+        }
+        if (req.has_header("Content-Encoding")) {
+          res.status = 415;
+          return;
+        }
+        // 临时文件的写入和落盘不持路径锁, 锁内只保存旧版本, rename和登记
+        std::string tmp = DurableFile::prepare(filepath, req.body);
+        if (tmp.empty()) {
+          res.status = 500;
+          return;
+        }
+        std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+        fdManager.preserveVersion(filepath, hash);
+        if (!DurableFile::commit(tmp, filepath) || !fdManager.insertData(filepath, hash) || !fdManager.sync({ dirpath })) {
+          res.status = 500;
+          return;
+        }
+        // 同一文件以前的版本可能已经被压缩
+        unlink((filepath + ".gz").c_str());
+        res.status = 200;
+      }
+      static void _compressedUpload(const httplib::Request &req, httplib::Response &res, const std::string &filepath) {
+        static Counter &uploads = Metrics::counter("cloudbackup_upload_precompressed_total",
+            "Uploads stored as sent because the client already gzip-compressed them", "");
+        static Counter &bytes = Metrics::counter("cloudbackup_upload_precompressed_bytes_total",
+            "Uncompressed size of the uploads the client compressed", "");
+        const std::string &body = req.body;
+        // 解压一遍校验整个gzip数据并算出原始内容的哈希, 不保存解压结果
+        size_t size;
+        uint64_t hash;
+        if (!CompressUtil::hashData(body, hash, size)) {
+          CB_LOG(WARN, "http.upload_bad_gzip").str("path", filepath);
+          res.status = 400;
+          return;
+        }
+        if (!_checkDigest(req, filepath, hash)) {
+          res.status = 400;
+          return;
+        }
+        if (fdManager.useSegment(size)) {
+          // 段中的内容不压缩, 小文件解压的开销很小
+          std::string content;
+          if (!CompressUtil::decompressData(body, content)) {
+            CB_LOG(WARN, "http.upload_bad_gzip").str("path", filepath);
+            res.status = 400;
+            return;
+          }
+          std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+          fdManager.preserveVersion(filepath, hash);
+          if (!_storeSegment(filepath, content)) {
+            res.status = 500;
+            return;
+          }
+        } else {
+          FileDataManager::FileData data(FileDataManager::COMPRESSED, time(nullptr), size, 0, 0, hash);
+          std::string tmp = DurableFile::prepare(filepath + ".gz", body);
+          if (tmp.empty()) {
+            res.status = 500;
+            return;
+          }
+          std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+          fdManager.preserveVersion(filepath, hash);
+          if (!DurableFile::commit(tmp, filepath + ".gz") || !fdManager.insertData(filepath, data)
+              || !fdManager.sync({ filepath.substr(0, filepath.find_last_of("/")) })) {
+            res.status = 500;
+            return;
+          }
+          unlink(filepath.c_str());
+        }
+        uploads.add(1);
+        bytes.add(size);
+        res.status = 200;
+      }
+      // 内容追加到段中并登记, 然后删除以单独文件保存的旧版本
+      static bool _storeSegment(const std::string &filepath, const std::string &content) {
+        FileDataManager::FileData data;
+        if (!fdManager.writeSegment(filepath, content, data) || !fdManager.syncSegment(data.m_segment)
+            || !fdManager.insertData(filepath, data) || !fdManager.sync()) {
+          return false;
+        }
+        unlink(filepath.c_str());
+        unlink((filepath + ".gz").c_str());
+        return true;
+      }
+      // 客户端在Digest头中给出的内容(解压后)的XXH64: "xxh64=16位十六进制", 没有这个头时返回false
+      static bool _clientDigest(const httplib::Request &req, uint64_t &hash) {
+        std::string digest = req.get_header_value("Digest");
+        if (digest.compare(0, 6, "xxh64=") != 0 || digest.size() != 22) {
+          return false;
+        }
+        char *end = nullptr;
+        hash = strtoull(digest.c_str() + 6, &end, 16);
+        return *end == '\0';
+      }
+      // 收到的内容与客户端给出的哈希不一致(传输中损坏)时返回false, 客户端下一轮重新上传
+      static bool _checkDigest(const httplib::Request &req, const std::string &filepath, uint64_t hash) {
+        static Counter &mismatches = Metrics::counter("cloudbackup_upload_digest_mismatch_total",
+            "Uploads rejected because the body did not match the client's Digest header", "");
+        uint64_t sent;
+        if (_clientDigest(req, sent) && sent != hash) {
+          CB_LOG(WARN, "http.upload_digest_mismatch").str("path", filepath)
+            .str("expected", XXHash64::toHex(sent)).str("actual", XXHash64::toHex(hash));
+          mismatches.add(1);
+          return false;
+        }
+        return true;
+      }
+      // 批量上传: 请求体是BatchPack格式的多个小文件, 逐个写入后一起落盘, 再在一次索引操作中全部登记
+      // 每个文件的处理与/upload相同; 写入失败的文件不登记, 它们的路径按行返回, 由客户端下一轮重试
+      static void _batchUpload(const httplib::Request &req, httplib::Response &res) {
+        static Counter &batches = Metrics::counter("cloudbackup_batch_uploads_total", "Batch upload requests applied", "");
+        static Counter &files = Metrics::counter("cloudbackup_batch_files_total", "Files stored by batch uploads", "");
+        std::vector<BatchPack::Entry> entries;
+        if (!BatchPack::parse(req.body, entries)) {
+          CB_LOG(WARN, "http.batch_bad_pack").num("size", req.body.size());
+          res.status = 400;
+          return;
+        }
+        CB_LOG(INFO, "http.batch").num("files", entries.size()).num("size", req.body.size());
+        // items是段中的文件, pending是单独保存的文件, 与batch中的临时文件一一对应
+        std::vector<std::pair<std::string, FileDataManager::FileData>> items, pending;
+        items.reserve(entries.size());
+        std::set<uint32_t> segments;
+        std::vector<std::string> dirs, versionSyncs;
+        DurableFile::Batch batch;
+        const std::string root = "/data/CloudBackup/";
+        std::string failed, dirpath, content, plain;
+        time_t now = time(nullptr);
+        // 批中都是小文件, 整批处理期间锁住所有路径
+        std::vector<std::string> paths;
+        for (const BatchPack::Entry &entry : entries) {
+          paths.push_back(root + entry.m_path.to_string());
+        }
+        std::vector<std::unique_lock<std::mutex>> locks = fdManager.lockPaths(paths);
+        for (const BatchPack::Entry &entry : entries) {
+          std::string filepath = root + entry.m_path.to_string();
+          content.assign(entry.m_data.data(), entry.m_data.size());
+          FileDataManager::FileData data(FileDataManager::NORMAL, now, content.size());
+          bool gzipped = (entry.m_flags == BatchPack::m_s_Gzip);
+          bool ok = (entry.m_flags == 0 || gzipped);
+          if (ok && gzipped) {
+            ok = CompressUtil::hashData(content, data.m_hash, data.m_fileSize);
+          } else if (ok) {
+            data.m_hash = XXHash64::hash(content);
+          }
+          if (ok) {
+            fdManager.preserveVersion(filepath, data.m_hash, versionSyncs);
+          }
+          if (ok && fdManager.useSegment(data.m_fileSize)) {
+            plain.clear();
+            ok = (!gzipped || CompressUtil::decompressData(content, plain))
+              && fdManager.writeSegment(filepath, gzipped ? plain : content, data);
+            if (ok) {
+              segments.insert(data.m_segment);
+              items.emplace_back(std::move(filepath), data);
+              continue;
+            }
+          } else if (ok) {
+            // 同一目录下的文件通常相邻, 只在目录变化时检查
+            std::string dir = filepath.substr(0, filepath.find_last_of("/"));
+            if (dir != dirpath) {
+              if (!boost::filesystem::exists(dir)) {
+                boost::filesystem::create_directories(dir);
+              }
+              dirpath = dir;
+              dirs.push_back(dir);
+            }
+            if (gzipped) {
+              data.m_fileStatus = FileDataManager::COMPRESSED;
+              ok = batch.add(filepath + ".gz", content);
+            } else {
+              ok = batch.add(filepath, content);
+            }
+            if (ok) {
+              pending.emplace_back(std::move(filepath), data);
+              continue;
+            }
+          }
+          CB_LOG(WARN, "http.batch_file_failed").str("path", filepath);
+          failed.append(entry.m_path.data(), entry.m_path.size()).push_back('\n');
+        }
+        // 段中的记录和单独的文件都落盘之后才登记, group方式下一批文件只落盘一次
+        // 保存的历史版本在新内容替换旧文件之前落盘
+        if (!versionSyncs.empty()) {
+          DurableFile::syncPaths(versionSyncs);
+        }
+        std::set<uint32_t> badSegments;
+        for (uint32_t segment : segments) {
+          if (!fdManager.syncSegment(segment)) {
+            badSegments.insert(segment);
+          }
+        }
+        if (!badSegments.empty()) {
+          auto bad = std::remove_if(items.begin(), items.end(), [&](const std::pair<std::string, FileDataManager::FileData> &item) {
+            return badSegments.count(item.second.m_segment) != 0;
+          });
+          for (auto it = bad; it != items.end(); ++it) {
+            failed.append(it->first, root.size(), std::string::npos).push_back('\n');
+          }
+          items.erase(bad, items.end());
+        }
+        std::vector<bool> committed = batch.commit();
+        for (size_t i = 0; i < pending.size(); ++i) {
+          if (committed[i]) {
+            items.push_back(std::move(pending[i]));
+          } else {
+            failed.append(pending[i].first, root.size(), std::string::npos).push_back('\n');
+          }
+        }
+        fdManager.insertData(items);
+        if (!fdManager.sync(dirs)) {
           res.status = 500;
           return;
         }
+        // 登记之后再删除以其他形式保存的旧版本
+        for (const auto &item : items) {
+          FileDataManager::status sta = item.second.m_fileStatus;
+          if (sta != FileDataManager::NORMAL) {
+            unlink(item.first.c_str());
+          }
+          if (sta != FileDataManager::COMPRESSED) {
+            unlink((item.first + ".gz").c_str());
+          }
+        }
+        batches.add(1);
+        files.add(items.size());
         res.status = 200;
+        res.set_content(failed, "text/plain");
+      }
+      // 追加上传: 请求体接在文件末尾, offset参数必须等于服务器上文件当前的大小, 否则返回409, 客户端改为完整上传
+      // 请求体可以是gzip压缩的; 已经压缩存储的文件追加一个gzip成员, 不需要先解压
+      static void _fileAppend(const httplib::Request &req, httplib::Response &res) {
+        static Counter &appends = Metrics::counter("cloudbackup_append_total", "Appends applied to existing files", "");
+        static Counter &conflicts = Metrics::counter("cloudbackup_append_conflicts_total",
+            "Appends rejected because the offset did not match the stored size", "");
+        CB_LOG(INFO, "http.append").str("path", req.path_params[0]).num("size", req.body.size());
+        std::string filepath = "/data/CloudBackup/" + req.path_params[1];
+        std::string encoding = req.get_header_value("Content-Encoding");
+        if (!encoding.empty() && encoding != "gzip") {
+          res.status = 415;
+          return;
+        }
+        // 检查偏移, 追加和登记新的大小都在路径锁内: 同一偏移的重复追加(例如客户端超时重试)只有一次成功,
+        // 压缩模块也不会在追加期间把文件换成.gz, 登记时的状态就是追加时的状态
+        std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+        FileDataManager::FileData data;
+        if (!req.has_param("offset") || !fdManager.findData(filepath, data)) {
+          res.status = 404;
+          return;
+        }
+        size_t offset = strtoull(req.get_param_value("offset").c_str(), nullptr, 10);
+        if (offset != data.m_fileSize) {
+          CB_LOG(INFO, "http.append_conflict").str("path", filepath).num("offset", offset).num("size", data.m_fileSize);
+          conflicts.add(1);
+          res.status = 409;
+          return;
+        }
+        bool gzipped = !encoding.empty(), ok;
+        std::string buf;
+        size_t length = req.body.size();
+        if (data.m_fileStatus == FileDataManager::SEGMENT) {
+          res.status = _appendSegment(req, filepath, data, gzipped);
+          if (res.status == 200) {
+            appends.add(1);
+          } else if (res.status == 409) {
+            conflicts.add(1);
+          }
+          return;
+        }
+        // tail是要接在磁盘上的文件(未压缩的文件或.gz)末尾的数据
+        const std::string *tail = &req.body;
+        if (data.m_fileStatus == FileDataManager::COMPRESSED) {
+          if (gzipped) {
+            // 解压一遍校验内容并得到原始长度, 损坏的成员会使整个.gz文件无法解压
+            ok = CompressUtil::decompressData(req.body, buf);
+            length = buf.size();
+          } else {
+            ok = CompressUtil::compressData(req.body, buf);
+            tail = &buf;
+          }
+        } else if (gzipped) {
+          ok = CompressUtil::decompressData(req.body, buf);
+          length = buf.size();
+          tail = &buf;
+        } else {
+          ok = true;
+        }
+        // 追加前的内容保存为历史版本
+        if (ok && length > 0) {
+          fdManager.preserveVersion(filepath, 0);
+        }
+        std::string target = (data.m_fileStatus == FileDataManager::COMPRESSED) ? filepath + ".gz" : filepath;
+        bool replaced = false;
+        ok = ok && _appendTail(target, *tail, replaced);
+        data.m_fileSize = offset + length;
+        data.m_fileATime = time(nullptr);
+        // 服务器不重新读整个文件, 追加后的哈希只能用客户端给出的值, 没有给出时为0, 由巡检补上
+        if (!_clientDigest(req, data.m_hash)) {
+          data.m_hash = 0;
+        }
+        std::vector<std::string> dirs;
+        if (replaced) {
+          dirs.push_back(filepath.substr(0, filepath.find_last_of("/")));
+        }
+        if (!ok || !fdManager.insertData(filepath, data) || !fdManager.sync(dirs)) {
+          res.status = 500;
+          return;
+        }
+        appends.add(1);
+        res.status = 200;
+      }
+      // 把tail接在file末尾并落盘, 落盘之后调用者才登记新的大小
+      // 历史版本是旧文件的硬链接, 与版本共用inode(链接数大于1)的文件不能原地追加, 否则保存的版本也随之改变:
+      // 复制一份(文件系统支持时reflink, 不复制数据块), 在副本上追加后rename替换, replaced返回true, 目录需要落盘
+      static bool _appendTail(const std::string &file, const std::string &tail, bool &replaced) {
+        struct stat buf;
+        if (stat(file.c_str(), &buf) != 0) {
+          return false;
+        }
+        if (buf.st_nlink <= 1) {
+          return MyUtil::appendFile(file, tail) && DurableFile::syncPath(file);
+        }
+        std::string tmp = DurableFile::tempName(file);
+        if (!DurableFile::copy(file, tmp) || !MyUtil::appendFile(tmp, tail) || !DurableFile::publish(tmp, file)) {
+          unlink(tmp.c_str());
+          return false;
+        }
+        replaced = true;
+        return true;
+      }
+      // 段中的记录不能原地追加: 读出原来的内容接上新内容后重新保存, 变大之后改为单独的文件
+      // 整个内容都在内存中, 与客户端给出的哈希不一致时说明两边原来的内容不同, 返回409让客户端完整上传
+      static int _appendSegment(const httplib::Request &req, const std::string &filepath,
+          const FileDataManager::FileData &data, bool gzipped) {
+        std::string content, buf;
+        if (!fdManager.readSegment(data, content) || (gzipped && !CompressUtil::decompressData(req.body, buf))) {
+          return 500;
+        }
+        content.append(gzipped ? buf : req.body);
+        uint64_t hash = XXHash64::hash(content), sent;
+        if (_clientDigest(req, sent) && sent != hash) {
+          CB_LOG(INFO, "http.append_conflict").str("path", filepath).str("expected", XXHash64::toHex(sent))
+            .str("actual", XXHash64::toHex(hash));
+          return 409;
+        }
+        fdManager.preserveVersion(filepath, hash);
+        if (fdManager.useSegment(content.size())) {
+          return _storeSegment(filepath, content) ? 200 : 500;
+        }
+        std::string dirpath = filepath.substr(0, filepath.find_last_of("/"));
+        if (!boost::filesystem::exists(dirpath)) {
+          boost::filesystem::create_directories(dirpath);
+        }
+        bool ok = DurableFile::write(filepath, content) && fdManager.insertData(filepath, hash) && fdManager.sync({ dirpath });
+        return ok ? 200 : 500;
       }
       static void _profile(const httplib::Request &req, httplib::Response &res) {
-        printf("profile:> [%s]\n", req.matches[0].str().c_str());
+        CB_LOG(INFO, "http.profile").str("path", req.path_params[0]);
 
         res.status = 301;
         res.body = "个人页面未完成，先跳转到暂定的暂时的界面...";
@@ -538,28 +2138,206 @@ namespace CloudBackup {
         res.set_header("Content-Type", "text/plain;charset=utf8");
       }
       static void _fileDownload(const httplib::Request &req, httplib::Response &res) {
-        printf("download:> [%s]\n", req.matches[0].str().c_str());
-        std::string filepath = "/data/CloudBackup/" + req.matches[1].str();
-        if (!fdManager.isExistFile(filepath)) {
+        CB_LOG(INFO, "http.download").str("path", req.path_params[0]);
+        std::string filepath = "/data/CloudBackup/" + req.path_params[1];
+        if (req.has_param("version")) {
+          _versionDownload(req, res, filepath);
+          return;
+        }
+        FileDataManager::FileData data;
+        if (!fdManager.findData(filepath, data)) {
           res.status = 404;
           return;
         }
-        if (fdManager.isCompressedFile(filepath)) {
-          fdManager.changeData(filepath);
-          CompressUtil::decompress(filepath + ".gz", filepath);
-          unlink((filepath + ".gz").c_str());
+        // 内容的哈希作为ETag, 同时在Digest头中给出, 客户端可以校验收到的内容; 哈希未知时用大小和修改时间作弱ETag
+        // 索引中的时间在每次上传或追加时更新, 作为Last-Modified
+        // 验证器都来自索引, 条件请求命中时不读文件, 也不解压冷文件
+        std::string etag;
+        if (data.m_hash != 0) {
+          std::string hex = XXHash64::toHex(data.m_hash);
+          etag = "\"" + hex + "\"";
+          res.set_header("Digest", "xxh64=" + hex);
+        } else {
+          etag = "W/\"" + std::to_string(data.m_fileSize) + "-" + std::to_string(data.m_fileATime) + "\"";
+        }
+        if (_notModified(req, res, etag, data.m_fileATime)) {
+          return;
+        }
+        // HEAD只需要头部, 长度取自索引, 同样不读文件也不解压冷文件
+        if (req.method == "HEAD") {
+          res.status = 200;
+          res.set_header("Content-Type", "application/octet-stream");
+          if (data.m_fileSize > 0) {
+            res.set_content_provider(data.m_fileSize, [](size_t, size_t, httplib::DataSink &) {});
+          }
+          return;
+        }
+        // 未压缩的小文件: 命中内存缓存时不读磁盘; 未命中时整个读到内存中返回, 并交给缓存按访问频率决定是否保留
+        if (fdManager.cacheable(data)) {
+          std::shared_ptr<const std::string> content = fdManager.cachedContent(filepath, data);
+          if (!content) {
+            std::string buf;
+            if (!_readSmallFile(filepath, data, buf)) {
+              res.status = 500;
+              return;
+            }
+            content = std::make_shared<const std::string>(std::move(buf));
+            fdManager.cacheContent(filepath, data, content);
+          }
+          res.status = 200;
+          res.set_header("Content-Type", "application/octet-stream");
+          if (!content->empty()) {
+            res.set_content_provider(content->size(), [content](size_t offset, size_t length, httplib::DataSink &sink) {
+              sink.write(content->data() + offset, length);
+            });
+          }
+          return;
+        }
+        // 段中的都是小文件, 直接读到内存中返回
+        if (data.m_fileStatus == FileDataManager::SEGMENT) {
+          std::string content;
+          if (!_readSmallFile(filepath, data, content)) {
+            res.status = 500;
+            return;
+          }
+          res.status = 200;
+          res.set_content(std::move(content), "application/octet-stream");
+          return;
+        }
+        bool cold = (data.m_fileStatus == FileDataManager::COMPRESSED);
+        if (cold) {
+          _decompressCold(filepath, data);
+        }
+        cold = UringContext::s_directIO 
+          && (cold || MyUtil::isNonHotFile(filepath, FileManageModule::intervalTime()));
+        auto reader = std::make_shared<UringReader>();
+        if (!reader->open(filepath, cold)) {
+          res.status = 500;
+          return;
         }
-        MyUtil::readFile(filepath, res.body);
         res.status = 200;
         res.set_header("Content-Type", "application/octet-stream");
-        res.set_header("Content-Length", std::to_string(res.body.size()));
+        if (reader->size() > 0) {
+          res.set_content_provider(reader->size(), [reader](size_t offset, size_t length, httplib::DataSink &sink) {
+            reader->read(offset, length, sink);
+          });
+        }
+      }
+      // 下载前把冷文件解压成普通文件: 解压到临时文件, 落盘并rename之后才改索引和删除.gz, 中途崩溃时.gz仍然完整
+      // 解压不持路径锁, 完成后在锁内确认索引项没有变化; 期间被追加或覆盖时按新的索引项重来
+      // 同时下载同一个文件的请求各自解压, 先完成的删除.gz之后, 其余的在锁内看到已经解压, 直接读取解压好的文件
+      static void _decompressCold(const std::string &filepath, FileDataManager::FileData data) {
+        static Histogram &latency = Metrics::histogram("cloudbackup_decompress_duration_seconds",
+            "Time to decompress a cold file before download", "", 16, 38);
+        for (int retry = 0; retry < m_s_DecompressRetries && data.m_fileStatus == FileDataManager::COMPRESSED; ++retry) {
+          std::string tmp = DurableFile::tempName(filepath);
+          bool ok;
+          {
+            MetricTimer timer(latency);
+            ok = CompressUtil::decompress(filepath + ".gz", tmp) && DurableFile::syncPath(tmp);
+          }
+          std::unique_lock<std::mutex> lock = fdManager.lockPath(filepath);
+          if (!ok || !fdManager.unchanged(filepath, data)) {
+            unlink(tmp.c_str());
+            if (!fdManager.findData(filepath, data)) {
+              return;
+            }
+            continue;
+          }
+          if (DurableFile::commit(tmp, filepath) && fdManager.changeData(filepath, FileDataManager::NORMAL)
+              && fdManager.sync()) {
+            unlink((filepath + ".gz").c_str());
+          }
+          return;
+        }
+      }
+      // 下载历史版本: /download/<路径>?version=<版本号>, 版本号来自/versions
+      // 版本的内容不会改变, 有哈希时同样用作ETag
+      static void _versionDownload(const httplib::Request &req, httplib::Response &res, const std::string &filepath) {
+        char *end = nullptr;
+        std::string param = req.get_param_value("version");
+        uint64_t id = strtoull(param.c_str(), &end, 10);
+        VersionStore::Version version;
+        if (param.empty() || *end != '\0' || !fdManager.versions().find(filepath, id, version)) {
+          res.status = 404;
+          return;
+        }
+        std::string etag = "W/\"v" + std::to_string(version.m_id) + "-" + std::to_string(version.m_size) + "\"";
+        if (version.m_hash != 0) {
+          std::string hex = XXHash64::toHex(version.m_hash);
+          etag = "\"" + hex + "\"";
+          res.set_header("Digest", "xxh64=" + hex);
+        }
+        if (_notModified(req, res, etag, version.m_mtime)) {
+          return;
+        }
+        // 后台任务可能刚好把raw版本转换成块, 重新查一次
+        auto reader = std::make_shared<VersionStore::Reader>();
+        if (!reader->open(fdManager.versions(), filepath, version)) {
+          reader = std::make_shared<VersionStore::Reader>();
+          if (!fdManager.versions().find(filepath, id, version) || !reader->open(fdManager.versions(), filepath, version)) {
+            res.status = 500;
+            return;
+          }
+        }
+        res.status = 200;
+        res.set_header("Content-Type", "application/octet-stream");
+        if (reader->size() > 0) {
+          res.set_content_provider(reader->size(), [reader](size_t offset, size_t length, httplib::DataSink &sink) {
+            std::string buf;
+            if (!reader->read(offset, std::min(length, m_s_VersionReadSize), buf) || buf.empty()) {
+              CB_LOG(ERROR, "version.read_failed").num("offset", offset);
+              sink.done();
+              return;
+            }
+            sink.write(buf.data(), buf.size());
+          });
+        }
+      }
+      // 列出文件的历史版本(JSON), 新的在前: {"path":..., "versions":[{"version":..., "size":..., "mtime":..., "replaced":..., "hash":...}]}
+      static void _versionList(const httplib::Request &req, httplib::Response &res) {
+        CB_LOG(INFO, "http.versions").str("path", req.path_params[0]);
+        std::string filepath = "/data/CloudBackup/" + req.path_params[1];
+        std::vector<VersionStore::Version> versions;
+        if (!fdManager.versions().list(filepath, versions) && !fdManager.isExistFile(filepath)) {
+          res.status = 404;
+          return;
+        }
+        std::string buf = "{\"path\":\"";
+        MyUtil::jsonEscape(req.path_params[1], buf);
+        buf += "\",\"versions\":[";
+        for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+          buf += (it == versions.rbegin()) ? "{" : ",{";
+          buf += "\"version\":" + std::to_string(it->m_id) + ",\"size\":" + std::to_string(it->m_size)
+            + ",\"mtime\":" + std::to_string(it->m_mtime) + ",\"replaced\":" + std::to_string(it->m_replaced)
+            + ",\"hash\":" + (it->m_hash != 0 ? "\"" + XXHash64::toHex(it->m_hash) + "\"}" : "null}");
+        }
+        buf += "]}";
+        res.status = 200;
+        res.set_content(buf, "application/json");
+      }
+      // 把未压缩的文件整个读到dst中; 段中的内容返回之前顺便校验
+      static bool _readSmallFile(const std::string &filepath, const FileDataManager::FileData &data, std::string &dst) {
+        if (data.m_fileStatus != FileDataManager::SEGMENT) {
+          return MyUtil::readFile(filepath, dst);
+        }
+        static Counter &corrupt = Metrics::counter("cloudbackup_corrupt_files_total",
+            "Files whose content no longer matches the hash in the index", "source=\"download\"");
+        if (!fdManager.readSegment(data, dst)) {
+          return false;
+        }
+        if (data.m_hash != 0 && XXHash64::hash(dst) != data.m_hash) {
+          CB_LOG(ERROR, "segment.corrupt").str("path", filepath).num("segment", data.m_segment).num("offset", data.m_offset);
+          corrupt.add(1);
+          return false;
+        }
+        return true;
       }
       static void _fileList(const httplib::Request &req, httplib::Response &res) {
-        printf("list:> [%s]\n", req.matches[0].str().c_str());
+        CB_LOG(INFO, "http.list").str("path", req.path_params[0]);
 
-        std::string uid = req.matches[1].str();
+        std::string uid = req.path_params[1];
         std::string cookie = req.get_header_value("Cookie");
-        std::cout << "Cookie:> " << cookie << std::endl;
         if (!m_db.cookieCheck(cookie, uid)) {
           res.status = 301;
           res.set_redirect("/index.html");
@@ -567,19 +2345,17 @@ namespace CloudBackup {
           return;
         }
 
-        std::string dirpath, pathtmp, filename, parentDirpath;
+        std::string dirpath, parentDirpath;
         std::stringstream buf;
-        std::vector<std::string> fileList;
-        if (req.matches[0].str() == "/list/" + uid) {
+        if (req.path_params[0] == "/list/" + uid) {
           dirpath = "/data/CloudBackup/" + uid;
           parentDirpath = "/data/CloudBackup/" + uid;
         } else {
-          dirpath = "/data/CloudBackup/" + uid + "/" + req.matches[2].str();
+          dirpath = "/data/CloudBackup/" + uid + "/" + req.path_params[2];
           parentDirpath = dirpath.substr(0, dirpath.rfind("/", dirpath.size() - 2) + 1);
         }
-        fdManager.getDirList(dirpath, fileList);
         std::string indexPath = "(" + m_db.getNickname(uid) + "):/"
-          + dirpath.substr(17 + uid.size() + 2);
+          + dirpath.substr(std::min(dirpath.size(), 17 + uid.size() + 2));
         buf << "<html>\r\n"
           << "\t<head><title>Index of " << indexPath << "</title></head>\r\n\r\n"
           << "\t<body>\r\n"
@@ -588,47 +2364,22 @@ namespace CloudBackup {
           << "\t<a href=\"/clist/\">公共文件</a>\r\n"
           << "\t\t<h1>Index of " << indexPath << "</h1><hr><pre>\r\n"
           << "<a href='/list/" << parentDirpath.substr(17) << "'>../</a>\r\n";
-        for (std::vector<std::string>::size_type i = 0; i < fileList.size(); ++i) {
-          pathtmp = fileList[i].substr(18);
-          filename = pathtmp.substr(pathtmp.rfind("/") + 1);
-          if (boost::filesystem::is_directory(fileList[i])) {
-            buf << "<a href='/list/" << pathtmp << "/'>" << filename << "/</a>"
-              << std::string(99, ' ') << "\t\t\t  -" << std::string(17, ' ')
-              << "\t  -<br>";
-          } else {
-            std::string filesize = fdManager.getFileSize(fileList[i]);
-            buf << "<a href='/download/" << uid << "/" << pathtmp << "'>" << filename << "</a>"
-              << std::string((filename.size() < 100) ? 100 - filename.size() : 0, ' ') 
-              << "\t\t\t大小: " << filesize 
-              << std::string((filesize.size() < 20) ? 20 - filesize.size() : 0, ' ') 
-              << "\t最近访问: " << fdManager.getAtime(fileList[i]);
-          }
-        }
-        buf << "</pre>\r\n\t\t</hr>\r\n\t</body>\r\n"
-          << "</html>";
-        res.body = buf.str();
-        res.status = 200;
-        res.set_header("Content-Type", "text/html;charset=utf8");
-        res.set_header("Content-Length", std::to_string(res.body.size()));
+        _listResponse(req, res, dirpath, "/list/", buf.str());
       }
       static void _cfileList(const httplib::Request &req, httplib::Response &res) {
-        printf("clist:> [%s]\n", req.matches[0].str().c_str());
+        CB_LOG(INFO, "http.clist").str("path", req.path_params[0]);
 
         auto cookie = req.get_header_value("Cookie");
-        std::cout << "Cookie:> " << cookie << std::endl;
 
-        std::string dirpath, pathtmp, filename, parentDirpath;
+        std::string dirpath, parentDirpath;
         std::stringstream buf;
-        std::vector<std::string> fileList;
-
-        if (req.matches[0].str() == "/clist/") {
+        if (req.path_params[0] == "/clist/") {
           dirpath = "/data/CloudBackup/";
           parentDirpath = "/data/CloudBackup/";
         } else {
-          dirpath = "/data/CloudBackup/" + req.matches[1].str();
+          dirpath = "/data/CloudBackup/" + req.path_params[1];
           parentDirpath = dirpath.substr(0, dirpath.rfind("/", dirpath.size() - 2) + 1);
         }
-        fdManager.getDirList(dirpath, fileList);
         buf << "<html>\r\n"
           << "\t<head><title>Index of "<< dirpath.substr(17) << "</title></head>\r\n\r\n"
           << "\t<body>\r\n";
@@ -643,34 +2394,183 @@ namespace CloudBackup {
         buf << "\t<a href='/clist/'>公共文件</a>\r\n"
           << "\t\t<h1>Index of " << dirpath.substr(17)  << "</h1><hr><pre>\r\n"
           << "<a href='/clist" << parentDirpath.substr(17) << "'>../</a>\r\n";
-        for (std::vector<std::string>::size_type i = 0; i < fileList.size(); ++i) {
-          pathtmp = fileList[i].substr(18);
-          filename = pathtmp.substr(pathtmp.rfind("/") + 1);
-          if (boost::filesystem::is_directory(fileList[i])) {
-            buf << "<a href='/clist/" << pathtmp << "/'>" << filename << "/</a>"
-              << std::string(99, ' ') << "\t\t\t  -" << std::string(17, ' ')
-              << "\t  -<br>";
+        _listResponse(req, res, dirpath, "/clist/", buf.str());
+      }
+    private:
+      // 一次目录列表响应的输出状态, 在多次chunk回调之间保存
+      struct ListState
+      {
+        std::string m_dirpath;    // 不带结尾'/'的目录绝对路径
+        std::string m_listPrefix; // 子目录链接的前缀, /list/或/clist/
+        std::string m_head;       // 尚未输出的页面头部
+        std::string m_cursor;     // 下一批目录项的起点
+        size_t m_limit;           // 每页的目录项数, 0表示不限
+        size_t m_remain;          // 本页还需输出的目录项数
+        bool m_json;
+        bool m_first;
+      };
+      // 按cursor分页, 并以chunked方式分批输出目录列表, 内存占用与目录大小无关
+      // 请求参数: cursor 翻页位置, limit 每页项数(0表示整个目录), format=json 输出json
+      static void _listResponse(const httplib::Request &req, httplib::Response &res,
+          const std::string &dirpath, const std::string &listPrefix, const std::string &head) {
+        auto state = std::make_shared<ListState>();
+        state->m_dirpath = dirpath;
+        while (!state->m_dirpath.empty() && state->m_dirpath.back() == '/') {
+          state->m_dirpath.pop_back();
+        }
+        state->m_listPrefix = listPrefix;
+        state->m_cursor = req.get_param_value("cursor");
+        state->m_limit = req.has_param("limit") ? 
+          strtoul(req.get_param_value("limit").c_str(), nullptr, 10) : m_s_ListPageSize;
+        state->m_remain = state->m_limit;
+        state->m_json = (req.get_param_value("format") == "json");
+        state->m_first = true;
+        if (state->m_json) {
+          state->m_head = "{\"path\":\"";
+          MyUtil::jsonEscape(state->m_dirpath.substr(std::min(state->m_dirpath.size(), m_s_RootPathSize)), state->m_head);
+          state->m_head += "\",\"entries\":[";
+        } else {
+          state->m_head = head;
+        }
+
+        // 目录列表的弱ETag: 目录的版本加上请求参数和页面头部的哈希, 目录没有变化时不遍历索引, 直接返回304
+        time_t mtime;
+        XXHash64 params;
+        for (const std::string &part : { head, state->m_cursor, std::to_string(state->m_limit), req.get_param_value("format") }) {
+          params.update(part.data(), part.size() + 1);
+        }
+        std::string etag = "W/\"" + fdManager.dirTag(state->m_dirpath, mtime) + "-" + XXHash64::toHex(params.digest()) + "\"";
+        if (_notModified(req, res, etag, mtime)) {
+          return;
+        }
+        res.status = 200;
+        res.set_header("Content-Type", state->m_json ? "application/json;charset=utf8" : "text/html;charset=utf8");
+        res.set_chunked_content_provider([state](size_t offset, httplib::DataSink &sink) {
+          _writeListChunk(*state, sink);
+        });
+      }
+      // 设置ETag和Last-Modified; 条件请求表明客户端的副本仍然有效时回复304并返回true
+      // 有If-None-Match时只看它(弱比较, *匹配任何存在的资源), 否则看If-Modified-Since
+      static bool _notModified(const httplib::Request &req, httplib::Response &res, const std::string &etag, time_t mtime) {
+        res.set_header("ETag", etag);
+        res.set_header("Last-Modified", MyUtil::httpDate(mtime));
+        bool match = false;
+        if (req.has_header("If-None-Match")) {
+          std::string tags = req.get_header_value("If-None-Match");
+          boost::string_view opaque = _opaqueTag(etag);
+          for (size_t begin = 0; begin < tags.size() && !match; ) {
+            size_t end = tags.find(',', begin);
+            if (end == std::string::npos) {
+              end = tags.size();
+            }
+            boost::string_view tag(tags.data() + begin, end - begin);
+            while (!tag.empty() && tag.front() == ' ') {
+              tag.remove_prefix(1);
+            }
+            while (!tag.empty() && tag.back() == ' ') {
+              tag.remove_suffix(1);
+            }
+            match = (tag == "*" || _opaqueTag(tag) == opaque);
+            begin = end + 1;
+          }
+        } else if (req.has_header("If-Modified-Since")) {
+          time_t since;
+          match = MyUtil::parseHttpDate(req.get_header_value("If-Modified-Since"), since) && mtime <= since;
+        }
+        if (match) {
+          res.status = 304;
+        }
+        return match;
+      }
+      // 弱比较时去掉W/前缀
+      static boost::string_view _opaqueTag(boost::string_view tag) {
+        if (tag.starts_with("W/")) {
+          tag.remove_prefix(2);
+        }
+        return tag;
+      }
+      static void _writeListChunk(ListState &state, httplib::DataSink &sink) {
+        std::string buf, next;
+        buf.swap(state.m_head);
+        size_t batch = m_s_ListBatchSize;
+        if (state.m_limit != 0 && state.m_remain < batch) {
+          batch = state.m_remain;
+        }
+        std::vector<FileDataManager::DirEntry> entries;
+        fdManager.getDirPage(state.m_dirpath, state.m_cursor, batch, entries, next);
+        // 相对于/data/CloudBackup/的路径前缀
+        std::string relDir = (state.m_dirpath.size() > m_s_RootPathSize) ? 
+          state.m_dirpath.substr(m_s_RootPathSize) + "/" : "";
+        for (auto &entry : entries) {
+          if (state.m_json) {
+            buf += state.m_first ? "{\"name\":\"" : ",{\"name\":\"";
+            MyUtil::jsonEscape(entry.m_name, buf);
+            if (entry.m_isDir) {
+              buf += "\",\"type\":\"dir\"}";
+            } else {
+              buf += "\",\"type\":\"file\",\"size\":" + std::to_string(entry.m_fileSize)
+                + ",\"atime\":" + std::to_string(entry.m_fileATime)
+                + ",\"compressed\":" + (entry.m_isCompressed ? "true}" : "false}");
+            }
+          } else if (entry.m_isDir) {
+            buf += "<a href='" + state.m_listPrefix + relDir + entry.m_name + "/'>" + entry.m_name + "/</a>"
+              + std::string(99, ' ') + "\t\t\t  -" + std::string(17, ' ') + "\t  -<br>";
           } else {
-            std::string filesize = fdManager.getFileSize(fileList[i]);
-            buf << "<a href='/download/" << pathtmp << "'>" << filename << "</a>"
-              << std::string((filename.size() < 100) ? 100 - filename.size() : 0, ' ') 
-              << "\t\t\t大小: " << filesize 
-              << std::string((filesize.size() < 20) ? 20 - filesize.size() : 0, ' ') 
-              << "\t最近访问: " << fdManager.getAtime(fileList[i]);
+            std::string filesize = std::to_string(entry.m_fileSize);
+            buf += "<a href='/download/" + relDir + entry.m_name + "'>" + entry.m_name + "</a>"
+              + std::string((entry.m_name.size() < 100) ? 100 - entry.m_name.size() : 0, ' ') 
+              + "\t\t\t大小: " + filesize 
+              + std::string((filesize.size() < 20) ? 20 - filesize.size() : 0, ' ') 
+              + "\t最近访问: " + MyUtil::formatTime(entry.m_fileATime) + "\n";
           }
+          state.m_first = false;
         }
-        buf << "</pre>\r\n\t\t</hr>\r\n\t</body>\r\n"
-          << "</html>";
-        res.body = buf.str();
-        res.status = 200;
-        res.set_header("Content-Type", "text/html;charset=utf8");
-        res.set_header("Content-Length", std::to_string(res.body.size()));
+        state.m_cursor = next;
+        if (state.m_limit != 0) {
+          state.m_remain -= entries.size();
+        }
+        if (next.empty() || (state.m_limit != 0 && state.m_remain == 0)) {
+          // 本页结束, 输出尾部并给出下一页的cursor
+          if (state.m_json) {
+            buf += "],\"next\":";
+            if (next.empty()) {
+              buf += "null}";
+            } else {
+              buf += "\"";
+              MyUtil::jsonEscape(next, buf);
+              buf += "\"}";
+            }
+          } else {
+            if (!next.empty()) {
+              buf += "<a href='?cursor=" + MyUtil::urlEncode(next) 
+                + "&limit=" + std::to_string(state.m_limit) + "'>下一页</a>\r\n";
+            }
+            buf += "</pre>\r\n\t\t</hr>\r\n\t</body>\r\n</html>";
+          }
+          sink.write(buf.data(), buf.size());
+          sink.done();
+          return;
+        }
+        sink.write(buf.data(), buf.size());
       }
     private:
-      httplib::Server m_srv;
+      std::unique_ptr<httplib::Server> m_srv;
+      Router m_router;
       static MysqlModule m_db;
+      static std::atomic<WorkStealingPool *> m_s_pool; // 当前使用的工作窃取线程池, 用于查看队列状态
+      static const size_t m_s_ListPageSize = 1000; // 默认每页的目录项数
+      static const size_t m_s_ListBatchSize = 256; // 每个chunk的目录项数
+      static const size_t m_s_RootPathSize = 18;   // "/data/CloudBackup/"的长度
+      static const size_t m_s_VersionReadSize = 256 * 1024; // 下载历史版本时每次读取的字节数
+      static const int m_s_DecompressRetries = 3;           // 冷文件解压期间被修改时最多重来的次数
   };
+  const size_t HttpServerModule::m_s_ListPageSize;
+  const size_t HttpServerModule::m_s_ListBatchSize;
+  const size_t HttpServerModule::m_s_RootPathSize;
+  const size_t HttpServerModule::m_s_VersionReadSize;
+  const int HttpServerModule::m_s_DecompressRetries;
   MysqlModule HttpServerModule::m_db;
+  std::atomic<WorkStealingPool *> HttpServerModule::m_s_pool(nullptr);
   }
 
 #endif /* _CLOUDBACKUP_HPP_ */ 
@@ -6,6 +6,16 @@ void thr_hotfile()
   CloudBackup::FileManageModule fm;
   fm.start();
 }
+void thr_scrub()
+{
+  CloudBackup::ScrubModule sm;
+  sm.start();
+}
+void thr_version()
+{
+  CloudBackup::VersionModule vm;
+  vm.start();
+}
 void thr_httpserv()
 {
   CloudBackup::HttpServerModule srv;
@@ -15,8 +25,12 @@ void thr_httpserv()
 int main(int argc, char *argv[])
 {
   std::thread hotfile(thr_hotfile);
+  std::thread scrub(thr_scrub);
+  std::thread version(thr_version);
   std::thread httpserv(thr_httpserv);
   hotfile.join();
+  scrub.join();
+  version.join();
   httpserv.join();
 
   return 0;
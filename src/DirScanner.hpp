@@ -0,0 +1,183 @@
+#ifndef _DIRSCANNER_HPP_
+#define _DIRSCANNER_HPP_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace CloudBackup {
+  // 多线程目录扫描: 待扫描的目录放在共享的栈中, 各线程取出一个目录后用getdents64整块读取目录项
+  // 目录项自带类型(d_type), 子目录不需要stat就能识别, 只对普通文件(和类型未知的项)在已打开的目录上fstatat
+  // 与boost::filesystem::recursive_directory_iterator + is_directory + stat相比, 每个文件只有一次系统调用, 而且不重复解析完整路径
+  class DirScanner
+  {
+    public:
+      struct Entry
+      {
+        std::string m_path;
+        struct stat m_stat; // 扫描时的stat结果, 记录到文件信息表时不需要再stat一次
+      };
+
+      // threadNum为0时使用CPU核数
+      explicit DirScanner(size_t threadNum = 0) : m_threadNum(threadNum) {
+        if (m_threadNum == 0) {
+          m_threadNum = std::max(1u, std::thread::hardware_concurrency());
+        }
+      }
+      // 扫描root下的所有普通文件, 符号链接的处理与recursive_directory_iterator相同: 指向文件的算作文件, 指向目录的不进入
+      // filter(path, st)在各扫描线程中并发调用, 必须是线程安全的, 返回true的文件放入files(顺序不固定)
+      // root不是目录时返回false; 子目录打不开时跳过并输出错误, 不影响其余部分
+      template <typename Filter>
+      bool scan(const std::string &root, Filter filter, std::vector<Entry> &files) {
+        struct stat buf;
+        if (stat(root.empty() ? "/" : root.c_str(), &buf) < 0 || !S_ISDIR(buf.st_mode)) {
+          std::cout << "scan dir " << root << " error" << std::endl;
+          return false;
+        }
+        Shared shared;
+        shared.m_dirs.push_back(root);
+        shared.m_pending = 1;
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < m_threadNum; ++i) {
+          threads.emplace_back([&]() { _worker(shared, filter, files); });
+        }
+        _worker(shared, filter, files);
+        for (auto &t : threads) {
+          t.join();
+        }
+        return true;
+      }
+      size_t threadNum() const {
+        return m_threadNum;
+      }
+    private:
+      struct Shared
+      {
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        std::vector<std::string> m_dirs; // 按栈使用, 深度优先, 待扫描的目录不会堆积太多
+        size_t m_pending;                // 栈中和正在扫描的目录数, 为0时扫描结束
+      };
+      // 内核返回的目录项格式, glibc没有导出
+      struct LinuxDirent64
+      {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+      };
+
+      template <typename Filter>
+      void _worker(Shared &shared, Filter &filter, std::vector<Entry> &files) {
+        std::vector<char> buf(m_s_BufSize);
+        std::vector<std::string> subdirs;
+        std::vector<Entry> found;
+        std::string dir;
+        while (_pop(shared, dir)) {
+          subdirs.clear();
+          _scanDir(dir, buf, filter, subdirs, found);
+          std::lock_guard<std::mutex> lock(shared.m_mutex);
+          shared.m_pending += subdirs.size();
+          --shared.m_pending;
+          for (auto &sub : subdirs) {
+            shared.m_dirs.push_back(std::move(sub));
+          }
+          if (!subdirs.empty() || shared.m_pending == 0) {
+            shared.m_cond.notify_all();
+          }
+        }
+        std::lock_guard<std::mutex> lock(shared.m_mutex);
+        files.insert(files.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+      }
+      // 取出一个待扫描的目录, 所有目录都扫描完时返回false
+      static bool _pop(Shared &shared, std::string &dir) {
+        std::unique_lock<std::mutex> lock(shared.m_mutex);
+        shared.m_cond.wait(lock, [&shared]() { return !shared.m_dirs.empty() || shared.m_pending == 0; });
+        if (shared.m_dirs.empty()) {
+          return false;
+        }
+        dir = std::move(shared.m_dirs.back());
+        shared.m_dirs.pop_back();
+        return true;
+      }
+      template <typename Filter>
+      void _scanDir(const std::string &dir, std::vector<char> &buf, Filter &filter,
+        std::vector<std::string> &subdirs, std::vector<Entry> &found) {
+        int fd = open(dir.empty() ? "/" : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+          std::cout << "open dir " << dir << " error: " << strerror(errno) << std::endl;
+          return;
+        }
+        std::string path = dir + '/';
+        size_t prefix = path.size();
+        struct stat st;
+        while (true) {
+          long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+          if (n <= 0) {
+            if (n < 0) {
+              std::cout << "read dir " << dir << " error: " << strerror(errno) << std::endl;
+            }
+            break;
+          }
+          for (long off = 0; off < n; ) {
+            const LinuxDirent64 *d = reinterpret_cast<const LinuxDirent64 *>(buf.data() + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+              continue;
+            }
+            path.resize(prefix);
+            path.append(name);
+            if (d->d_type == DT_DIR) {
+              subdirs.push_back(path);
+              continue;
+            }
+            if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) {
+              continue;
+            }
+            // 部分文件系统不填d_type, 此时先不跟随符号链接stat一次区分出目录
+            if (d->d_type == DT_UNKNOWN) {
+              if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+              }
+              if (S_ISDIR(st.st_mode)) {
+                subdirs.push_back(path);
+                continue;
+              }
+              if (S_ISREG(st.st_mode) && filter(path, st)) {
+                found.push_back(Entry{ path, st });
+                continue;
+              }
+              if (!S_ISLNK(st.st_mode)) {
+                continue;
+              }
+            }
+            if (fstatat(fd, name, &st, 0) < 0) {
+              std::cout << "get " << path << " stat error" << std::endl;
+              continue;
+            }
+            if (S_ISREG(st.st_mode) && filter(path, st)) {
+              found.push_back(Entry{ path, st });
+            }
+          }
+        }
+        close(fd);
+      }
+    private:
+      size_t m_threadNum;
+      static const size_t m_s_BufSize = 64 * 1024;
+  };
+}
+
+#endif /* _DIRSCANNER_HPP_ */
@@ -0,0 +1,322 @@
+#ifndef _DURABLEFILE_HPP_
+#define _DURABLEFILE_HPP_
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "UringIO.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int) // <linux/fs.h>, 与<sys/mount.h>冲突, 不直接包含
+#endif
+
+namespace CloudBackup {
+  // 上传的提交顺序: 写临时文件 -> 临时文件落盘 -> rename成目标文件 -> 登记索引 -> 目录和索引日志落盘
+  // 读者要么看到旧文件要么看到完整的新文件; 崩溃后索引中登记的文件一定是完整的
+  // 崩溃时残留的临时文件(文件名带.cbtmp)不在索引中, 不会被列出或下载, 由FileManageModule定期删除
+  // 落盘方式(uploadSync):
+  //   none  不落盘, 只保证原子替换
+  //   fsync 每个文件单独fdatasync
+  //   group 同一文件系统上同时等待落盘的文件合并成一组, 由组中的一个请求者先对整组发起回写, 再逐个fdatasync,
+  //         日志文件系统上第一次fdatasync提交的日志已经包含了整组的元数据, 其余的几乎不再等待;
+  //         只落盘组中的文件, 不牵连同一文件系统上其它无关的脏数据(不用syncfs), 每个文件的错误单独报告
+  class DurableFile
+  {
+    // 一组一起落盘的文件, m_ok与m_fds一一对应
+    struct Group
+    {
+      bool m_done = false;
+      std::vector<int> m_fds;
+      std::vector<char> m_ok;
+    };
+    // 每个文件系统同时只有一组在落盘, 进行期间到达的请求加入下一组
+    struct Device
+    {
+      bool m_syncing = false;
+      std::shared_ptr<Group> m_next;
+    };
+    public:
+      enum Mode { NONE, FSYNC, GROUP };
+      static std::atomic<int> s_mode;
+
+      static void configure(const std::string &mode) {
+        if (mode == "none") {
+          s_mode = NONE;
+        } else if (mode == "fsync") {
+          s_mode = FSYNC;
+        } else {
+          s_mode = GROUP;
+        }
+      }
+      // 与name在同一目录下的临时文件名, 同时写同一个文件的请求互不干扰
+      static std::string tempName(const std::string &name) {
+        static std::atomic<unsigned long> seq(0);
+        return name + ".cbtmp" + std::to_string(++seq);
+      }
+      // path是tempName生成的临时文件名(以".cbtmp<序号>"结尾); 用户的文件也可能叫这个名字, 需要再查索引区分
+      static bool isTempName(const std::string &path) {
+        size_t pos = path.rfind(".cbtmp");
+        return pos != std::string::npos && pos + 6 < path.size()
+          && path.find_first_not_of("0123456789", pos + 6) == std::string::npos;
+      }
+      // 已经写好的临时文件落盘后rename成name, 失败时删除临时文件
+      static bool publish(const std::string &tmp, const std::string &name) {
+        if (!syncPath(tmp)) {
+          CB_LOG(ERROR, "durable.sync_failed").str("path", tmp).num("errno", errno);
+          unlink(tmp.c_str());
+          return false;
+        }
+        return commit(tmp, name);
+      }
+      // 已经落盘的临时文件rename成name, 失败时删除临时文件
+      // 与prepare分开调用时, 写入和落盘可以在调用者持锁之前完成, 锁内只做rename
+      static bool commit(const std::string &tmp, const std::string &name) {
+        if (rename(tmp.c_str(), name.c_str()) != 0) {
+          CB_LOG(ERROR, "durable.rename_failed").str("path", name).num("errno", errno);
+          unlink(tmp.c_str());
+          return false;
+        }
+        return true;
+      }
+      // 把src写入name的临时文件并落盘, 返回临时文件名, 失败时返回空串
+      static std::string prepare(const std::string &name, const std::string &src) {
+        std::string tmp = tempName(name);
+        if (!UringIO::writeFile(tmp, src)) {
+          unlink(tmp.c_str());
+          return std::string();
+        }
+        if (!syncPath(tmp)) {
+          CB_LOG(ERROR, "durable.sync_failed").str("path", tmp).num("errno", errno);
+          unlink(tmp.c_str());
+          return std::string();
+        }
+        return tmp;
+      }
+      // 用src替换name的内容
+      static bool write(const std::string &name, const std::string &src) {
+        std::string tmp = prepare(name, src);
+        return !tmp.empty() && commit(tmp, name);
+      }
+      // 把src复制为新文件dst, 不落盘(通常接着publish): 文件系统支持时用reflink共享数据块, 否则在内核中复制
+      static bool copy(const std::string &src, const std::string &dst) {
+        int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+          return false;
+        }
+        struct stat buf;
+        int out = -1;
+        bool ok = fstat(in, &buf) == 0
+          && (out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, buf.st_mode & 0777)) >= 0;
+        if (ok && ioctl(out, FICLONE, in) != 0) {
+          ok = _copyData(in, out, buf.st_size);
+        }
+        if (out >= 0) {
+          close(out);
+        }
+        close(in);
+        if (!ok) {
+          CB_LOG(ERROR, "durable.copy_failed").str("path", src).num("errno", errno);
+        }
+        return ok;
+      }
+      // 按配置的方式让fd的内容落盘
+      static bool sync(int fd) {
+        switch (s_mode.load()) {
+          case NONE:
+            return true;
+          case FSYNC:
+            return _fsync(fd);
+          default: {
+            struct stat buf;
+            return fstat(fd, &buf) == 0 && _groupSync(buf.st_dev, std::vector<int>(1, fd));
+          }
+        }
+      }
+      // 让一批文件或目录落盘; group方式下同一文件系统上的文件一起加入一组
+      static bool syncPaths(const std::vector<std::string> &paths) {
+        if (s_mode == NONE) {
+          return true;
+        }
+        std::map<dev_t, std::vector<int>> devices;
+        std::vector<int> fds;
+        bool ok = true;
+        for (const std::string &path : paths) {
+          int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+          struct stat buf;
+          if (fd < 0 || fstat(fd, &buf) < 0) {
+            ok = false;
+            if (fd >= 0) {
+              close(fd);
+            }
+            continue;
+          }
+          fds.push_back(fd);
+          if (s_mode == FSYNC) {
+            ok = _fsync(fd) && ok;
+          } else {
+            devices[buf.st_dev].push_back(fd);
+          }
+        }
+        for (auto &dev : devices) {
+          ok = _groupSync(dev.first, dev.second) && ok;
+        }
+        for (int fd : fds) {
+          close(fd);
+        }
+        return ok;
+      }
+      static bool syncPath(const std::string &path) {
+        return syncPaths(std::vector<std::string>(1, path));
+      }
+      // 批量提交: 先写出全部临时文件, 一起落盘后再逐个rename
+      class Batch
+      {
+        public:
+          Batch() = default;
+          Batch(const Batch &) = delete;
+          Batch &operator=(const Batch &) = delete;
+          ~Batch() {
+            for (auto &file : m_files) {
+              unlink(file.first.c_str());
+            }
+          }
+          bool add(const std::string &name, const std::string &src) {
+            std::string tmp = tempName(name);
+            if (!UringIO::writeFile(tmp, src)) {
+              unlink(tmp.c_str());
+              return false;
+            }
+            m_files.emplace_back(std::move(tmp), name);
+            return true;
+          }
+          // 按add的顺序返回每个文件是否已经rename成目标文件; 落盘失败时全部放弃
+          std::vector<bool> commit() {
+            std::vector<std::string> tmps;
+            for (auto &file : m_files) {
+              tmps.push_back(file.first);
+            }
+            bool synced = syncPaths(tmps);
+            std::vector<bool> done;
+            for (auto &file : m_files) {
+              bool ok = synced && rename(file.first.c_str(), file.second.c_str()) == 0;
+              if (!ok) {
+                CB_LOG(ERROR, "durable.commit_failed").str("path", file.second).num("errno", errno);
+                unlink(file.first.c_str());
+              }
+              done.push_back(ok);
+            }
+            m_files.clear();
+            return done;
+          }
+        private:
+          std::vector<std::pair<std::string, std::string>> m_files; // 临时文件, 目标文件
+      };
+    private:
+      // copy_file_range不可用(旧内核, 跨文件系统)时退化为read/write
+      static bool _copyData(int in, int out, off_t size) {
+        bool fallback = false;
+        char buf[m_s_CopyBufSize];
+        while (size > 0) {
+          ssize_t n;
+          if (!fallback) {
+            n = copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(size), 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+              fallback = true;
+              continue;
+            }
+          } else {
+            n = ::read(in, buf, std::min<off_t>(size, sizeof(buf)));
+            if (n > 0 && ::write(out, buf, n) != n) {
+              return false;
+            }
+          }
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n <= 0) {
+            return false;
+          }
+          size -= n;
+        }
+        return true;
+      }
+      static bool _fsync(int fd) {
+        static Counter &calls = Metrics::counter("cloudbackup_fsync_calls_total", "fdatasync calls issued", "");
+        static Histogram &duration = Metrics::histogram("cloudbackup_fsync_duration_seconds",
+            "Time spent in one fdatasync call", "", 12, 34);
+        MetricTimer timer(duration);
+        calls.add(1);
+        return fdatasync(fd) == 0;
+      }
+      // 组提交: 没有进行中的一组时由请求者自己执行, 否则加入下一组等待,
+      // 进行中的一组结束后由下一组中的一个请求者为整组落盘并唤醒整组
+      // 调用者在返回之前不能关闭fds
+      static bool _groupSync(dev_t devId, const std::vector<int> &fds) {
+        static Counter &requests = Metrics::counter("cloudbackup_fsync_group_requests_total",
+            "Requests served by group sync", "");
+        static Counter &rounds = Metrics::counter("cloudbackup_fsync_group_rounds_total",
+            "Group sync rounds; requests divided by rounds gives the group size", "");
+        static std::mutex mutex;
+        static std::condition_variable cond;
+        static std::map<dev_t, Device> devices;
+        requests.add(1);
+        std::unique_lock<std::mutex> lock(mutex);
+        Device &dev = devices[devId];
+        if (!dev.m_next) {
+          dev.m_next = std::make_shared<Group>();
+        }
+        std::shared_ptr<Group> group = dev.m_next;
+        size_t first = group->m_fds.size();
+        group->m_fds.insert(group->m_fds.end(), fds.begin(), fds.end());
+        while (!group->m_done) {
+          if (!dev.m_syncing) {
+            // 之后到达的请求的数据不一定在这一组落盘之前写入, 让它们组成新的一组
+            dev.m_syncing = true;
+            dev.m_next.reset();
+            lock.unlock();
+            rounds.add(1);
+            std::vector<char> ok = _syncGroup(group->m_fds);
+            lock.lock();
+            group->m_ok.swap(ok);
+            group->m_done = true;
+            dev.m_syncing = false;
+            cond.notify_all();
+            break;
+          }
+          cond.wait(lock);
+        }
+        for (size_t i = first; i < first + fds.size(); ++i) {
+          if (!group->m_ok[i]) {
+            return false;
+          }
+        }
+        return true;
+      }
+      // 先为所有文件发起回写, 让它们的数据一起写出, 再逐个等待
+      static std::vector<char> _syncGroup(const std::vector<int> &fds) {
+        for (int fd : fds) {
+          sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE); // 只是提示, 结果以fdatasync为准
+        }
+        std::vector<char> ok;
+        for (int fd : fds) {
+          ok.push_back(_fsync(fd));
+        }
+        return ok;
+      }
+      static const size_t m_s_CopyBufSize = 65536;
+  };
+  std::atomic<int> DurableFile::s_mode(DurableFile::GROUP);
+}
+
+#endif /* _DURABLEFILE_HPP_ */
@@ -0,0 +1,546 @@
+#ifndef _EPOLLSERVER_HPP_
+#define _EPOLLSERVER_HPP_
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include "httplib.h"
+#include "Logger.hpp"
+
+namespace CloudBackup {
+  // 基于epoll的httplib::Server
+  // 每个reactor线程有自己的监听socket(SO_REUSEPORT)和epoll实例, 负责accept和所有的非阻塞读:
+  // 请求头和请求体(Content-Length或chunked)在reactor中读进连接的缓冲区, 读完整之后才交给工作线程池(new_task_queue),
+  // 工作线程池是单独的阻塞IO线程池, 在其中解析请求, 执行处理函数(磁盘IO)并写回响应, 解析时不再等待socket
+  // 慢速的小请求和空闲的keep-alive连接只占用reactor中的缓冲区, 不占用工作线程
+  // 超过m_s_MaxBufferedBody的请求体不缓冲: 请求头完整时就交给工作线程, 由它像线程模式一样从socket读取,
+  // 每个连接在reactor中至多缓冲请求头和m_s_MaxBufferedBody字节, 同时进行的大上传数受工作线程数限制
+  // 请求处理完后连接回到epoll中等待, 缓冲区中已经有下一个完整请求(pipeline)时直接继续处理
+  // 限制: 不支持expect_100_continue_handler(reactor直接回复100 Continue); 响应仍由工作线程写出, 下载慢的客户端在写超时之内占用工作线程
+  class EpollServer : public httplib::Server
+  {
+    public:
+      // reactorNum为0时使用CPU核数
+      explicit EpollServer(size_t reactorNum = 0)
+        : m_reactorNum(reactorNum) {
+        if (m_reactorNum == 0) {
+          m_reactorNum = std::max(1u, std::thread::hardware_concurrency());
+        }
+      }
+      ~EpollServer() override {
+        stop();
+      }
+      bool listen(const char *host, int port, int socket_flags = 0) override {
+        for (size_t i = 0; i < m_reactorNum; ++i) {
+          std::unique_ptr<Reactor> reactor(new Reactor);
+          reactor->m_listenSock = _createListenSocket(host, port, socket_flags);
+          reactor->m_epfd = epoll_create1(EPOLL_CLOEXEC);
+          reactor->m_spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+          if (reactor->m_listenSock == INVALID_SOCKET || reactor->m_epfd < 0) {
+            CB_LOG(ERROR, "epoll.listen_failed").str("host", host).num("port", port);
+            _closeReactor(*reactor);
+            _closeReactors();
+            return false;
+          }
+          struct epoll_event ev;
+          ev.events = EPOLLIN | EPOLLET;
+          ev.data.ptr = nullptr; // 空指针表示监听socket
+          epoll_ctl(reactor->m_epfd, EPOLL_CTL_ADD, reactor->m_listenSock, &ev);
+          m_reactors.push_back(std::move(reactor));
+        }
+        svr_sock_ = m_reactors[0]->m_listenSock;
+        is_running_ = true;
+        m_taskQueue.reset(new_task_queue());
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < m_reactors.size(); ++i) {
+          threads.emplace_back(&EpollServer::_loop, this, std::ref(*m_reactors[i]));
+        }
+        for (auto &thr : threads) {
+          thr.join();
+        }
+        m_taskQueue->shutdown();
+        m_taskQueue.reset();
+        _closeReactors();
+        is_running_ = false;
+        return true;
+      }
+      void stop() override {
+        if (is_running_) {
+          svr_sock_ = INVALID_SOCKET;
+          m_stopped = true;
+        }
+      }
+
+    private:
+      struct Reactor;
+      // 缓冲区中当前请求的状态
+      enum Parse { INCOMPLETE, COMPLETE, BAD };
+      static const size_t npos = std::string::npos;
+      // 一个客户端连接, 读缓冲区在多个请求之间保留, 以支持pipeline
+      // 同一时间只属于一个线程: 在epoll中等待和读取请求时属于reactor, 处理请求时属于工作线程
+      struct Connection
+      {
+        socket_t m_sock;
+        Reactor *m_reactor;
+        size_t m_requests;
+        std::string m_buf;
+        size_t m_pos;       // 当前请求在m_buf中的起点, 处理请求时是已经读走的位置
+        bool m_registered;  // 是否已经加入epoll
+        bool m_idle;
+        time_t m_idleSince; // 进入等待的时间, 每次收到数据时更新
+        std::list<Connection *>::iterator m_idleIt;
+        // 以下是对当前请求的解析进度, 每个请求开始时由_reset清空
+        size_t m_scanPos;   // 查找请求头结尾的起点
+        size_t m_headerEnd; // 请求头之后的位置, npos表示请求头还不完整
+        size_t m_need;      // 有Content-Length时, 缓冲区达到这个长度请求才完整
+        bool m_chunked;
+        size_t m_chunkPos;  // chunked请求体中下一个要检查的块
+        bool m_expect;      // 客户端等待100 Continue之后才发送请求体
+        Connection(socket_t sock, Reactor *reactor)
+          : m_sock(sock), m_reactor(reactor), m_requests(0), m_pos(0),
+          m_registered(false), m_idle(false), m_idleSince(0) {
+          _reset();
+        }
+        void _reset() {
+          m_scanPos = m_pos;
+          m_headerEnd = npos;
+          m_need = npos;
+          m_chunked = false;
+          m_chunkPos = npos;
+          m_expect = false;
+        }
+      };
+      struct Reactor
+      {
+        socket_t m_listenSock = INVALID_SOCKET;
+        int m_epfd = -1;
+        int m_spareFd = -1;           // 文件描述符用尽时关闭它腾出一个, accept之后立即关闭新连接
+        bool m_acceptPending = false; // 上次没能把等待accept的连接取完, 不能等监听socket的下一次边缘触发
+        std::mutex m_mutex; // 保护m_idleList
+        std::list<Connection *> m_idleList; // 按进入等待的时间排序
+      };
+      // 非阻塞socket上的Stream: 交给工作线程时小请求已经完整地在缓冲区中, 读取不需要等待
+      // 缓冲区读完后(不缓冲的大请求体)才从socket读, 数据未就绪时用poll等待, 超时时间与httplib相同
+      class ConnectionStream : public httplib::Stream
+      {
+        public:
+          ConnectionStream(Connection &conn, time_t timeoutSec, time_t timeoutUsec)
+            : m_conn(conn), m_timeoutMs(static_cast<int>(timeoutSec * 1000 + timeoutUsec / 1000)) {}
+          bool is_readable() const override {
+            return m_conn.m_pos < m_conn.m_buf.size() || _wait(POLLIN, m_timeoutMs);
+          }
+          bool is_writable() const override {
+            return _wait(POLLOUT, 0);
+          }
+          ssize_t read(char *ptr, size_t size) override {
+            if (m_conn.m_pos == m_conn.m_buf.size()) {
+              ssize_t ret = _fill();
+              if (ret <= 0) {
+                return ret;
+              }
+            }
+            size_t n = std::min(size, m_conn.m_buf.size() - m_conn.m_pos);
+            memcpy(ptr, m_conn.m_buf.data() + m_conn.m_pos, n);
+            m_conn.m_pos += n;
+            if (m_conn.m_pos == m_conn.m_buf.size() && m_conn.m_buf.capacity() > m_s_KeepBufSize) {
+              // 缓冲的请求体已经全部复制进请求, 执行处理函数期间不再同时持有两份
+              std::string().swap(m_conn.m_buf);
+              m_conn.m_pos = 0;
+            }
+            return static_cast<ssize_t>(n);
+          }
+          ssize_t write(const char *ptr, size_t size) override {
+            size_t sent = 0;
+            while (sent < size) {
+              ssize_t n = send(m_conn.m_sock, ptr + sent, size - sent, MSG_NOSIGNAL);
+              if (n > 0) {
+                sent += n;
+              } else if (n < 0 && errno == EINTR) {
+                continue;
+              } else if (n < 0 && errno == EAGAIN && _wait(POLLOUT, m_timeoutMs)) {
+                continue;
+              } else {
+                return -1;
+              }
+            }
+            return static_cast<ssize_t>(size);
+          }
+          std::string get_remote_addr() const override {
+            return httplib::detail::get_remote_addr(m_conn.m_sock);
+          }
+        private:
+          // 从socket读取一批数据到连接的缓冲区, 返回值与recv相同, 超时也返回-1
+          ssize_t _fill() {
+            m_conn.m_buf.resize(m_s_ReadBufSize);
+            m_conn.m_pos = 0;
+            for (;;) {
+              ssize_t n = recv(m_conn.m_sock, &m_conn.m_buf[0], m_s_ReadBufSize, 0);
+              if (n < 0 && (errno == EINTR || (errno == EAGAIN && _wait(POLLIN, m_timeoutMs)))) {
+                continue;
+              }
+              m_conn.m_buf.resize(n > 0 ? n : 0);
+              return n;
+            }
+          }
+          bool _wait(short events, int timeoutMs) const {
+            struct pollfd pfd;
+            pfd.fd = m_conn.m_sock;
+            pfd.events = events;
+            pfd.revents = 0;
+            int ret;
+            do {
+              ret = poll(&pfd, 1, timeoutMs);
+            } while (ret < 0 && errno == EINTR);
+            return ret > 0 && (pfd.revents & (events | POLLHUP | POLLERR));
+          }
+        private:
+          Connection &m_conn;
+          int m_timeoutMs;
+      };
+
+      socket_t _createListenSocket(const char *host, int port, int socket_flags) {
+        // create_socket已经设置了SO_REUSEADDR和SO_REUSEPORT, 各reactor可以绑定同一个端口
+        socket_t sock = httplib::detail::create_socket(
+            host, port,
+            [](socket_t sock, struct addrinfo &ai) -> bool {
+              if (::bind(sock, ai.ai_addr, static_cast<socklen_t>(ai.ai_addrlen))) {
+                return false;
+              }
+              return ::listen(sock, SOMAXCONN) == 0;
+            },
+            socket_flags);
+        if (sock != INVALID_SOCKET) {
+          httplib::detail::set_nonblocking(sock, true);
+        }
+        return sock;
+      }
+      void _loop(Reactor &reactor) {
+        struct epoll_event events[m_s_MaxEvents];
+        while (!m_stopped) {
+          int n = epoll_wait(reactor.m_epfd, events, m_s_MaxEvents, reactor.m_acceptPending ? m_s_AcceptRetryMs : 1000);
+          for (int i = 0; i < n; ++i) {
+            Connection *conn = static_cast<Connection *>(events[i].data.ptr);
+            if (conn == nullptr) {
+              _accept(reactor);
+              continue;
+            }
+            {
+              std::lock_guard<std::mutex> lock(reactor.m_mutex);
+              if (conn->m_idle) {
+                reactor.m_idleList.erase(conn->m_idleIt);
+                conn->m_idle = false;
+              }
+            }
+            _receive(conn);
+          }
+          if (reactor.m_acceptPending) {
+            _accept(reactor);
+          }
+          _reapIdle(reactor);
+        }
+      }
+      void _accept(Reactor &reactor) {
+        // 边缘触发, 需要一直accept到EAGAIN
+        reactor.m_acceptPending = false;
+        for (;;) {
+          socket_t sock = accept4(reactor.m_listenSock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (sock == INVALID_SOCKET) {
+            if (errno == EINTR) {
+              continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+              // 不取走的连接不会再触发监听socket, 用备用的描述符accept之后立即关闭, 让客户端尽快失败而不是一直等待
+              CB_LOG(ERROR, "epoll.accept_failed").num("errno", errno);
+              if (reactor.m_spareFd >= 0) {
+                ::close(reactor.m_spareFd);
+                sock = accept4(reactor.m_listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+                if (sock != INVALID_SOCKET) {
+                  httplib::detail::close_socket(sock);
+                }
+                reactor.m_spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (sock != INVALID_SOCKET) {
+                  continue;
+                }
+              }
+              // 备用描述符也被别的线程用掉了, 稍后再试
+              reactor.m_acceptPending = true;
+            }
+            return;
+          }
+          int yes = 1;
+          setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+          _park(new Connection(sock, &reactor));
+        }
+      }
+      // 在reactor中读取连接上已经到达的数据, 请求完整时交给工作线程, 否则回到epoll中继续等待
+      // 缓冲区至多读到当前请求的请求头加m_s_MaxBufferedBody, 在此之前请求要么完整, 要么已经判定为不缓冲的大请求
+      void _receive(Connection *conn) {
+        std::string &buf = conn->m_buf;
+        size_t limit = conn->m_pos + m_s_MaxHeaderSize + m_s_MaxBufferedBody;
+        bool eof = false;
+        while (buf.size() < limit) {
+          size_t old = buf.size();
+          size_t want = std::min(m_s_ReadBufSize, limit - old);
+          buf.resize(old + want);
+          ssize_t n = recv(conn->m_sock, &buf[old], want, 0);
+          buf.resize(old + (n > 0 ? n : 0));
+          if (n > 0) {
+            continue;
+          }
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n < 0 && errno != EAGAIN) {
+            _close(conn);
+            return;
+          }
+          eof = (n == 0);
+          break;
+        }
+        // 读到上限时socket中可能还有数据, 交给工作线程后由它读取, 或者重新注册(EPOLL_CTL_MOD)后立即再次触发
+        Parse state = _parse(*conn);
+        if (state == COMPLETE) {
+          m_taskQueue->enqueue([this, conn]() { _serve(conn); });
+        } else if (state == BAD || eof) {
+          _close(conn);
+        } else {
+          _park(conn);
+        }
+      }
+      // 在工作线程中处理缓冲区中完整的请求, 处理完后把连接放回epoll或者关闭
+      void _serve(Connection *conn) {
+        ConnectionStream strm(*conn, read_timeout_sec_, read_timeout_usec_);
+        for (;;) {
+          bool last = (keep_alive_max_count_ <= conn->m_requests + 1);
+          bool close = false;
+          bool ret = process_request(strm, last, close, nullptr);
+          ++conn->m_requests;
+          if (!ret || close || last || m_stopped) {
+            _close(conn);
+            return;
+          }
+          // 丢掉处理完的请求, 大的请求体处理完后释放缓冲区
+          conn->m_buf.erase(0, conn->m_pos);
+          conn->m_pos = 0;
+          if (conn->m_buf.capacity() > m_s_KeepBufSize && conn->m_buf.size() <= m_s_KeepBufSize) {
+            std::string(conn->m_buf).swap(conn->m_buf);
+          }
+          conn->_reset();
+          Parse state = _parse(*conn);
+          if (state == BAD) {
+            _close(conn);
+            return;
+          }
+          if (state == INCOMPLETE) {
+            break;
+          }
+          // 缓冲区中还有完整的pipeline请求, 继续处理
+        }
+        _park(conn);
+      }
+      // 判断缓冲区中从m_pos开始是否已经有一个完整的请求, 解析进度保存在连接中, 数据增加后从上次的位置继续
+      // 没有Content-Length也不是chunked的请求(GET等)在请求头结束时就完整
+      Parse _parse(Connection &conn) {
+        std::string &buf = conn.m_buf;
+        if (conn.m_headerEnd == npos) {
+          size_t end = buf.find("\r\n\r\n", conn.m_scanPos);
+          if (end == npos) {
+            if (buf.size() - conn.m_pos > m_s_MaxHeaderSize) {
+              return BAD;
+            }
+            conn.m_scanPos = std::max(conn.m_pos, buf.size() < 3 ? 0 : buf.size() - 3);
+            return INCOMPLETE;
+          }
+          conn.m_headerEnd = end + 4;
+          _parseHeaders(conn);
+        }
+        Parse state;
+        if (conn.m_chunked) {
+          state = _scanChunks(conn);
+          if (state == INCOMPLETE && buf.size() - conn.m_headerEnd >= m_s_MaxBufferedBody) {
+            state = COMPLETE; // 大的chunked请求体, 其余部分由工作线程从socket读取
+          }
+        } else {
+          state = (buf.size() >= conn.m_need) ? COMPLETE : INCOMPLETE;
+        }
+        if (state == INCOMPLETE && conn.m_expect) {
+          static const char reply[] = "HTTP/1.1 100 Continue\r\n\r\n";
+          conn.m_expect = false;
+          if (send(conn.m_sock, reply, sizeof(reply) - 1, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(reply) - 1)) {
+            return BAD;
+          }
+        }
+        return state;
+      }
+      // 从请求头中取出决定请求体长度的Content-Length和Transfer-Encoding, 以及Expect: 100-continue
+      void _parseHeaders(Connection &conn) {
+        std::string &buf = conn.m_buf;
+        uint64_t length = 0;
+        size_t expect = npos, expectLen = 0;
+        size_t line = buf.find("\r\n", conn.m_pos) + 2; // 跳过请求行
+        while (line + 2 < conn.m_headerEnd) {
+          size_t eol = buf.find("\r\n", line);
+          size_t colon = buf.find(':', line);
+          if (colon < eol) {
+            size_t value = buf.find_first_not_of(" \t", colon + 1);
+            size_t valueEnd = buf.find_last_not_of(" \t", eol - 1);
+            std::string name = buf.substr(line, colon - line);
+            std::string val = (value < eol && valueEnd >= value) ? buf.substr(value, valueEnd + 1 - value) : std::string();
+            if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+              length = strtoull(val.c_str(), nullptr, 10);
+            } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0 && strcasecmp(val.c_str(), "chunked") == 0) {
+              conn.m_chunked = true;
+            } else if (strcasecmp(name.c_str(), "Expect") == 0 && strcasecmp(val.c_str(), "100-continue") == 0) {
+              expect = line;
+              expectLen = eol + 2 - line;
+            }
+          }
+          line = eol + 2;
+        }
+        // 不缓冲的请求体(超过m_s_MaxBufferedBody, 或者超过payload_max_length由process_request回复413)不等待,
+        // 保留Expect, 由工作线程在读请求体之前回复100 Continue
+        bool stream = !conn.m_chunked && (length > m_s_MaxBufferedBody || length > payload_max_length_);
+        if (stream) {
+          conn.m_need = conn.m_headerEnd;
+          return;
+        }
+        if (expect != npos) {
+          // 由reactor回复100 Continue, 去掉请求头中的Expect, 工作线程不会再回复一次
+          buf.erase(expect, expectLen);
+          conn.m_headerEnd -= expectLen;
+          conn.m_expect = true;
+        }
+        conn.m_need = conn.m_headerEnd + length;
+        if (!conn.m_chunked && conn.m_need > buf.size()) {
+          buf.reserve(conn.m_need);
+        }
+      }
+      // 检查chunked请求体是否已经完整: 逐块跳过, 直到长度为0的块和结束的空行
+      Parse _scanChunks(Connection &conn) {
+        std::string &buf = conn.m_buf;
+        size_t pos = (conn.m_chunkPos == npos) ? conn.m_headerEnd : conn.m_chunkPos;
+        for (;;) {
+          conn.m_chunkPos = pos;
+          size_t eol = buf.find("\r\n", pos);
+          if (eol == npos) {
+            return (buf.size() - pos > m_s_MaxChunkLine) ? BAD : INCOMPLETE;
+          }
+          char *end;
+          unsigned long long len = strtoull(buf.c_str() + pos, &end, 16);
+          if (end == buf.c_str() + pos || len > m_s_MaxChunkSize) {
+            return BAD;
+          }
+          if (len == 0) {
+            // 最后一块之后是可选的trailer, 以空行结束
+            for (size_t line = eol + 2; ; ) {
+              size_t lineEnd = buf.find("\r\n", line);
+              if (lineEnd == npos) {
+                return INCOMPLETE;
+              }
+              if (lineEnd == line) {
+                return COMPLETE;
+              }
+              line = lineEnd + 2;
+            }
+          }
+          size_t next = eol + 2 + static_cast<size_t>(len) + 2;
+          if (buf.size() < next) {
+            return INCOMPLETE;
+          }
+          pos = next;
+        }
+      }
+      // 连接进入等待列表并重新注册到epoll, EPOLLONESHOT保证同一时间只有一个线程处理它
+      void _park(Connection *conn) {
+        Reactor &reactor = *conn->m_reactor;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        std::lock_guard<std::mutex> lock(reactor.m_mutex);
+        conn->m_idle = true;
+        conn->m_idleSince = time(nullptr);
+        conn->m_idleIt = reactor.m_idleList.insert(reactor.m_idleList.end(), conn);
+        int op = conn->m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(reactor.m_epfd, op, conn->m_sock, &ev) < 0) {
+          reactor.m_idleList.erase(conn->m_idleIt);
+          _close(conn);
+          return;
+        }
+        conn->m_registered = true;
+      }
+      // 关闭等待超时的连接(空闲的keep-alive连接, 或者超时没有发来新数据的不完整请求)
+      // 等待列表按时间有序, 只需要检查表头
+      void _reapIdle(Reactor &reactor) {
+        time_t now = time(nullptr);
+        std::lock_guard<std::mutex> lock(reactor.m_mutex);
+        while (!reactor.m_idleList.empty()
+            && now - reactor.m_idleList.front()->m_idleSince > m_s_IdleTimeout) {
+          Connection *conn = reactor.m_idleList.front();
+          reactor.m_idleList.pop_front();
+          _close(conn);
+        }
+      }
+      static void _close(Connection *conn) {
+        httplib::detail::close_socket(conn->m_sock);
+        delete conn;
+      }
+      static void _closeReactor(Reactor &reactor) {
+        for (auto conn : reactor.m_idleList) {
+          _close(conn);
+        }
+        reactor.m_idleList.clear();
+        if (reactor.m_listenSock != INVALID_SOCKET) {
+          httplib::detail::close_socket(reactor.m_listenSock);
+        }
+        if (reactor.m_epfd >= 0) {
+          ::close(reactor.m_epfd);
+        }
+        if (reactor.m_spareFd >= 0) {
+          ::close(reactor.m_spareFd);
+        }
+      }
+      void _closeReactors() {
+        for (auto &reactor : m_reactors) {
+          _closeReactor(*reactor);
+        }
+        m_reactors.clear();
+      }
+    private:
+      size_t m_reactorNum;
+      std::atomic<bool> m_stopped{ false };
+      std::vector<std::unique_ptr<Reactor>> m_reactors;
+      std::unique_ptr<httplib::TaskQueue> m_taskQueue; // 阻塞IO线程池: 执行处理函数和写响应
+      static const int m_s_MaxEvents = 256;
+      static const size_t m_s_ReadBufSize = 16384;
+      static const size_t m_s_MaxBufferedBody = 1024 * 1024; // reactor中缓冲的请求体上限, 更大的由工作线程从socket读取
+      static const size_t m_s_KeepBufSize = 64 * 1024;       // 处理完请求后保留的缓冲区大小
+      static const size_t m_s_MaxHeaderSize = 64 * 1024;
+      static const size_t m_s_MaxChunkLine = 1024;
+      static const uint64_t m_s_MaxChunkSize = 1ULL << 40;
+      static const int m_s_AcceptRetryMs = 100;
+      static const time_t m_s_IdleTimeout = 60; // 等待数据的超时(秒), 收到数据时重新计算
+  };
+  const int EpollServer::m_s_MaxEvents;
+  const size_t EpollServer::m_s_ReadBufSize;
+  const size_t EpollServer::m_s_MaxBufferedBody;
+  const size_t EpollServer::m_s_KeepBufSize;
+  const size_t EpollServer::m_s_MaxHeaderSize;
+  const size_t EpollServer::m_s_MaxChunkLine;
+  const uint64_t EpollServer::m_s_MaxChunkSize;
+  const int EpollServer::m_s_AcceptRetryMs;
+  const time_t EpollServer::m_s_IdleTimeout;
+}
+
+#endif /* _EPOLLSERVER_HPP_ */
@@ -0,0 +1,290 @@
+#ifndef _INDEXSNAPSHOT_HPP_
+#define _INDEXSNAPSHOT_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/utility/string_view.hpp>
+
+namespace CloudBackup {
+  // 文件信息表的只读快照, 直接mmap使用, 启动时不需要解析和分配内存
+  // 文件格式(本机字节序):
+  //   Header                 64字节
+  //   Entry[count]           按路径排序, 每项56字节(版本1每项32字节, 版本2每项48字节, 没有的字段为0, 仍然可以读取)
+  //   uint32_t[hashSlots]    开放寻址的哈希表, 值为项号+1, 0表示空
+  //   路径字符串             各项路径依次存放, 不带结尾的'\0'
+  class IndexSnapshot
+  {
+    struct Header
+    {
+      char m_magic[8];
+      uint64_t m_count;
+      uint64_t m_hashSlots;
+      uint64_t m_entriesOff;
+      uint64_t m_hashOff;
+      uint64_t m_stringsOff;
+      uint64_t m_fileSize;
+      uint64_t m_reserved;
+    };
+    public:
+      struct Entry
+      {
+        uint64_t m_pathOff; // 相对于路径字符串区的偏移
+        uint32_t m_pathLen;
+        uint32_t m_status;
+        int64_t m_atime;
+        uint64_t m_size;
+        // 以上是版本1的全部字段
+        uint64_t m_offset;  // 存放在段文件中的小文件: 内容在段中的偏移
+        uint32_t m_segment; // 段号
+        uint32_t m_reserved;
+        // 以上是版本2的全部字段
+        uint64_t m_hash;    // 内容(解压后)的XXH64, 0表示未知
+      };
+      static const size_t npos = static_cast<size_t>(-1);
+
+      IndexSnapshot() : m_base(nullptr), m_length(0), m_header(nullptr), m_entries(nullptr),
+        m_entrySize(sizeof(Entry)), m_hash(nullptr), m_strings(nullptr) {}
+      ~IndexSnapshot() {
+        close();
+      }
+      IndexSnapshot(const IndexSnapshot &) = delete;
+      IndexSnapshot &operator=(const IndexSnapshot &) = delete;
+
+      // 文件不存在或格式不对时返回false, 此时快照为空
+      bool open(const std::string &filename) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          return false;
+        }
+        struct stat buf;
+        if (fstat(fd, &buf) < 0 || static_cast<size_t>(buf.st_size) < sizeof(Header)) {
+          ::close(fd);
+          return false;
+        }
+        void *base = mmap(nullptr, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+          return false;
+        }
+        m_base = static_cast<const char *>(base);
+        m_length = buf.st_size;
+        m_header = reinterpret_cast<const Header *>(m_base);
+        if (!_valid()) {
+          close();
+          return false;
+        }
+        m_entries = m_base + m_header->m_entriesOff;
+        m_hash = reinterpret_cast<const uint32_t *>(m_base + m_header->m_hashOff);
+        m_strings = m_base + m_header->m_stringsOff;
+        // 查找是随机访问, 不需要预读
+        madvise(const_cast<char *>(m_base), m_length, MADV_RANDOM);
+        return true;
+      }
+      void close() {
+        if (m_base != nullptr) {
+          munmap(const_cast<char *>(m_base), m_length);
+        }
+        m_base = nullptr;
+        m_length = 0;
+        m_header = nullptr;
+        m_entries = nullptr;
+        m_hash = nullptr;
+        m_strings = nullptr;
+      }
+      size_t size() const {
+        return m_header ? m_header->m_count : 0;
+      }
+      // 旧版本的项没有的字段为0
+      Entry entry(size_t i) const {
+        Entry res;
+        if (m_entrySize == sizeof(Entry)) {
+          memcpy(&res, m_entries + i * sizeof(Entry), sizeof(Entry));
+        } else {
+          memset(&res, 0, sizeof(res));
+          memcpy(&res, m_entries + i * m_entrySize, m_entrySize);
+        }
+        return res;
+      }
+      const char *path(size_t i) const {
+        return m_strings + _head(i).m_pathOff;
+      }
+      size_t pathLen(size_t i) const {
+        return _head(i).m_pathLen;
+      }
+      // 第i项的路径与key比较, 结果与std::string::compare相同
+      int compare(size_t i, const std::string &key) const {
+        size_t len = _head(i).m_pathLen;
+        int res = memcmp(path(i), key.data(), std::min(len, key.size()));
+        if (res != 0) {
+          return res;
+        }
+        return (len < key.size()) ? -1 : (len > key.size() ? 1 : 0);
+      }
+      // 按哈希表查找, 不存在时返回npos
+      size_t find(const std::string &key) const {
+        if (size() == 0) {
+          return npos;
+        }
+        uint64_t mask = m_header->m_hashSlots - 1;
+        for (uint64_t slot = hash(key.data(), key.size()) & mask; m_hash[slot] != 0; slot = (slot + 1) & mask) {
+          size_t i = m_hash[slot] - 1;
+          if (compare(i, key) == 0) {
+            return i;
+          }
+        }
+        return npos;
+      }
+      // 第一个路径不小于key的项
+      size_t lowerBound(const std::string &key) const {
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+          size_t mid = lo + (hi - lo) / 2;
+          if (compare(mid, key) < 0) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        return lo;
+      }
+      // FNV-1a
+      static uint64_t hash(const char *data, size_t len) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; ++i) {
+          h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+        }
+        return h;
+      }
+
+      // 生成快照, 各项必须按路径从小到大依次加入
+      // 先写到filename.tmp, 完成后rename, 已经打开旧快照的读者不受影响
+      class Writer
+      {
+        public:
+          void add(boost::string_view path, uint32_t status, int64_t atime, uint64_t size,
+              uint32_t segment = 0, uint64_t offset = 0, uint64_t hash = 0) {
+            Entry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.m_pathOff = m_strings.size();
+            entry.m_pathLen = static_cast<uint32_t>(path.size());
+            entry.m_status = status;
+            entry.m_atime = atime;
+            entry.m_size = size;
+            entry.m_segment = segment;
+            entry.m_offset = offset;
+            entry.m_hash = hash;
+            m_entries.push_back(entry);
+            m_strings.append(path.data(), path.size());
+          }
+          bool finish(const std::string &filename) {
+            uint64_t slots = 16;
+            while (slots < m_entries.size() * 2) {
+              slots <<= 1;
+            }
+            std::vector<uint32_t> table(slots, 0);
+            for (size_t i = 0; i < m_entries.size(); ++i) {
+              uint64_t slot = hash(m_strings.data() + m_entries[i].m_pathOff, m_entries[i].m_pathLen) & (slots - 1);
+              while (table[slot] != 0) {
+                slot = (slot + 1) & (slots - 1);
+              }
+              table[slot] = static_cast<uint32_t>(i + 1);
+            }
+            Header header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.m_magic, _magic(), sizeof(header.m_magic));
+            header.m_count = m_entries.size();
+            header.m_hashSlots = slots;
+            header.m_entriesOff = sizeof(Header);
+            header.m_hashOff = header.m_entriesOff + m_entries.size() * sizeof(Entry);
+            header.m_stringsOff = header.m_hashOff + slots * sizeof(uint32_t);
+            header.m_fileSize = header.m_stringsOff + m_strings.size();
+
+            std::string tmp = filename + ".tmp";
+            FILE *fp = fopen(tmp.c_str(), "wb");
+            if (fp == nullptr) {
+              return false;
+            }
+            bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+              && fwrite(m_entries.data(), sizeof(Entry), m_entries.size(), fp) == m_entries.size()
+              && fwrite(table.data(), sizeof(uint32_t), slots, fp) == slots
+              && fwrite(m_strings.data(), 1, m_strings.size(), fp) == m_strings.size();
+            ok = (fflush(fp) == 0) && ok;
+            ok = (fsync(fileno(fp)) == 0) && ok;
+            ok = (fclose(fp) == 0) && ok;
+            if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+              unlink(tmp.c_str());
+              return false;
+            }
+            return true;
+          }
+        private:
+          std::vector<Entry> m_entries;
+          std::string m_strings;
+      };
+    private:
+      // 版本1的项, 与Entry的前32字节相同
+      struct EntryV1
+      {
+        uint64_t m_pathOff;
+        uint32_t m_pathLen;
+        uint32_t m_status;
+        int64_t m_atime;
+        uint64_t m_size;
+      };
+      // 文件开头的8字节, 格式变化时修改版本号
+      static const char *_magic() {
+        return "CBIDX03";
+      }
+      static const char *_magicV2() {
+        return "CBIDX02";
+      }
+      static const char *_magicV1() {
+        return "CBIDX01";
+      }
+      // 路径字段在各个版本中的位置相同
+      const EntryV1 &_head(size_t i) const {
+        return *reinterpret_cast<const EntryV1 *>(m_entries + i * m_entrySize);
+      }
+      bool _valid() {
+        const Header &h = *m_header;
+        if (memcmp(h.m_magic, _magic(), sizeof(h.m_magic)) == 0) {
+          m_entrySize = sizeof(Entry);
+        } else if (memcmp(h.m_magic, _magicV2(), sizeof(h.m_magic)) == 0) {
+          m_entrySize = offsetof(Entry, m_hash);
+        } else if (memcmp(h.m_magic, _magicV1(), sizeof(h.m_magic)) == 0) {
+          m_entrySize = sizeof(EntryV1);
+        } else {
+          return false;
+        }
+        if (h.m_fileSize != m_length) {
+          return false;
+        }
+        // 哈希表大小必须是2的幂且有空位, 各区域依次排列并且不越界
+        return h.m_hashSlots != 0 && (h.m_hashSlots & (h.m_hashSlots - 1)) == 0 && h.m_hashSlots > h.m_count
+          && h.m_entriesOff == sizeof(Header)
+          && h.m_hashOff == h.m_entriesOff + h.m_count * m_entrySize
+          && h.m_stringsOff == h.m_hashOff + h.m_hashSlots * sizeof(uint32_t)
+          && h.m_stringsOff <= m_length;
+      }
+    private:
+      const char *m_base;
+      size_t m_length;
+      const Header *m_header;
+      const char *m_entries;
+      size_t m_entrySize; // 每项的字节数, 由文件的版本决定
+      const uint32_t *m_hash;
+      const char *m_strings;
+  };
+}
+
+#endif /* _INDEXSNAPSHOT_HPP_ */
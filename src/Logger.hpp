@@ -0,0 +1,447 @@
+#ifndef _LOGGER_HPP_
+#define _LOGGER_HPP_
+
+#include <map>
+#include <ctime>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "Metrics.hpp"
+#include "MyUtil.hpp"
+
+// 结构化日志, 用法:
+//   CB_LOG(INFO, "upload").str("path", filepath).num("size", size);
+// 级别未开启时不会对参数求值; 事件名和字段名只保存指针, 必须是字符串常量
+// 每个CB_LOG展开处有自己的限速状态, 同一秒内超过logRateLimit条的部分被丢弃, 下一条带上suppressed字段
+#define CB_LOG(level, event) \
+  if (!CloudBackup::Logger::enabled(CloudBackup::LOG_##level)) {} else \
+    CloudBackup::LogLine(CloudBackup::LOG_##level, event, \
+        []() -> CloudBackup::LogSite & { static CloudBackup::LogSite s_site; return s_site; }())
+
+namespace CloudBackup {
+  enum LogLevel {
+    LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR
+  };
+
+  // 一条日志记录, 定长, 字符串值复制到m_text中, 格式化推迟到后台线程进行
+  struct LogRecord
+  {
+    struct Field
+    {
+      const char *m_key;
+      bool m_isStr;
+      bool m_truncated; // 字符串值超出m_text剩余空间被截断
+      uint16_t m_offset; // 字符串值在m_text中的位置
+      uint16_t m_len;
+      int64_t m_num;
+    };
+    static const size_t m_s_MaxFields = 6;
+    static const size_t m_s_TextSize = 344;
+    int64_t m_time; // CLOCK_REALTIME, 纳秒
+    const char *m_event;
+    uint32_t m_tid;
+    uint8_t m_level;
+    uint8_t m_fieldNum;
+    uint16_t m_textLen;
+    Field m_fields[m_s_MaxFields];
+    char m_text[m_s_TextSize];
+  };
+  static_assert(sizeof(LogRecord) == 512, "LogRecord should fill exactly 512 bytes");
+
+  // 单生产者单消费者的环形缓冲区, 每个线程一个, 生产者是所属线程, 消费者是后台写日志的线程
+  // 缓冲区满时新记录直接丢弃, 记录线程永远不会被写日志阻塞
+  class LogRing
+  {
+    public:
+      static const size_t m_s_Capacity = 1024; // 2的幂
+
+      explicit LogRing(uint32_t tid)
+        : m_tid(tid), m_closed(false), m_head(0), m_tail(0), m_slots(new LogRecord[m_s_Capacity]) {}
+      // 返回放入后缓冲区中的记录数, 缓冲区已满时返回0
+      size_t push(const LogRecord &rec) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t used = tail - m_head.load(std::memory_order_acquire);
+        if (used >= m_s_Capacity) {
+          return 0;
+        }
+        LogRecord &slot = m_slots[tail & (m_s_Capacity - 1)];
+        memcpy(&slot, &rec, offsetof(LogRecord, m_text) + rec.m_textLen); // 只复制用到的部分
+        slot.m_tid = m_tid;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return used + 1;
+      }
+      // 以下由消费者调用: 读取[head(), tail())之间的记录, 处理完后release
+      size_t head() const {
+        return m_head.load(std::memory_order_relaxed);
+      }
+      size_t tail() const {
+        return m_tail.load(std::memory_order_acquire);
+      }
+      const LogRecord &at(size_t pos) const {
+        return m_slots[pos & (m_s_Capacity - 1)];
+      }
+      void release(size_t pos) {
+        m_head.store(pos, std::memory_order_release);
+      }
+      // 所属线程退出后, 缓冲区清空时由消费者回收
+      void close() {
+        m_closed.store(true, std::memory_order_release);
+      }
+      bool closed() const {
+        return m_closed.load(std::memory_order_acquire);
+      }
+    private:
+      uint32_t m_tid;
+      std::atomic<bool> m_closed;
+      alignas(64) std::atomic<size_t> m_head;
+      alignas(64) std::atomic<size_t> m_tail;
+      std::unique_ptr<LogRecord[]> m_slots;
+  };
+
+  // 日志点的限速状态: 高32位是当前的秒, 低32位是这一秒内已经通过的条数
+  class LogSite
+  {
+    public:
+      LogSite() : m_window(0), m_suppressed(0) {}
+      // 新的一秒第一条通过时, suppressed返回之前被丢弃的条数
+      bool allow(int64_t sec, uint32_t limit, uint64_t &suppressed) {
+        uint64_t window = m_window.load(std::memory_order_relaxed);
+        if ((window >> 32) != static_cast<uint32_t>(sec)
+            && m_window.compare_exchange_strong(window, (static_cast<uint64_t>(sec) << 32) | 1, std::memory_order_relaxed)) {
+          suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+          return true;
+        }
+        if ((m_window.fetch_add(1, std::memory_order_relaxed) & 0xffffffff) < limit) {
+          return true;
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    private:
+      std::atomic<uint64_t> m_window;
+      std::atomic<uint64_t> m_suppressed;
+  };
+
+  // 日志的后台部分: 管理各线程的缓冲区, 后台线程定期取出所有记录, 按时间排序后格式化写出
+  // 写出格式为text(一行一条, 字段为key=value)或json(一行一个JSON对象)
+  class Logger
+  {
+    public:
+      static bool enabled(LogLevel level) {
+        return level >= _level().load(std::memory_order_relaxed);
+      }
+      static uint32_t rateLimit() {
+        return _rateLimit().load(std::memory_order_relaxed);
+      }
+      // 使用配置文件中的logLevel, logFormat, logFile, logRateLimit, 未配置的项保持默认值
+      static void configure(std::map<std::string, std::string> config) {
+        static const char *levels[] = { "debug", "info", "warn", "error" };
+        for (int i = LOG_DEBUG; i <= LOG_ERROR; ++i) {
+          if (config["logLevel"] == levels[i]) {
+            _level().store(i, std::memory_order_relaxed);
+          }
+        }
+        if (!config["logRateLimit"].empty()) {
+          _rateLimit().store(strtoul(config["logRateLimit"].c_str(), nullptr, 10), std::memory_order_relaxed);
+        }
+        Logger &logger = instance();
+        std::lock_guard<std::mutex> lock(logger.m_outMutex);
+        if (!config["logFormat"].empty()) {
+          logger.m_json = (config["logFormat"] == "json");
+        }
+        if (!config["logFile"].empty()) {
+          FILE *out = fopen(config["logFile"].c_str(), "a");
+          if (out == nullptr) {
+            fprintf(stderr, "open log file %s failed!\n", config["logFile"].c_str());
+            return;
+          }
+          if (logger.m_out != stdout) {
+            fclose(logger.m_out);
+          }
+          logger.m_out = out;
+        }
+      }
+      // 立即写出所有缓冲区中的记录, 用于abort之前
+      static void flush() {
+        instance()._drain();
+      }
+      // 由LogLine析构时调用, 放入当前线程的缓冲区
+      void commit(const LogRecord &rec) {
+        if (m_sync.load(std::memory_order_acquire)) {
+          // 后台线程已经退出(进程正在结束), 直接写出
+          std::string buf;
+          LogRecord copy = rec;
+          copy.m_tid = _tid();
+          std::lock_guard<std::mutex> lock(m_outMutex);
+          _format(copy, buf);
+          _write(buf);
+          return;
+        }
+        size_t used = _threadRing().push(rec);
+        if (used == 0) {
+          static Counter &dropped = Metrics::counter("cloudbackup_log_dropped_total",
+              "Log records dropped because the thread's log buffer was full");
+          dropped.add(1);
+        } else if (used == LogRing::m_s_Capacity / 2) {
+          m_cond.notify_one(); // 缓冲区过半时提前唤醒后台线程
+        }
+      }
+      // 不析构: 进程结束时其他静态对象的析构函数中仍然可能写日志
+      static Logger &instance() {
+        static Logger *s_logger = new Logger;
+        return *s_logger;
+      }
+    private:
+      Logger() : m_json(false), m_out(stdout), m_stop(false), m_sync(false), m_lastSec(-1) {
+        m_thread = std::thread(&Logger::_run, this);
+        std::atexit(&Logger::_shutdown);
+      }
+      static std::atomic<int> &_level() {
+        static std::atomic<int> s_level(LOG_INFO);
+        return s_level;
+      }
+      static std::atomic<uint32_t> &_rateLimit() {
+        static std::atomic<uint32_t> s_rateLimit(0);
+        return s_rateLimit;
+      }
+      static uint32_t _tid() {
+        return static_cast<uint32_t>(syscall(SYS_gettid));
+      }
+      // 线程第一次写日志时创建自己的缓冲区, 线程退出时标记为关闭
+      struct ThreadRing
+      {
+        std::shared_ptr<LogRing> m_ring;
+        ThreadRing() : m_ring(std::make_shared<LogRing>(_tid())) {
+          Logger &logger = instance();
+          std::lock_guard<std::mutex> lock(logger.m_ringsMutex);
+          logger.m_rings.push_back(m_ring);
+        }
+        ~ThreadRing() {
+          m_ring->close();
+        }
+      };
+      static LogRing &_threadRing() {
+        thread_local ThreadRing t_ring;
+        return *t_ring.m_ring;
+      }
+      static void _shutdown() {
+        Logger &logger = instance();
+        logger.m_sync.store(true, std::memory_order_release);
+        {
+          std::lock_guard<std::mutex> lock(logger.m_condMutex);
+          logger.m_stop = true;
+        }
+        logger.m_cond.notify_one();
+        logger.m_thread.join();
+      }
+      void _run() {
+        const std::chrono::milliseconds interval(static_cast<int>(m_s_FlushIntervalMs));
+        std::unique_lock<std::mutex> lock(m_condMutex);
+        while (!m_stop) {
+          m_cond.wait_for(lock, interval);
+          lock.unlock();
+          _drain();
+          lock.lock();
+        }
+        lock.unlock();
+        _drain();
+      }
+      // 取出所有缓冲区中的记录, 按时间合并后写出
+      void _drain() {
+        std::lock_guard<std::mutex> outLock(m_outMutex);
+        std::vector<std::shared_ptr<LogRing>> rings;
+        {
+          std::lock_guard<std::mutex> lock(m_ringsMutex);
+          m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(), [](const std::shared_ptr<LogRing> &ring) {
+                return ring->closed() && ring->head() == ring->tail();
+              }), m_rings.end());
+          rings = m_rings;
+        }
+        std::vector<size_t> ends(rings.size());
+        m_pending.clear();
+        for (size_t i = 0; i < rings.size(); ++i) {
+          ends[i] = rings[i]->tail();
+          for (size_t pos = rings[i]->head(); pos != ends[i]; ++pos) {
+            m_pending.push_back(&rings[i]->at(pos));
+          }
+        }
+        if (m_pending.empty()) {
+          return;
+        }
+        std::stable_sort(m_pending.begin(), m_pending.end(), [](const LogRecord *a, const LogRecord *b) {
+            return a->m_time < b->m_time;
+          });
+        m_buf.clear();
+        for (const LogRecord *rec : m_pending) {
+          _format(*rec, m_buf);
+        }
+        for (size_t i = 0; i < rings.size(); ++i) {
+          rings[i]->release(ends[i]);
+        }
+        _write(m_buf);
+      }
+      void _write(const std::string &buf) {
+        fwrite(buf.data(), 1, buf.size(), m_out);
+        fflush(m_out);
+      }
+      // 本地时间, 精确到微秒; 同一秒内的记录复用格式化好的秒部分
+      void _formatTime(int64_t ns, std::string &dst) {
+        time_t sec = static_cast<time_t>(ns / 1000000000);
+        if (sec != m_lastSec) {
+          struct tm tmbuf;
+          localtime_r(&sec, &tmbuf);
+          char buf[32] = { 0 };
+          strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmbuf);
+          m_lastSecText = buf;
+          m_lastSec = sec;
+        }
+        char usec[16];
+        snprintf(usec, sizeof(usec), ".%06d", static_cast<int>(ns % 1000000000 / 1000));
+        dst += m_lastSecText;
+        dst += usec;
+      }
+      void _format(const LogRecord &rec, std::string &dst) {
+        static const char *levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+        static const char *jsonLevels[] = { "debug", "info", "warn", "error" };
+        if (m_json) {
+          dst += "{\"time\":\"";
+          _formatTime(rec.m_time, dst);
+          dst += "\",\"level\":\"";
+          dst += jsonLevels[rec.m_level];
+          dst += "\",\"tid\":" + std::to_string(rec.m_tid) + ",\"event\":\"";
+          MyUtil::jsonEscape(rec.m_event, dst);
+          dst += '"';
+        } else {
+          _formatTime(rec.m_time, dst);
+          dst += ' ';
+          dst += levels[rec.m_level];
+          dst += " [" + std::to_string(rec.m_tid) + "] ";
+          dst += rec.m_event;
+        }
+        for (size_t i = 0; i < rec.m_fieldNum; ++i) {
+          const LogRecord::Field &field = rec.m_fields[i];
+          dst += m_json ? ",\"" : " ";
+          dst += field.m_key;
+          dst += m_json ? "\":" : "=";
+          if (!field.m_isStr) {
+            dst += std::to_string(field.m_num);
+            continue;
+          }
+          std::string value(rec.m_text + field.m_offset, field.m_len);
+          if (field.m_truncated) {
+            value += "...";
+          }
+          // text格式中含空白, 引号或为空的值加引号
+          bool quote = m_json || value.empty() || value.find_first_of(" \t\r\n\"=") != std::string::npos;
+          if (quote) {
+            dst += '"';
+            MyUtil::jsonEscape(value, dst);
+            dst += '"';
+          } else {
+            dst += value;
+          }
+        }
+        dst += m_json ? "}\n" : "\n";
+      }
+    private:
+      static const int m_s_FlushIntervalMs = 50; // 后台线程写出的间隔
+      bool m_json;
+      FILE *m_out;
+      std::mutex m_outMutex; // 保护写出和格式化状态, 同一时间只有一个消费者
+      std::mutex m_ringsMutex;
+      std::vector<std::shared_ptr<LogRing>> m_rings;
+      std::mutex m_condMutex;
+      std::condition_variable m_cond;
+      bool m_stop;
+      std::atomic<bool> m_sync;
+      std::thread m_thread;
+      std::vector<const LogRecord *> m_pending;
+      std::string m_buf;
+      time_t m_lastSec;
+      std::string m_lastSecText;
+  };
+
+  // 一条正在构造的日志, 在记录线程的栈上填好字段, 析构时(语句结束)复制进线程的缓冲区
+  class LogLine
+  {
+    public:
+      LogLine(LogLevel level, const char *event, LogSite &site) : m_valid(true) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        m_rec.m_time = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        m_rec.m_event = event;
+        m_rec.m_tid = 0;
+        m_rec.m_level = static_cast<uint8_t>(level);
+        m_rec.m_fieldNum = 0;
+        m_rec.m_textLen = 0;
+        uint32_t limit = Logger::rateLimit();
+        uint64_t suppressed = 0;
+        if (limit != 0 && !site.allow(ts.tv_sec, limit, suppressed)) {
+          static Counter &counter = Metrics::counter("cloudbackup_log_suppressed_total",
+              "Log records dropped by the per-call-site rate limit");
+          counter.add(1);
+          m_valid = false;
+          return;
+        }
+        if (suppressed != 0) {
+          num("suppressed", static_cast<int64_t>(suppressed));
+        }
+      }
+      ~LogLine() {
+        if (m_valid) {
+          Logger::instance().commit(m_rec);
+        }
+      }
+      LogLine(const LogLine &) = delete;
+      LogLine &operator=(const LogLine &) = delete;
+
+      // 字段数超过LogRecord::m_s_MaxFields时忽略多出的字段
+      LogLine &num(const char *key, int64_t value) {
+        if (m_valid && m_rec.m_fieldNum < LogRecord::m_s_MaxFields) {
+          LogRecord::Field &field = m_rec.m_fields[m_rec.m_fieldNum++];
+          field.m_key = key;
+          field.m_isStr = false;
+          field.m_num = value;
+        }
+        return *this;
+      }
+      LogLine &str(const char *key, const char *value, size_t len) {
+        if (m_valid && m_rec.m_fieldNum < LogRecord::m_s_MaxFields) {
+          LogRecord::Field &field = m_rec.m_fields[m_rec.m_fieldNum++];
+          size_t room = LogRecord::m_s_TextSize - m_rec.m_textLen;
+          field.m_key = key;
+          field.m_isStr = true;
+          field.m_truncated = (len > room);
+          field.m_offset = m_rec.m_textLen;
+          field.m_len = static_cast<uint16_t>(std::min(len, room));
+          memcpy(m_rec.m_text + m_rec.m_textLen, value, field.m_len);
+          m_rec.m_textLen += field.m_len;
+        }
+        return *this;
+      }
+      LogLine &str(const char *key, const std::string &value) {
+        return str(key, value.data(), value.size());
+      }
+      LogLine &str(const char *key, const char *value) {
+        return str(key, value, strlen(value));
+      }
+    private:
+      bool m_valid;
+      LogRecord m_rec;
+  };
+}
+
+#endif /* _LOGGER_HPP_ */
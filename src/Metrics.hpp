@@ -0,0 +1,333 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+
+namespace CloudBackup {
+  // 分片计数器, 每个线程固定写一个分片, 热路径上只有一次relaxed的原子加, 读取时汇总所有分片
+  class Counter
+  {
+    struct Shard
+    {
+      std::atomic<uint64_t> m_value;
+      char m_pad[64 - sizeof(std::atomic<uint64_t>)]; // 每个分片独占一个缓存行
+    };
+    public:
+      Counter() {
+        for (auto &shard : m_shards) {
+          shard.m_value.store(0, std::memory_order_relaxed);
+        }
+      }
+      void add(uint64_t n = 1) {
+        m_shards[shardIndex()].m_value.fetch_add(n, std::memory_order_relaxed);
+      }
+      uint64_t value() const {
+        uint64_t sum = 0;
+        for (auto &shard : m_shards) {
+          sum += shard.m_value.load(std::memory_order_relaxed);
+        }
+        return sum;
+      }
+      // 当前线程使用的分片, 线程第一次使用时按顺序分配
+      static size_t shardIndex() {
+        static std::atomic<size_t> next(0);
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % m_s_Shards;
+        return index;
+      }
+    private:
+      static const size_t m_s_Shards = 16;
+      Shard m_shards[m_s_Shards];
+  };
+
+  // 可增减的瞬时值
+  class Gauge
+  {
+    public:
+      Gauge() : m_value(0) {}
+      void set(int64_t v) {
+        m_value.store(v, std::memory_order_relaxed);
+      }
+      void add(int64_t n) {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+      }
+      int64_t value() const {
+        return m_value.load(std::memory_order_relaxed);
+      }
+    private:
+      std::atomic<int64_t> m_value;
+  };
+
+  // HDR直方图: 每个2的幂区间再等分为2^m_s_SubBits个子桶, 相对误差不超过1/32,
+  // 记录一个值只需要计算桶号并做一次原子加, 不需要加锁
+  // 值是整数(例如纳秒), 输出时乘以m_scale换算成基本单位(秒)
+  class Histogram
+  {
+    public:
+      // 输出时le的范围为[2^minExp, 2^maxExp], 每个2的幂区间输出两个桶边界
+      Histogram(double scale, int minExp, int maxExp)
+        : m_scale(scale), m_minExp(minExp), m_maxExp(maxExp), m_buckets(new std::atomic<uint64_t>[m_s_BucketNum]) {
+        for (size_t i = 0; i < m_s_BucketNum; ++i) {
+          m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+      }
+      void record(uint64_t value) {
+        m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.add(1);
+        m_sum.add(value);
+      }
+      uint64_t count() const {
+        return m_count.value();
+      }
+      uint64_t sum() const {
+        return m_sum.value();
+      }
+      // 小于bound的记录数, bound为桶边界时是精确值
+      uint64_t countBelow(uint64_t bound) const {
+        uint64_t res = 0;
+        size_t end = bucketIndex(bound);
+        for (size_t i = 0; i < end; ++i) {
+          res += m_buckets[i].load(std::memory_order_relaxed);
+        }
+        return res;
+      }
+      // 分位数, 返回所在桶的上界
+      uint64_t quantile(double q) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < m_s_BucketNum; ++i) {
+          total += m_buckets[i].load(std::memory_order_relaxed);
+        }
+        uint64_t rank = static_cast<uint64_t>(q * total + 0.5), seen = 0;
+        for (size_t i = 0; i < m_s_BucketNum; ++i) {
+          seen += m_buckets[i].load(std::memory_order_relaxed);
+          if (seen >= rank && seen > 0) {
+            return bucketUpper(i);
+          }
+        }
+        return 0;
+      }
+      double scale() const {
+        return m_scale;
+      }
+      int minExp() const {
+        return m_minExp;
+      }
+      int maxExp() const {
+        return m_maxExp;
+      }
+      static size_t bucketIndex(uint64_t value) {
+        if (value < m_s_SubCount) {
+          return static_cast<size_t>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - m_s_SubBits;
+        return (shift + 1) * m_s_SubCount + static_cast<size_t>((value >> shift) - m_s_SubCount);
+      }
+      static uint64_t bucketUpper(size_t index) {
+        if (index < m_s_SubCount) {
+          return index;
+        }
+        int shift = static_cast<int>(index / m_s_SubCount) - 1;
+        uint64_t lower = (m_s_SubCount + index % m_s_SubCount) << shift;
+        return lower + (uint64_t(1) << shift) - 1;
+      }
+    private:
+      static const int m_s_SubBits = 5;
+      static const uint64_t m_s_SubCount = 1 << m_s_SubBits;
+      static const size_t m_s_BucketNum = (64 - m_s_SubBits) * m_s_SubCount;
+      double m_scale;
+      int m_minExp;
+      int m_maxExp;
+      std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+      Counter m_count;
+      Counter m_sum;
+  };
+
+  // 作用域计时, 析构时把经过的纳秒数记入直方图
+  class MetricTimer
+  {
+    public:
+      explicit MetricTimer(Histogram &hist)
+        : m_hist(hist), m_start(std::chrono::steady_clock::now()) {}
+      ~MetricTimer() {
+        m_hist.record(elapsed());
+      }
+      uint64_t elapsed() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+      }
+    private:
+      Histogram &m_hist;
+      std::chrono::steady_clock::time_point m_start;
+  };
+
+  // 记录锁等待时间的互斥锁, 可以直接用于std::lock_guard
+  // 没有竞争时try_lock直接成功, 只多一次计数; 有竞争时才计时
+  class MeteredMutex
+  {
+    public:
+      MeteredMutex(Counter &acquired, Counter &contended, Histogram &wait)
+        : m_acquired(acquired), m_contended(contended), m_wait(wait) {}
+      void lock() {
+        m_acquired.add(1);
+        if (m_mutex.try_lock()) {
+          return;
+        }
+        m_contended.add(1);
+        MetricTimer timer(m_wait);
+        m_mutex.lock();
+      }
+      bool try_lock() {
+        if (!m_mutex.try_lock()) {
+          return false;
+        }
+        m_acquired.add(1);
+        return true;
+      }
+      void unlock() {
+        m_mutex.unlock();
+      }
+    private:
+      std::mutex m_mutex;
+      Counter &m_acquired;
+      Counter &m_contended;
+      Histogram &m_wait;
+  };
+
+  // 指标注册表, 以Prometheus文本格式输出
+  // 指标在启动时注册并一直存在, 热路径上持有指标的引用直接更新, 只有注册和输出时加锁
+  // labels是已经格式化好的标签, 例如 route="list"
+  class Metrics
+  {
+    struct Series
+    {
+      std::string m_labels;
+      std::unique_ptr<Counter> m_counter;
+      std::unique_ptr<Gauge> m_gauge;
+      std::unique_ptr<Histogram> m_histogram;
+      std::function<double()> m_callback;
+    };
+    struct Family
+    {
+      std::string m_help;
+      std::string m_type;
+      std::vector<std::unique_ptr<Series>> m_series;
+    };
+    struct Registry
+    {
+      std::mutex m_mutex;
+      std::map<std::string, Family> m_families;
+    };
+    public:
+      static Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "") {
+        return *_series(name, help, "counter", labels).m_counter;
+      }
+      static Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "") {
+        return *_series(name, help, "gauge", labels).m_gauge;
+      }
+      // 纳秒计时的直方图, 输出单位为秒, le从2^minExp纳秒到2^maxExp纳秒
+      static Histogram &histogram(const std::string &name, const std::string &help,
+          const std::string &labels = "", int minExp = 10, int maxExp = 35) {
+        return *_series(name, help, "histogram", labels, minExp, maxExp).m_histogram;
+      }
+      // 输出时才求值的指标, 用于已经由其他模块维护的数值(索引大小, 线程池状态等), type为counter或gauge
+      static void callback(const std::string &name, const std::string &help, const std::string &type,
+          const std::string &labels, std::function<double()> fn) {
+        _series(name, help, type, labels, 0, 0, fn);
+      }
+      static std::string render() {
+        Registry &reg = _registry();
+        std::lock_guard<std::mutex> lock(reg.m_mutex);
+        std::string out;
+        for (auto &family : reg.m_families) {
+          const std::string &name = family.first;
+          out += "# HELP " + name + " " + family.second.m_help + "\n";
+          out += "# TYPE " + name + " " + family.second.m_type + "\n";
+          for (auto &series : family.second.m_series) {
+            _renderSeries(name, *series, out);
+          }
+        }
+        return out;
+      }
+    private:
+      static Registry &_registry() {
+        static Registry s_registry;
+        return s_registry;
+      }
+      // 查找或创建一个序列, 指标对象在注册表的锁内创建
+      static Series &_series(const std::string &name, const std::string &help, const std::string &type,
+          const std::string &labels, int minExp = 0, int maxExp = 0, std::function<double()> fn = nullptr) {
+        Registry &reg = _registry();
+        std::lock_guard<std::mutex> lock(reg.m_mutex);
+        Family &family = reg.m_families[name];
+        if (family.m_type.empty()) {
+          family.m_help = help;
+          family.m_type = type;
+        }
+        Series *series = nullptr;
+        for (auto &it : family.m_series) {
+          if (it->m_labels == labels) {
+            series = it.get();
+          }
+        }
+        if (series == nullptr) {
+          family.m_series.emplace_back(new Series);
+          series = family.m_series.back().get();
+          series->m_labels = labels;
+        }
+        if (fn) {
+          series->m_callback = fn;
+        } else if (type == "counter" && !series->m_counter) {
+          series->m_counter.reset(new Counter);
+        } else if (type == "gauge" && !series->m_gauge) {
+          series->m_gauge.reset(new Gauge);
+        } else if (type == "histogram" && !series->m_histogram) {
+          series->m_histogram.reset(new Histogram(1e-9, minExp, maxExp));
+        }
+        return *series;
+      }
+      static std::string _number(double v) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.9g", v);
+        return buf;
+      }
+      static std::string _braces(const std::string &labels, const std::string &extra = "") {
+        if (labels.empty() && extra.empty()) {
+          return "";
+        }
+        return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+      }
+      static void _renderSeries(const std::string &name, const Series &series, std::string &out) {
+        if (series.m_counter) {
+          out += name + _braces(series.m_labels) + " " + std::to_string(series.m_counter->value()) + "\n";
+        } else if (series.m_gauge) {
+          out += name + _braces(series.m_labels) + " " + std::to_string(series.m_gauge->value()) + "\n";
+        } else if (series.m_callback) {
+          out += name + _braces(series.m_labels) + " " + _number(series.m_callback()) + "\n";
+        } else if (series.m_histogram) {
+          // 桶边界取2^k和1.5*2^k, 都是HDR子桶的边界, 累计数是精确的(不含恰好等于边界的值)
+          const Histogram &hist = *series.m_histogram;
+          for (int exp = hist.minExp(); exp <= hist.maxExp(); ++exp) {
+            uint64_t bounds[2] = { uint64_t(1) << exp, (uint64_t(3) << exp) >> 1 };
+            for (int i = 0; i < (exp < hist.maxExp() ? 2 : 1); ++i) {
+              out += name + "_bucket" + _braces(series.m_labels, "le=\"" + _number(bounds[i] * hist.scale()) + "\"")
+                + " " + std::to_string(hist.countBelow(bounds[i])) + "\n";
+            }
+          }
+          uint64_t count = hist.count();
+          out += name + "_bucket" + _braces(series.m_labels, "le=\"+Inf\"") + " " + std::to_string(count) + "\n";
+          out += name + "_sum" + _braces(series.m_labels) + " " + _number(hist.sum() * hist.scale()) + "\n";
+          out += name + "_count" + _braces(series.m_labels) + " " + std::to_string(count) + "\n";
+        }
+      }
+  };
+}
+
+#endif /* _METRICS_HPP_ */
@@ -4,15 +4,20 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <ctime>
+#include <cctype>
+#include <cstring>
+#include <sys/stat.h>
 #include <boost/filesystem.hpp>
 #include <boost/thread/thread.hpp>
 
 namespace CloudBackup {
-	// 
+	// 工具类
 	class MyUtil
 	{
 	public:
-		// ȡָļеݲ浽dst
+		// 读取指定文件中的所有内容并保存到dst中
 		static bool readFile(const std::string &name, std::string &dst) {
 			std::ifstream fin(name.c_str(), std::ios::binary);
 			if (!fin.is_open()) {
@@ -21,7 +26,7 @@ namespace CloudBackup {
 			}
 
 			fin.seekg(0, fin.end);
-			int length = fin.tellg(); // ļݵĳ
+			int length = fin.tellg(); // 获得文件内容的长度
 			fin.seekg(0, fin.beg);
 
 			dst.resize(length);
@@ -34,7 +39,7 @@ namespace CloudBackup {
 			fin.close();
 			return true;
 		}
-		// srcед뵽ָļ
+		// 将src中的所有数据写入到指定文件中
 		static bool writeFile(const std::string &name, const std::string &src) {
 			std::ofstream fout(name.c_str(), std::ios::binary);
 			if (!fout.is_open()) {
@@ -42,6 +47,39 @@ namespace CloudBackup {
 				return false;
 			}
 
+			fout.write(src.c_str(), src.length());
+			if (!fout.good()) {
+				std::cout << "write file " + name + " failed!" << std::endl;
+				fout.close();
+				return false;
+			}
+			fout.close();
+			return true;
+		}
+		// 读取文件中从offset开始的length字节, 文件不够长时返回false
+		static bool readFile(const std::string &name, std::string &dst, size_t offset, size_t length) {
+			std::ifstream fin(name.c_str(), std::ios::binary);
+			if (!fin.is_open()) {
+				std::cout << "open file " + name + " failed!" << std::endl;
+				return false;
+			}
+			dst.resize(length);
+			fin.seekg(offset, fin.beg);
+			fin.read(&dst[0], length);
+			if (!fin.good()) {
+				std::cout << "read file " + name + " failed!" << std::endl;
+				return false;
+			}
+			return true;
+		}
+		// 将src中的所有数据追加到指定文件的末尾
+		static bool appendFile(const std::string &name, const std::string &src) {
+			std::ofstream fout(name.c_str(), std::ios::binary | std::ios::app);
+			if (!fout.is_open()) {
+				std::cout << "open file " + name + " failed!" << std::endl;
+				return false;
+			}
+
 			fout.write(src.c_str(), src.length());
 			if (!fout.good()) {
 				std::cout << "write file " + name + " failed!" << std::endl;
@@ -77,7 +115,7 @@ namespace CloudBackup {
       }
       return config;
     }
-		// ·
+		// 处理路径
 		static std::string& DealPath(std::string &path) {
 			while (path.find("\\") != std::string::npos) {
 				size_t pos = path.find("\\");
@@ -89,7 +127,7 @@ namespace CloudBackup {
 			}
 			return path;
 		}
-		// ȵļж
+		// 非热点文件判断
 		static bool isNonHotFile(const std::string &filepath, time_t intervalTime) {
 			time_t cur = time(nullptr);
 			struct stat buf;
@@ -100,14 +138,78 @@ namespace CloudBackup {
 			}
 			return (cur - buf.st_atime) > intervalTime;
 		}
-		// sleep
+		// sleep函数
 		static void MySleep(int secs) {
 			boost::xtime xt;
-			boost::xtime_get(&xt, boost::xtime_clock_types::TIME_UTC_); //õǰʱxt.
-			xt.sec += secs; //ڵǰʱϼsecs,õһµʱ,
-			//Ȼʹ߳ߵָʱxt.
+			boost::xtime_get(&xt, boost::xtime_clock_types::TIME_UTC_); //得到当前时间点xt.
+			xt.sec += secs; //在当前时间点上加上secs秒,得到一个新的时间点,
+			//然后使线程休眠到指定的时间点xt.
 			boost::thread::sleep(xt); // sleep for secs second;
 		}
+		// 线程安全的时间格式化, 格式与ctime相同但不带结尾的换行
+		static std::string formatTime(time_t t) {
+			struct tm tmbuf;
+			char buf[32] = { 0 };
+			localtime_r(&t, &tmbuf);
+			strftime(buf, sizeof(buf), "%a %b %e %H:%M:%S %Y", &tmbuf);
+			return buf;
+		}
+		// HTTP头中使用的时间格式(IMF-fixdate), 例如 Sun, 06 Nov 1994 08:49:37 GMT
+		static std::string httpDate(time_t t) {
+			struct tm tmbuf;
+			char buf[32] = { 0 };
+			gmtime_r(&t, &tmbuf);
+			strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tmbuf);
+			return buf;
+		}
+		// 解析IMF-fixdate格式的时间, 格式不对时返回false
+		static bool parseHttpDate(const std::string &str, time_t &t) {
+			struct tm tmbuf;
+			memset(&tmbuf, 0, sizeof(tmbuf));
+			const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tmbuf);
+			if (end == nullptr || *end != '\0') {
+				return false;
+			}
+			t = timegm(&tmbuf);
+			return true;
+		}
+		// url编码, 只保留非保留字符
+		static std::string urlEncode(const std::string &src) {
+			static const char hex[] = "0123456789ABCDEF";
+			std::string dst;
+			dst.reserve(src.size());
+			for (unsigned char c : src) {
+				if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+					dst += c;
+				} else {
+					dst += '%';
+					dst += hex[c >> 4];
+					dst += hex[c & 0xF];
+				}
+			}
+			return dst;
+		}
+		// json字符串转义, 追加到dst后面
+		static void jsonEscape(const std::string &src, std::string &dst) {
+			static const char hex[] = "0123456789abcdef";
+			for (unsigned char c : src) {
+				switch (c) {
+				case '"': dst += "\\\""; break;
+				case '\\': dst += "\\\\"; break;
+				case '\n': dst += "\\n"; break;
+				case '\r': dst += "\\r"; break;
+				case '\t': dst += "\\t"; break;
+				default:
+					if (c < 0x20) {
+						dst += "\\u00";
+						dst += hex[c >> 4];
+						dst += hex[c & 0xF];
+					} else {
+						dst += c;
+					}
+				}
+			}
+		}
 	};
 }
 #endif /* _MYUTIL_HPP_ */
@@ -0,0 +1,211 @@
+#ifndef _OBJECTCACHE_HPP_
+#define _OBJECTCACHE_HPP_
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <unordered_map>
+#include "XXHash64.hpp"
+#include "Metrics.hpp"
+
+namespace CloudBackup {
+  // 小文件内容的内存缓存: 按键的哈希分成m_s_Shards个分片, 每个分片一把锁, 各自按LRU淘汰, 容量按字节计算
+  // 准入(TinyLFU): 每个分片用一个Count-Min Sketch估计各个键最近的访问频率(查找时不论命中与否都计数),
+  // 放入新内容需要淘汰旧内容时, 只有新内容的频率高于所有被淘汰者才放入, 一次性的大量访问(例如全量下载)不会冲掉热点
+  // 计数器到15饱和, 总计数达到计数器数量的10倍时全部减半, 频率反映的是最近的访问
+  // 每项带一个版本号(由调用者根据索引项算出), 查找时版本不同视为未命中, 读到一半被覆盖的旧内容不会被当成新内容返回
+  class ObjectCache
+  {
+    typedef std::shared_ptr<const std::string> Value;
+    struct Entry
+    {
+      std::string m_key;
+      uint64_t m_version;
+      Value m_value;
+      size_t m_charge; // 计入容量的字节数, 含键和管理开销
+    };
+    // 4行的Count-Min Sketch, 每个计数器一个字节
+    class Sketch
+    {
+      public:
+        Sketch() : m_mask(0), m_additions(0) {}
+        void resize(size_t width) {
+          size_t n = 64;
+          while (n < width) {
+            n <<= 1;
+          }
+          m_table.assign(n * m_s_Rows, 0);
+          m_mask = n - 1;
+          m_additions = 0;
+        }
+        void increment(uint64_t h) {
+          if (m_table.empty()) {
+            return;
+          }
+          bool added = false;
+          for (size_t i = 0; i < m_s_Rows; ++i) {
+            uint8_t &c = m_table[_index(h, i)];
+            if (c < m_s_MaxCount) {
+              ++c;
+              added = true;
+            }
+          }
+          if (added && ++m_additions >= m_table.size() / m_s_Rows * 10) {
+            for (uint8_t &c : m_table) {
+              c >>= 1;
+            }
+            m_additions /= 2;
+          }
+        }
+        unsigned frequency(uint64_t h) const {
+          if (m_table.empty()) {
+            return 0;
+          }
+          unsigned freq = m_s_MaxCount;
+          for (size_t i = 0; i < m_s_Rows; ++i) {
+            freq = std::min<unsigned>(freq, m_table[_index(h, i)]);
+          }
+          return freq;
+        }
+      private:
+        // 由一个64位哈希导出各行的位置
+        size_t _index(uint64_t h, size_t row) const {
+          uint64_t h2 = (h >> 32) | 1;
+          return row * (m_mask + 1) + ((h + row * h2) & m_mask);
+        }
+        std::vector<uint8_t> m_table;
+        size_t m_mask;
+        size_t m_additions;
+        static const size_t m_s_Rows = 4;
+        static const uint8_t m_s_MaxCount = 15;
+    };
+    struct Shard
+    {
+      std::mutex m_mutex;
+      std::list<Entry> m_lru; // 头部是最近使用的
+      std::unordered_map<std::string, std::list<Entry>::iterator> m_map;
+      size_t m_bytes = 0;
+      Sketch m_sketch;
+    };
+    public:
+      ObjectCache() : m_capacity(0), m_maxObject(0) {}
+      ObjectCache(const ObjectCache &) = delete;
+      ObjectCache &operator=(const ObjectCache &) = delete;
+
+      // capacity为总字节数, 0表示不缓存; 超过maxObject字节的内容不缓存
+      // 在使用之前调用
+      void configure(size_t capacity, size_t maxObject) {
+        m_capacity = capacity / m_s_Shards;
+        m_maxObject = std::min(maxObject, m_capacity);
+        for (Shard &shard : m_shards) {
+          std::lock_guard<std::mutex> lock(shard.m_mutex);
+          // 按平均每项4KB估计分片能容纳的项数, 作为Sketch的宽度
+          shard.m_sketch.resize(m_capacity / 4096);
+        }
+      }
+      bool enabled() const {
+        return m_capacity > 0;
+      }
+      size_t maxObject() const {
+        return m_maxObject;
+      }
+      // 版本相同时返回缓存的内容, 否则返回空; 同时记一次访问
+      Value get(const std::string &key, uint64_t version) {
+        static Counter &hits = Metrics::counter("cloudbackup_cache_requests_total", "Object cache lookups", "result=\"hit\"");
+        static Counter &misses = Metrics::counter("cloudbackup_cache_requests_total", "Object cache lookups", "result=\"miss\"");
+        uint64_t h = XXHash64::hash(key);
+        Shard &shard = _shard(h);
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        shard.m_sketch.increment(h);
+        auto it = shard.m_map.find(key);
+        if (it == shard.m_map.end() || it->second->m_version != version) {
+          misses.add(1);
+          return nullptr;
+        }
+        shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, it->second);
+        hits.add(1);
+        return it->second->m_value;
+      }
+      // 放入内容, 空间不够时按准入规则决定是否淘汰旧内容; 返回是否放入
+      bool put(const std::string &key, uint64_t version, Value value) {
+        static Counter &admitted = Metrics::counter("cloudbackup_cache_admissions_total", "Objects admitted into the cache", "result=\"admitted\"");
+        static Counter &rejected = Metrics::counter("cloudbackup_cache_admissions_total", "Objects admitted into the cache", "result=\"rejected\"");
+        static Counter &evicted = Metrics::counter("cloudbackup_cache_evictions_total", "Objects evicted to make room for more frequent ones");
+        if (!value || value->size() > m_maxObject) {
+          return false;
+        }
+        size_t charge = value->size() + key.size() + m_s_Overhead;
+        uint64_t h = XXHash64::hash(key);
+        Shard &shard = _shard(h);
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        auto it = shard.m_map.find(key);
+        if (it != shard.m_map.end()) {
+          _remove(shard, it->second);
+        }
+        // 从LRU尾部找出需要淘汰的项, 有一项的频率不低于新内容时放弃, 不淘汰任何项
+        unsigned freq = shard.m_sketch.frequency(h);
+        size_t freed = 0, victims = 0;
+        for (auto victim = shard.m_lru.rbegin(); shard.m_bytes - freed + charge > m_capacity; ++victim, ++victims) {
+          if (victim == shard.m_lru.rend() || shard.m_sketch.frequency(XXHash64::hash(victim->m_key)) >= freq) {
+            rejected.add(1);
+            return false;
+          }
+          freed += victim->m_charge;
+        }
+        for (; victims > 0; --victims) {
+          _remove(shard, std::prev(shard.m_lru.end()));
+          evicted.add(1);
+        }
+        shard.m_lru.push_front(Entry{ key, version, std::move(value), charge });
+        shard.m_map[key] = shard.m_lru.begin();
+        shard.m_bytes += charge;
+        admitted.add(1);
+        return true;
+      }
+      void erase(const std::string &key) {
+        Shard &shard = _shard(XXHash64::hash(key));
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        auto it = shard.m_map.find(key);
+        if (it != shard.m_map.end()) {
+          _remove(shard, it->second);
+        }
+      }
+      bool contains(const std::string &key) {
+        Shard &shard = _shard(XXHash64::hash(key));
+        std::lock_guard<std::mutex> lock(shard.m_mutex);
+        return shard.m_map.count(key) != 0;
+      }
+      // 项数和占用的字节数, 用于监控
+      void stats(size_t &count, size_t &bytes) {
+        count = bytes = 0;
+        for (Shard &shard : m_shards) {
+          std::lock_guard<std::mutex> lock(shard.m_mutex);
+          count += shard.m_map.size();
+          bytes += shard.m_bytes;
+        }
+      }
+    private:
+      Shard &_shard(uint64_t h) {
+        // 低位用于Sketch的位置, 分片用高位
+        return m_shards[(h >> 58) % m_s_Shards];
+      }
+      static void _remove(Shard &shard, std::list<Entry>::iterator it) {
+        shard.m_bytes -= it->m_charge;
+        shard.m_map.erase(it->m_key);
+        shard.m_lru.erase(it);
+      }
+    private:
+      static const size_t m_s_Shards = 16;
+      static const size_t m_s_Overhead = 128; // 每项的链表节点, 哈希表节点和键的额外开销的估计
+      Shard m_shards[m_s_Shards];
+      size_t m_capacity;  // 每个分片的容量
+      size_t m_maxObject;
+  };
+}
+
+#endif /* _OBJECTCACHE_HPP_ */
@@ -0,0 +1,203 @@
+#ifndef _PATHTABLE_HPP_
+#define _PATHTABLE_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/utility/string_view.hpp>
+
+namespace CloudBackup {
+  // 路径驻留表: 路径按'/'拆成一棵目录树, 每个节点只保存父节点号和名字号(8字节),
+  // 名字在arena中只存一份, 不同目录下的同名文件共用同一个名字, 公共前缀只在树中出现一次
+  // 节点号在表的生命周期内不变, 0是根节点(空路径); 节点只增不删, 删除由使用者在节点号索引的数组中标记
+  // 拆分和拼接是严格互逆的: "/a/b"拆成"", "a", "b", "a//b"中间的空名字也会保留
+  class PathTable
+  {
+    struct Node
+    {
+      uint32_t m_parent;
+      uint32_t m_atom;
+    };
+    struct Atom
+    {
+      uint32_t m_offset; // 在m_arena中的位置
+      uint32_t m_len;
+    };
+    public:
+      typedef uint32_t Id;
+
+      PathTable() : m_nodeSlots(16, 0), m_atomSlots(16, 0) {
+        m_nodes.push_back(Node{ 0, 0 }); // 根节点
+        m_atoms.push_back(Atom{ 0, 0 }); // 0号名字不使用, 哈希表中0表示空位
+      }
+      // 查找路径对应的节点, 不存在时返回false
+      bool find(boost::string_view path, Id &id) const {
+        Id cur = 0;
+        size_t begin = 0;
+        while (!path.empty()) {
+          size_t pos = path.find('/', begin);
+          boost::string_view name = path.substr(begin, pos == boost::string_view::npos ? pos : pos - begin);
+          uint32_t atom = _findAtom(name);
+          if (atom == 0 || (cur = _findChild(cur, atom)) == 0) {
+            return false;
+          }
+          if (pos == boost::string_view::npos) {
+            break;
+          }
+          begin = pos + 1;
+        }
+        id = cur;
+        return true;
+      }
+      // 查找或插入路径, 返回它的节点号
+      Id intern(boost::string_view path) {
+        Id cur = 0;
+        size_t begin = 0;
+        while (!path.empty()) {
+          size_t pos = path.find('/', begin);
+          boost::string_view name = path.substr(begin, pos == boost::string_view::npos ? pos : pos - begin);
+          uint32_t atom = _internAtom(name);
+          Id child = _findChild(cur, atom);
+          cur = (child != 0) ? child : _addChild(cur, atom);
+          if (pos == boost::string_view::npos) {
+            break;
+          }
+          begin = pos + 1;
+        }
+        return cur;
+      }
+      // 最后一级的名字, 在下一次intern之前有效
+      boost::string_view name(Id id) const {
+        const Atom &atom = m_atoms[m_nodes[id].m_atom];
+        return boost::string_view(m_arena.data() + atom.m_offset, atom.m_len);
+      }
+      Id parent(Id id) const {
+        return m_nodes[id].m_parent;
+      }
+      // 把完整路径追加到dst, 可以复用同一个缓冲区逐个拼出路径而不分配内存
+      void appendPath(Id id, std::string &dst) const {
+        if (id == 0) {
+          return;
+        }
+        size_t begin = dst.size(), len = 0;
+        for (Id cur = id; cur != 0; cur = m_nodes[cur].m_parent) {
+          len += m_atoms[m_nodes[cur].m_atom].m_len + (m_nodes[cur].m_parent != 0 ? 1 : 0);
+        }
+        dst.resize(begin + len);
+        size_t end = begin + len;
+        for (Id cur = id; cur != 0; cur = m_nodes[cur].m_parent) {
+          const Atom &atom = m_atoms[m_nodes[cur].m_atom];
+          end -= atom.m_len;
+          m_arena.copy(&dst[end], atom.m_len, atom.m_offset);
+          if (m_nodes[cur].m_parent != 0) {
+            dst[--end] = '/';
+          }
+        }
+      }
+      std::string path(Id id) const {
+        std::string res;
+        appendPath(id, res);
+        return res;
+      }
+      // 节点数, 包括根节点和中间的目录节点, 节点号都小于它
+      size_t size() const {
+        return m_nodes.size();
+      }
+      // 占用的堆内存(按容量计算)
+      size_t memoryUsage() const {
+        return m_nodes.capacity() * sizeof(Node) + m_atoms.capacity() * sizeof(Atom) + m_arena.capacity()
+          + (m_nodeSlots.capacity() + m_atomSlots.capacity()) * sizeof(uint32_t);
+      }
+    private:
+      static uint64_t _mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+      }
+      // FNV-1a
+      static uint64_t _hashName(boost::string_view name) {
+        uint64_t h = 14695981039346656037ULL;
+        for (char c : name) {
+          h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+        }
+        return h;
+      }
+      static uint64_t _hashChild(Id parent, uint32_t atom) {
+        return _mix((static_cast<uint64_t>(parent) << 32) | atom);
+      }
+      boost::string_view _atomName(uint32_t atom) const {
+        return boost::string_view(m_arena.data() + m_atoms[atom].m_offset, m_atoms[atom].m_len);
+      }
+      // 以下两个开放寻址哈希表都只存编号, 键从m_atoms/m_nodes中取, 负载因子不超过1/2
+      uint32_t _findAtom(boost::string_view name) const {
+        size_t mask = m_atomSlots.size() - 1;
+        for (size_t slot = _hashName(name) & mask; m_atomSlots[slot] != 0; slot = (slot + 1) & mask) {
+          if (_atomName(m_atomSlots[slot]) == name) {
+            return m_atomSlots[slot];
+          }
+        }
+        return 0;
+      }
+      uint32_t _internAtom(boost::string_view name) {
+        uint32_t atom = _findAtom(name);
+        if (atom != 0) {
+          return atom;
+        }
+        atom = static_cast<uint32_t>(m_atoms.size());
+        m_atoms.push_back(Atom{ static_cast<uint32_t>(m_arena.size()), static_cast<uint32_t>(name.size()) });
+        m_arena.append(name.data(), name.size());
+        if (m_atoms.size() * 2 > m_atomSlots.size()) {
+          _rehash(m_atomSlots, [this](uint32_t a) { return _hashName(_atomName(a)); });
+        } else {
+          _place(m_atomSlots, _hashName(name), atom);
+        }
+        return atom;
+      }
+      Id _findChild(Id parent, uint32_t atom) const {
+        size_t mask = m_nodeSlots.size() - 1;
+        for (size_t slot = _hashChild(parent, atom) & mask; m_nodeSlots[slot] != 0; slot = (slot + 1) & mask) {
+          const Node &node = m_nodes[m_nodeSlots[slot]];
+          if (node.m_parent == parent && node.m_atom == atom) {
+            return m_nodeSlots[slot];
+          }
+        }
+        return 0;
+      }
+      Id _addChild(Id parent, uint32_t atom) {
+        Id id = static_cast<Id>(m_nodes.size());
+        m_nodes.push_back(Node{ parent, atom });
+        if (m_nodes.size() * 2 > m_nodeSlots.size()) {
+          _rehash(m_nodeSlots, [this](uint32_t n) { return _hashChild(m_nodes[n].m_parent, m_nodes[n].m_atom); });
+        } else {
+          _place(m_nodeSlots, _hashChild(parent, atom), id);
+        }
+        return id;
+      }
+      static void _place(std::vector<uint32_t> &slots, uint64_t hash, uint32_t value) {
+        size_t mask = slots.size() - 1, slot = hash & mask;
+        while (slots[slot] != 0) {
+          slot = (slot + 1) & mask;
+        }
+        slots[slot] = value;
+      }
+      // 容量翻倍, 重新放入1..count-1号(新加入的也在其中)
+      template <typename Hash>
+      void _rehash(std::vector<uint32_t> &slots, Hash hash) {
+        size_t count = (&slots == &m_nodeSlots) ? m_nodes.size() : m_atoms.size();
+        std::vector<uint32_t> bigger(slots.size() * 2, 0);
+        for (uint32_t i = 1; i < count; ++i) {
+          _place(bigger, hash(i), i);
+        }
+        slots.swap(bigger);
+      }
+    private:
+      std::vector<Node> m_nodes;
+      std::vector<Atom> m_atoms;
+      std::string m_arena;
+      std::vector<uint32_t> m_nodeSlots;
+      std::vector<uint32_t> m_atomSlots;
+  };
+}
+
+#endif /* _PATHTABLE_HPP_ */
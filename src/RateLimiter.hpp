@@ -0,0 +1,170 @@
+#ifndef _RATELIMITER_HPP_
+#define _RATELIMITER_HPP_
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <algorithm>
+
+namespace CloudBackup {
+  // 上传限速: 令牌桶 + 按时段的速率表 + 可选的自适应退让
+  // 速率表: "09:00-18:00=512K,18:00-23:00=4M", 不在任何时段内时使用默认速率; 时段可以跨过0点
+  // 速率单位是字节/秒, 可以带K/M/G后缀(1024进制), 0表示不限速
+  // 自适应: 每个请求建立连接的耗时作为RTT样本, RTT明显高于基线(上行链路排队)时速率乘0.7, 否则每次恢复5%, 最多恢复到速率表的值
+  // 多个上传线程共用一个限速器, 令牌不够时先记账再睡眠, 各线程按请求的先后分到带宽
+  class RateLimiter
+  {
+    struct Window
+    {
+      int m_begin; // 一天中的分钟数
+      int m_end;
+      double m_rate;
+    };
+    public:
+      RateLimiter() : m_defaultRate(0), m_adaptive(false), m_cap(0), m_factor(1), m_baseRtt(0),
+        m_throughput(0), m_tokens(0), m_last(std::chrono::steady_clock::now()) {}
+
+      // 格式错误的时段输出错误并忽略
+      void configure(const std::string &defaultRate, const std::string &schedule, bool adaptive) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_defaultRate = parseRate(defaultRate);
+        m_adaptive = adaptive;
+        m_windows.clear();
+        size_t begin = 0;
+        while (begin < schedule.size()) {
+          size_t end = schedule.find(',', begin);
+          if (end == std::string::npos) {
+            end = schedule.size();
+          }
+          std::string item = schedule.substr(begin, end - begin);
+          int h1, m1, h2, m2;
+          char rate[32];
+          if (sscanf(item.c_str(), " %d:%d-%d:%d=%31s", &h1, &m1, &h2, &m2, rate) == 5) {
+            m_windows.push_back(Window{ h1 * 60 + m1, h2 * 60 + m2, parseRate(rate) });
+          } else if (!item.empty()) {
+            std::cout << "bad upload rate schedule item: " << item << std::endl;
+          }
+          begin = end + 1;
+        }
+        m_cap = _scheduled(time(nullptr));
+      }
+      // 按当前时间重新取速率表中的值, 每轮扫描调用一次
+      void update(time_t now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cap = _scheduled(now);
+      }
+      // 发送n字节之前调用, 令牌不够时睡眠, 返回睡眠的纳秒数
+      uint64_t acquire(size_t n) {
+        std::chrono::nanoseconds wait(0);
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          double rate = _rate();
+          auto now = std::chrono::steady_clock::now();
+          if (rate <= 0) {
+            m_tokens = 0;
+            m_last = now;
+            return 0;
+          }
+          // 最多积攒0.1秒的令牌, 空闲之后的突发不会太大
+          double elapsed = std::chrono::duration<double>(now - m_last).count();
+          m_tokens = std::min(m_tokens + elapsed * rate, rate / 10);
+          m_last = now;
+          m_tokens -= n;
+          if (m_tokens < 0) {
+            wait = std::chrono::nanoseconds(static_cast<int64_t>(-m_tokens / rate * 1e9));
+          }
+        }
+        if (wait.count() > 0) {
+          std::this_thread::sleep_for(wait);
+        }
+        return wait.count();
+      }
+      // 一个请求的RTT样本和发送速度样本(字节数和发送耗时), 只在自适应模式下使用
+      void sample(uint64_t rttNs, size_t bytes, uint64_t sendNs) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_adaptive || rttNs == 0) {
+          return;
+        }
+        // 基线是最小RTT, 并缓慢向上跟随, 网络路径变化后能重新学到
+        if (m_baseRtt == 0 || rttNs < m_baseRtt) {
+          m_baseRtt = rttNs;
+        } else {
+          m_baseRtt += (rttNs - m_baseRtt) / 256;
+        }
+        if (bytes >= m_s_MinThroughputSample && sendNs > 0) {
+          double speed = bytes * 1e9 / sendNs;
+          m_throughput = (m_throughput == 0) ? speed : m_throughput * 0.8 + speed * 0.2;
+        }
+        if (rttNs > m_baseRtt * 2 && rttNs - m_baseRtt > m_s_MinQueueDelayNs) {
+          m_factor = std::max(m_factor * 0.7, 0.05);
+        } else {
+          m_factor = std::min(m_factor + 0.05, 1.0);
+        }
+      }
+      // 当前生效的速率, 0表示不限速
+      double limit() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return _rate();
+      }
+      // "512K" -> 524288, 不能解析时为0
+      static double parseRate(const std::string &str) {
+        char *end = nullptr;
+        double rate = strtod(str.c_str(), &end);
+        if (end == str.c_str() || rate < 0) {
+          return 0;
+        }
+        switch (*end) {
+          case 'k': case 'K': return rate * 1024;
+          case 'm': case 'M': return rate * 1024 * 1024;
+          case 'g': case 'G': return rate * 1024 * 1024 * 1024;
+          default: return rate;
+        }
+      }
+    private:
+      double _scheduled(time_t now) const {
+        struct tm local;
+        localtime_r(&now, &local);
+        int minute = local.tm_hour * 60 + local.tm_min;
+        for (const Window &w : m_windows) {
+          bool in = (w.m_begin <= w.m_end) ? (minute >= w.m_begin && minute < w.m_end)
+            : (minute >= w.m_begin || minute < w.m_end);
+          if (in) {
+            return w.m_rate;
+          }
+        }
+        return m_defaultRate;
+      }
+      // 不限速时自适应以最近测得的发送速度为上限
+      double _rate() const {
+        if (!m_adaptive || m_factor >= 1.0) {
+          return m_cap;
+        }
+        if (m_cap > 0) {
+          return m_cap * m_factor;
+        }
+        return m_throughput * m_factor;
+      }
+    private:
+      std::mutex m_mutex;
+      double m_defaultRate;
+      std::vector<Window> m_windows;
+      bool m_adaptive;
+      double m_cap;        // 速率表中当前时段的速率
+      double m_factor;     // 自适应系数, (0, 1]
+      uint64_t m_baseRtt;
+      double m_throughput; // 发送速度的滑动平均, 字节/秒
+      double m_tokens;     // 可以为负, 表示已经透支, 后来的请求要多等
+      std::chrono::steady_clock::time_point m_last;
+      static const size_t m_s_MinThroughputSample = 64 * 1024;
+      static const uint64_t m_s_MinQueueDelayNs = 5000000; // 局域网上RTT很小, 几毫秒的抖动不算拥塞
+  };
+}
+
+#endif /* _RATELIMITER_HPP_ */
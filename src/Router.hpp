@@ -0,0 +1,162 @@
+#ifndef _ROUTER_HPP_
+#define _ROUTER_HPP_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+#include "httplib.h"
+
+namespace CloudBackup {
+  // 基于前缀树的路由, 代替httplib对每个请求逐个做std::regex匹配
+  // 路由模式沿用原来的写法, 只支持两种捕获:
+  //   ([0-9]*) 捕获一段连续的数字
+  //   (.*)     捕获剩余的全部路径, 只能出现在模式的末尾
+  // 捕获结果按顺序存入req.path_params[1..], path_params[0]为完整路径, 与req.matches的下标一致
+  class Router
+  {
+    public:
+      typedef httplib::Server::Handler Handler;
+
+      Router &Get(const char *pattern, Handler handler) {
+        return _add(m_get, pattern, handler);
+      }
+      Router &Post(const char *pattern, Handler handler) {
+        return _add(m_post, pattern, handler);
+      }
+      Router &Put(const char *pattern, Handler handler) {
+        return _add(m_put, pattern, handler);
+      }
+      Router &Delete(const char *pattern, Handler handler) {
+        return _add(m_delete, pattern, handler);
+      }
+      // 查找method和path对应的处理函数, 成功时params中存放捕获结果
+      const Handler *route(const std::string &method, const std::string &path,
+          std::vector<std::string> &params) const {
+        const Node *root = _root(method);
+        params.clear();
+        if (root == nullptr) {
+          return nullptr;
+        }
+        params.push_back(path);
+        const Node *node = _match(root, path, 0, params);
+        if (node == nullptr) {
+          params.clear();
+          return nullptr;
+        }
+        return &node->m_handler;
+      }
+      // 作为httplib::Server的dispatcher使用, 未匹配时返回false交给httplib继续处理
+      bool dispatch(httplib::Request &req, httplib::Response &res) const {
+        const Handler *handler = route(req.method, req.path, req.path_params);
+        if (handler == nullptr) {
+          return false;
+        }
+        (*handler)(req, res);
+        return true;
+      }
+
+    private:
+      struct Node
+      {
+        std::vector<std::pair<char, std::unique_ptr<Node>>> m_children; // 字面字符
+        std::unique_ptr<Node> m_digits; // ([0-9]*)
+        std::unique_ptr<Node> m_rest;   // (.*)
+        Handler m_handler;
+      };
+
+      Router &_add(Node &root, const char *pattern, Handler handler) {
+        static const std::string digits = "([0-9]*)", rest = "(.*)";
+        std::string pat(pattern);
+        Node *node = &root;
+        for (size_t i = 0; i < pat.size(); ) {
+          if (pat.compare(i, digits.size(), digits) == 0) {
+            if (!node->m_digits) {
+              node->m_digits.reset(new Node);
+            }
+            node = node->m_digits.get();
+            i += digits.size();
+          } else if (pat.compare(i, rest.size(), rest) == 0) {
+            if (i + rest.size() != pat.size()) {
+              throw std::runtime_error("route " + pat + ": (.*) must be at the end");
+            }
+            if (!node->m_rest) {
+              node->m_rest.reset(new Node);
+            }
+            node = node->m_rest.get();
+            i += rest.size();
+          } else if (pat[i] == '(' || pat[i] == '[' || pat[i] == '*' || pat[i] == '\\') {
+            throw std::runtime_error("route " + pat + ": unsupported pattern");
+          } else {
+            node = _child(node, pat[i++]);
+          }
+        }
+        node->m_handler = handler;
+        return *this;
+      }
+      static Node *_child(Node *node, char c) {
+        for (auto &child : node->m_children) {
+          if (child.first == c) {
+            return child.second.get();
+          }
+        }
+        node->m_children.emplace_back(c, std::unique_ptr<Node>(new Node));
+        return node->m_children.back().second.get();
+      }
+      // 深度优先匹配, 字面字符优先, 失败时回溯到捕获
+      static const Node *_match(const Node *node, const std::string &path, size_t pos,
+          std::vector<std::string> &params) {
+        if (pos == path.size() && node->m_handler) {
+          return node;
+        }
+        if (pos < path.size()) {
+          for (auto &child : node->m_children) {
+            if (child.first == path[pos]) {
+              const Node *res = _match(child.second.get(), path, pos + 1, params);
+              if (res != nullptr) {
+                return res;
+              }
+              break;
+            }
+          }
+        }
+        if (node->m_digits) {
+          size_t end = pos;
+          while (end < path.size() && path[end] >= '0' && path[end] <= '9') {
+            ++end;
+          }
+          params.emplace_back(path, pos, end - pos);
+          const Node *res = _match(node->m_digits.get(), path, end, params);
+          if (res != nullptr) {
+            return res;
+          }
+          params.pop_back();
+        }
+        if (node->m_rest && node->m_rest->m_handler) {
+          params.emplace_back(path, pos, std::string::npos);
+          return node->m_rest.get();
+        }
+        return nullptr;
+      }
+      const Node *_root(const std::string &method) const {
+        if (method == "GET" || method == "HEAD") {
+          return &m_get;
+        } else if (method == "POST") {
+          return &m_post;
+        } else if (method == "PUT") {
+          return &m_put;
+        } else if (method == "DELETE") {
+          return &m_delete;
+        }
+        return nullptr;
+      }
+    private:
+      Node m_get;
+      Node m_post;
+      Node m_put;
+      Node m_delete;
+  };
+}
+
+#endif /* _ROUTER_HPP_ */
@@ -0,0 +1,233 @@
+#ifndef _SEGMENTSTORE_HPP_
+#define _SEGMENTSTORE_HPP_
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
+#include "DurableFile.hpp"
+
+namespace CloudBackup {
+  // 小文件的段存储: 内容依次追加到大的段文件中, 不再每个文件占用一个inode
+  // 段文件名为8位十六进制的段号加.seg, 只追加不修改; 文件在段中的位置(段号, 偏移, 长度)记录在索引中
+  // 每条记录(本机字节序): Record头 16字节, 路径, 内容; 路径用于回收时判断记录是否仍被索引引用
+  // 索引不再引用的记录是垃圾, 有效数据比例低的段由FileDataManager::compactSegments回收
+  class SegmentStore
+  {
+    struct Record
+    {
+      uint32_t m_magic;
+      uint32_t m_pathLen;
+      uint64_t m_size;
+    };
+    // 读取时持有shared_ptr, 段被删除后最后一个读者结束时才关闭文件
+    struct Segment
+    {
+      int m_fd;
+      uint64_t m_size; // 文件长度
+      uint64_t m_live; // 仍被索引引用的记录的字节数(含头部和路径)
+      explicit Segment(int fd, uint64_t size = 0) : m_fd(fd), m_size(size), m_live(0) {}
+      ~Segment() {
+        close(m_fd);
+      }
+    };
+    public:
+      SegmentStore() : m_segmentSize(0), m_active(0), m_next(0) {}
+      SegmentStore(const SegmentStore &) = delete;
+      SegmentStore &operator=(const SegmentStore &) = delete;
+
+      // 打开目录中已有的段, 之后的写入从一个新段开始(上次运行时活动段的末尾可能有写了一半的记录)
+      // 各段的有效字节数由调用者根据索引用addLive设置
+      bool open(const std::string &dir, uint64_t segmentSize) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(dir, ec);
+        boost::filesystem::directory_iterator it(dir, ec), end;
+        if (ec) {
+          return false;
+        }
+        m_dir = dir;
+        m_segmentSize = segmentSize;
+        if (m_segmentSize == 0) {
+          m_segmentSize = m_s_DefaultSegmentSize;
+        }
+        for (; it != end; it.increment(ec)) {
+          std::string name = it->path().filename().string();
+          char *stop = nullptr;
+          unsigned long id = strtoul(name.c_str(), &stop, 16);
+          if (name.size() != 12 || std::string(stop) != ".seg") {
+            continue;
+          }
+          int fd = ::open(_name(id).c_str(), O_RDWR | O_CLOEXEC);
+          struct stat buf;
+          if (fd < 0 || fstat(fd, &buf) < 0) {
+            if (fd >= 0) {
+              close(fd);
+            }
+            continue;
+          }
+          m_segments[id] = std::make_shared<Segment>(fd, buf.st_size);
+          m_next = std::max(m_next, static_cast<uint32_t>(id) + 1);
+        }
+        m_active = m_next;
+        return true;
+      }
+      bool enabled() const {
+        return !m_dir.empty();
+      }
+      // 追加一条记录, 返回内容在段中的位置; 活动段超过段大小时换到新段
+      bool append(boost::string_view path, const char *data, size_t len, uint32_t &segment, uint64_t &offset) {
+        Record record{ m_s_Magic, static_cast<uint32_t>(path.size()), len };
+        std::string buf(reinterpret_cast<const char *>(&record), sizeof(record));
+        buf.append(path.data(), path.size());
+        buf.append(data, len);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_segments.find(m_active);
+        if (it == m_segments.end() || it->second->m_size >= m_segmentSize) {
+          if (it != m_segments.end()) {
+            m_active = m_next;
+          }
+          int fd = ::open(_name(m_active).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+          if (fd < 0) {
+            return false;
+          }
+          it = m_segments.emplace(m_active, std::make_shared<Segment>(fd)).first;
+          m_next = m_active + 1;
+        }
+        Segment &seg = *it->second;
+        for (size_t done = 0; done < buf.size(); ) {
+          ssize_t n = pwrite(seg.m_fd, buf.data() + done, buf.size() - done, seg.m_size + done);
+          if (n <= 0) {
+            // 写了一半的记录不会被索引引用, 之后的记录接着写在它后面
+            seg.m_size += done;
+            return false;
+          }
+          done += n;
+        }
+        segment = m_active;
+        offset = seg.m_size + sizeof(record) + path.size();
+        seg.m_size += buf.size();
+        return true;
+      }
+      bool read(uint32_t segment, uint64_t offset, size_t len, std::string &dst) {
+        std::shared_ptr<Segment> seg = _find(segment);
+        return seg && _pread(seg->m_fd, dst, len, offset);
+      }
+      // 索引引用或不再引用一条记录时调整所在段的有效字节数
+      void addLive(uint32_t segment, boost::string_view path, size_t len, bool live) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_segments.find(segment);
+        if (it != m_segments.end()) {
+          uint64_t bytes = sizeof(Record) + path.size() + len;
+          it->second->m_live = live ? it->second->m_live + bytes : it->second->m_live - std::min(it->second->m_live, bytes);
+        }
+      }
+      // 有效数据低于percent%的段, 不包括活动段
+      std::vector<uint32_t> garbageSegments(unsigned percent) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<uint32_t> res;
+        for (auto &item : m_segments) {
+          const Segment &seg = *item.second;
+          if (item.first != m_active && (seg.m_live * 100 < seg.m_size * percent || seg.m_live == 0)) {
+            res.push_back(item.first);
+          }
+        }
+        return res;
+      }
+      // 按顺序读出段中的每条记录, visit(path, offset, data)返回false时停止; 遇到不完整的记录时结束
+      template <typename Visitor>
+      bool forEach(uint32_t segment, Visitor visit) {
+        std::shared_ptr<Segment> seg = _find(segment);
+        if (!seg) {
+          return false;
+        }
+        std::string buf, path, data;
+        Record record;
+        for (uint64_t off = 0; ; ) {
+          if (!_pread(seg->m_fd, buf, sizeof(record), off)) {
+            return true;
+          }
+          memcpy(&record, buf.data(), sizeof(record));
+          // 长度超出段的末尾说明记录不完整或已损坏
+          if (record.m_magic != m_s_Magic || record.m_pathLen + record.m_size > seg->m_size - off - sizeof(record)
+              || !_pread(seg->m_fd, path, record.m_pathLen, off + sizeof(record))
+              || !_pread(seg->m_fd, data, record.m_size, off + sizeof(record) + record.m_pathLen)) {
+            return true;
+          }
+          off += sizeof(record) + record.m_pathLen;
+          if (!visit(boost::string_view(path), off, data)) {
+            return false;
+          }
+          off += record.m_size;
+        }
+      }
+      // 段中新写入的记录落盘: 上传的记录按uploadSync配置的方式, 在登记索引之前调用
+      // always为true时总是fdatasync, 用于回收段, 保证复制出来的记录先于旧段的删除落盘
+      bool sync(uint32_t segment, bool always = false) {
+        std::shared_ptr<Segment> seg = _find(segment);
+        if (!seg) {
+          return false;
+        }
+        return always ? fdatasync(seg->m_fd) == 0 : DurableFile::sync(seg->m_fd);
+      }
+      void remove(uint32_t segment) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_segments.erase(segment) != 0) {
+          unlink(_name(segment).c_str());
+        }
+      }
+      // 段数, 总字节数, 有效字节数, 用于监控
+      void stats(size_t &count, uint64_t &bytes, uint64_t &live) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        count = m_segments.size();
+        bytes = live = 0;
+        for (auto &item : m_segments) {
+          bytes += item.second->m_size;
+          live += item.second->m_live;
+        }
+      }
+    private:
+      std::string _name(uint32_t segment) const {
+        char name[16];
+        snprintf(name, sizeof(name), "%08x.seg", segment);
+        return m_dir + "/" + name;
+      }
+      std::shared_ptr<Segment> _find(uint32_t segment) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_segments.find(segment);
+        return it == m_segments.end() ? nullptr : it->second;
+      }
+      static bool _pread(int fd, std::string &dst, size_t len, uint64_t offset) {
+        dst.resize(len);
+        for (size_t done = 0; done < len; ) {
+          ssize_t n = pread(fd, &dst[done], len - done, offset + done);
+          if (n <= 0) {
+            return false;
+          }
+          done += n;
+        }
+        return true;
+      }
+    private:
+      std::mutex m_mutex;
+      std::string m_dir;
+      uint64_t m_segmentSize;
+      std::map<uint32_t, std::shared_ptr<Segment>> m_segments;
+      uint32_t m_active; // 当前追加的段
+      uint32_t m_next;   // 下一个新段的段号
+      static const uint32_t m_s_Magic = 0x47455342; // "BSEG"
+      static const uint64_t m_s_DefaultSegmentSize = 64 * 1024 * 1024;
+  };
+}
+
+#endif /* _SEGMENTSTORE_HPP_ */
@@ -0,0 +1,169 @@
+#ifndef _UPLOADDEBOUNCER_HPP_
+#define _UPLOADDEBOUNCER_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+namespace CloudBackup {
+  // 上传去抖: 发现文件变化后先不上传, 等它的大小和修改时间稳定settle秒, 或者写入方关闭了文件(IN_CLOSE_WRITE)再上传
+  // 等待期间的多次修改合并成一次上传; 一直在变化的文件(例如不断追加的日志)最多等maxDelay秒, 之后按当时的内容上传一次
+  // 只跟踪正在等待的文件, 并且只在它们所在的目录上加inotify监视, 监视数不随目录树的大小增长
+  class UploadDebouncer
+  {
+    struct Pending
+    {
+      int64_t m_mtime;     // 纳秒
+      uint64_t m_size;
+      time_t m_firstSeen;  // 第一次发现变化的时间
+      time_t m_lastChange; // 最后一次发现大小或修改时间变化的时间
+      uint64_t m_cycle;    // 最后一次被扫描到的轮次
+      int m_wd;            // 所在目录的监视号, 没有监视时为-1
+      bool m_closed;       // 最后一次修改之后写入方关闭了文件
+    };
+    struct Watch
+    {
+      std::string m_dir;
+      size_t m_refs; // 该目录下等待中的文件数
+    };
+    public:
+      UploadDebouncer() : m_settle(0), m_maxDelay(0), m_cycle(0) {
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_fd < 0) {
+          std::cout << "inotify init error, wait for settle time only" << std::endl;
+        }
+      }
+      ~UploadDebouncer() {
+        if (m_fd >= 0) {
+          close(m_fd);
+        }
+      }
+      UploadDebouncer(const UploadDebouncer &) = delete;
+      UploadDebouncer &operator=(const UploadDebouncer &) = delete;
+
+      // settle为0时不去抖, 发现变化立即上传; maxDelay为0时不限制等待时间
+      void configure(time_t settle, time_t maxDelay) {
+        m_settle = settle;
+        m_maxDelay = maxDelay;
+      }
+      // 每轮扫描开始时调用, 读出上一轮以来的inotify事件
+      void beginCycle() {
+        ++m_cycle;
+        _drain();
+      }
+      // 扫描到一个有变化的文件, 返回true表示现在应该上传
+      bool ready(const std::string &filepath, const struct stat &buf, time_t now) {
+        // 修改时间已经早于settle秒前(例如客户端停止期间写好的文件), 不需要再等
+        if (m_settle <= 0 || now - buf.st_mtime >= m_settle) {
+          return true;
+        }
+        int64_t mtime = static_cast<int64_t>(buf.st_mtim.tv_sec) * 1000000000 + buf.st_mtim.tv_nsec;
+        uint64_t size = buf.st_size;
+        auto it = m_pending.find(filepath);
+        if (it == m_pending.end()) {
+          Pending p{ mtime, size, now, now, m_cycle, _watch(filepath), false };
+          m_pending.emplace(filepath, p);
+          return false;
+        }
+        Pending &p = it->second;
+        p.m_cycle = m_cycle;
+        if (p.m_mtime != mtime || p.m_size != size) {
+          p.m_mtime = mtime;
+          p.m_size = size;
+          p.m_lastChange = now;
+        } else if (now - p.m_lastChange >= m_settle) {
+          return true;
+        }
+        return p.m_closed || (m_maxDelay > 0 && now - p.m_firstSeen >= m_maxDelay);
+      }
+      // 上传成功后调用; 上传失败时不调用, 下一轮扫描时文件已经稳定, 会立即重试
+      void done(const std::string &filepath) {
+        auto it = m_pending.find(filepath);
+        if (it != m_pending.end()) {
+          _unwatch(it->second.m_wd);
+          m_pending.erase(it);
+        }
+      }
+      // 每轮扫描结束时调用, 清除这一轮没有再扫描到的文件(已经删除, 或者内容变回了已上传的版本)
+      void endCycle() {
+        for (auto it = m_pending.begin(); it != m_pending.end(); ) {
+          if (it->second.m_cycle != m_cycle) {
+            _unwatch(it->second.m_wd);
+            it = m_pending.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+      size_t pending() const {
+        return m_pending.size();
+      }
+    private:
+      int _watch(const std::string &filepath) {
+        if (m_fd < 0) {
+          return -1;
+        }
+        size_t pos = filepath.rfind('/');
+        std::string dir = (pos == std::string::npos) ? "." : filepath.substr(0, pos);
+        int wd = inotify_add_watch(m_fd, dir.empty() ? "/" : dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY);
+        if (wd < 0) {
+          return -1;
+        }
+        Watch &watch = m_watches[wd];
+        watch.m_dir = dir;
+        ++watch.m_refs;
+        return wd;
+      }
+      void _unwatch(int wd) {
+        auto it = m_watches.find(wd);
+        if (it == m_watches.end()) {
+          return;
+        }
+        if (--it->second.m_refs == 0) {
+          inotify_rm_watch(m_fd, wd);
+          m_watches.erase(it);
+        }
+      }
+      // 事件按发生顺序处理, 关闭之后又有修改时m_closed重新变为false
+      void _drain() {
+        if (m_fd < 0) {
+          return;
+        }
+        alignas(struct inotify_event) char buf[16 * 1024];
+        std::string filepath;
+        while (true) {
+          ssize_t n = read(m_fd, buf, sizeof(buf));
+          if (n <= 0) {
+            break;
+          }
+          for (ssize_t off = 0; off < n; ) {
+            const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(buf + off);
+            off += sizeof(struct inotify_event) + ev->len;
+            auto watch = m_watches.find(ev->wd);
+            if (ev->len == 0 || watch == m_watches.end()) {
+              continue;
+            }
+            filepath = watch->second.m_dir + '/' + ev->name;
+            auto it = m_pending.find(filepath);
+            if (it != m_pending.end()) {
+              it->second.m_closed = (ev->mask & IN_CLOSE_WRITE) != 0;
+            }
+          }
+        }
+      }
+    private:
+      int m_fd;
+      time_t m_settle;
+      time_t m_maxDelay;
+      uint64_t m_cycle;
+      std::unordered_map<std::string, Pending> m_pending;
+      std::unordered_map<int, Watch> m_watches;
+  };
+}
+
+#endif /* _UPLOADDEBOUNCER_HPP_ */
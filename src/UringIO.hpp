@@ -0,0 +1,492 @@
+#ifndef _URINGIO_HPP_
+#define _URINGIO_HPP_
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "httplib.h"
+#include "MyUtil.hpp"
+#include "Logger.hpp"
+
+namespace CloudBackup {
+  // io_uring的最小封装, 直接使用系统调用, 不依赖liburing
+  // 不是线程安全的, 每个线程使用自己的实例(见UringContext)
+  class IoUring
+  {
+    public:
+      IoUring() : m_fd(-1), m_sqPtr(nullptr), m_cqPtr(nullptr), m_sqes(nullptr),
+        m_sqSize(0), m_cqSize(0), m_sqeTail(0), m_submitted(0) {}
+      ~IoUring() {
+        if (m_sqes != nullptr) {
+          munmap(m_sqes, m_params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        if (m_cqPtr != nullptr && m_cqPtr != m_sqPtr) {
+          munmap(m_cqPtr, m_cqSize);
+        }
+        if (m_sqPtr != nullptr) {
+          munmap(m_sqPtr, m_sqSize);
+        }
+        if (m_fd >= 0) {
+          close(m_fd);
+        }
+      }
+      bool init(unsigned entries) {
+        memset(&m_params, 0, sizeof(m_params));
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &m_params));
+        if (m_fd < 0) {
+          return false;
+        }
+        m_sqSize = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+        m_cqSize = m_params.cq_off.cqes + m_params.cq_entries * sizeof(struct io_uring_cqe);
+        if (m_params.features & IORING_FEAT_SINGLE_MMAP) {
+          m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+        }
+        m_sqPtr = _map(m_sqSize, IORING_OFF_SQ_RING);
+        if (m_sqPtr == nullptr) {
+          return false;
+        }
+        m_cqPtr = (m_params.features & IORING_FEAT_SINGLE_MMAP) ? m_sqPtr : _map(m_cqSize, IORING_OFF_CQ_RING);
+        m_sqes = static_cast<struct io_uring_sqe *>(
+            _map(m_params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES));
+        if (m_cqPtr == nullptr || m_sqes == nullptr) {
+          return false;
+        }
+        char *sq = static_cast<char *>(m_sqPtr), *cq = static_cast<char *>(m_cqPtr);
+        m_sqHead = reinterpret_cast<unsigned *>(sq + m_params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned *>(sq + m_params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned *>(sq + m_params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned *>(sq + m_params.sq_off.array);
+        m_cqHead = reinterpret_cast<unsigned *>(cq + m_params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>(cq + m_params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned *>(cq + m_params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + m_params.cq_off.cqes);
+        m_sqeTail = m_submitted = *m_sqTail;
+        return true;
+      }
+      bool registerBuffers(const struct iovec *iovs, unsigned nr) {
+        return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iovs, nr) == 0;
+      }
+      unsigned entries() const {
+        return m_params.sq_entries;
+      }
+      // 取一个空闲的提交项, 队列满时返回nullptr
+      struct io_uring_sqe *getSqe() {
+        unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (m_sqeTail - head >= m_params.sq_entries) {
+          return nullptr;
+        }
+        unsigned idx = m_sqeTail & m_sqMask;
+        struct io_uring_sqe *sqe = &m_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqArray[idx] = idx;
+        ++m_sqeTail;
+        return sqe;
+      }
+      // 已准备但还没有交给内核的提交项数
+      unsigned unsubmitted() const {
+        return m_sqeTail - m_submitted;
+      }
+      // 一次系统调用提交所有准备好的请求, 并至少等待waitNr个完成事件
+      // 失败时丢弃还没有交给内核的提交项, 以免它们在以后别人的submit中被提交, 调用者需要自己回收这些请求占用的资源
+      bool submit(unsigned waitNr = 0) {
+        __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = m_sqeTail - m_submitted;
+        if (toSubmit == 0 && waitNr == 0) {
+          return true;
+        }
+        int ret;
+        do {
+          ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, toSubmit, waitNr,
+                waitNr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+          // 没有SQPOLL时内核只在io_uring_enter中读取提交队列, 可以安全地收回尾部
+          m_sqeTail = m_submitted = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+          __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+          return false;
+        }
+        m_submitted += ret;
+        return true;
+      }
+      // 取出一个完成事件, 没有时阻塞等待
+      bool waitCqe(struct io_uring_cqe &cqe) {
+        for (;;) {
+          unsigned head = *m_cqHead;
+          if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = m_cqes[head & m_cqMask];
+            __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+          }
+          if (!submit(1)) {
+            return false;
+          }
+        }
+      }
+    private:
+      void *_map(size_t size, off_t offset) {
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+      }
+    private:
+      int m_fd;
+      struct io_uring_params m_params;
+      void *m_sqPtr, *m_cqPtr;
+      struct io_uring_sqe *m_sqes;
+      size_t m_sqSize, m_cqSize;
+      unsigned *m_sqHead, *m_sqTail, *m_sqArray, m_sqMask;
+      unsigned *m_cqHead, *m_cqTail, m_cqMask;
+      struct io_uring_cqe *m_cqes;
+      unsigned m_sqeTail;   // 本地已准备的提交项
+      unsigned m_submitted; // 已经交给内核的提交项
+  };
+
+  // 每个工作线程的io_uring上下文: 一个ring和一组注册过的对齐缓冲区(可用于O_DIRECT)
+  // 一个线程同一时间只处理一个响应, 所以同一时间只有一个读写者使用它
+  class UringContext
+  {
+    public:
+      static UringContext &local() {
+        thread_local UringContext ctx;
+        return ctx;
+      }
+      bool valid() const {
+        return m_valid;
+      }
+      // ring出错且无法等到在途请求全部完成时调用, 之后这个线程不再使用ring, 退化为pread/pwrite
+      // ring中可能还有迟到的完成事件, 不能再交给新的读写者
+      void invalidate() {
+        if (m_valid) {
+          m_valid = false;
+          CB_LOG(ERROR, "uring.disabled");
+        }
+      }
+      IoUring &ring() {
+        return m_ring;
+      }
+      char *buffer(unsigned idx) {
+        return m_buffers + idx * m_s_BufSize;
+      }
+      ~UringContext() {
+        free(m_buffers);
+      }
+      static const unsigned m_s_BufNum = 8;
+      static const size_t m_s_BufSize = 256 * 1024;
+      // 写请求的user_data带这个标记(低位是文件偏移), 读请求的user_data是缓冲区下标, 双方据此丢弃不是自己的完成事件
+      static const uint64_t m_s_WriteTag = 1ULL << 63;
+    private:
+      UringContext() : m_valid(false), m_buffers(nullptr) {
+        if (!s_enabled) {
+          return;
+        }
+        if (posix_memalign(reinterpret_cast<void **>(&m_buffers), 4096, m_s_BufNum * m_s_BufSize) != 0) {
+          m_buffers = nullptr;
+          return;
+        }
+        std::vector<struct iovec> iovs(m_s_BufNum);
+        for (unsigned i = 0; i < m_s_BufNum; ++i) {
+          iovs[i].iov_base = buffer(i);
+          iovs[i].iov_len = m_s_BufSize;
+        }
+        m_valid = m_ring.init(m_s_Entries) && m_ring.registerBuffers(iovs.data(), m_s_BufNum);
+        if (!m_valid) {
+          CB_LOG(WARN, "uring.unavailable");
+        }
+      }
+    public:
+      static std::atomic<bool> s_enabled;  // ioBackend=uring
+      static std::atomic<bool> s_directIO; // 冷数据读取使用O_DIRECT
+    private:
+      bool m_valid;
+      IoUring m_ring;
+      char *m_buffers;
+      static const unsigned m_s_Entries = 64;
+  };
+  std::atomic<bool> UringContext::s_enabled(false);
+  std::atomic<bool> UringContext::s_directIO(false);
+  const unsigned UringContext::m_s_BufNum;
+  const size_t UringContext::m_s_BufSize;
+  const uint64_t UringContext::m_s_WriteTag;
+  const unsigned UringContext::m_s_Entries;
+
+  // 下载的数据源, 作为httplib的content provider使用
+  // 用注册缓冲区做预读流水线: 把后面的若干块一次性提交, 发送当前块时后面的块已经在读了
+  // io_uring不可用时退化为pread
+  class UringReader
+  {
+    enum state {
+      FREE, PENDING, READY
+    };
+    public:
+      UringReader() : m_fd(-1), m_size(0), m_direct(false), m_ctx(nullptr), m_next(0), m_inflight(0) {}
+      ~UringReader() {
+        _drain();
+        if (m_fd >= 0) {
+          close(m_fd);
+        }
+      }
+      // direct为true时尝试用O_DIRECT打开, 文件系统不支持时使用普通方式
+      bool open(const std::string &name, bool direct) {
+        UringContext &ctx = UringContext::local();
+        if (ctx.valid()) {
+          m_ctx = &ctx;
+        }
+        if (direct && m_ctx != nullptr) {
+          m_fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+          m_direct = (m_fd >= 0);
+        }
+        if (m_fd < 0) {
+          m_fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        struct stat buf;
+        if (m_fd < 0 || fstat(m_fd, &buf) < 0) {
+          CB_LOG(ERROR, "uring.open_failed").str("path", name);
+          return false;
+        }
+        m_size = buf.st_size;
+        for (unsigned i = 0; i < UringContext::m_s_BufNum; ++i) {
+          m_state[i] = FREE;
+        }
+        return true;
+      }
+      size_t size() const {
+        return m_size;
+      }
+      // 从offset开始输出一段数据(不超过length), 出错时调用sink.done()结束响应
+      void read(size_t offset, size_t length, httplib::DataSink &sink) {
+        size_t end = std::min(offset + length, m_size);
+        if (m_ctx == nullptr) {
+          _preadTo(offset, end, sink);
+          return;
+        }
+        size_t block = offset / UringContext::m_s_BufSize * UringContext::m_s_BufSize;
+        int idx = _find(block);
+        if (idx < 0) {
+          // 不是顺序读(例如Range请求), 重新开始预读
+          _drain();
+          if (m_ctx == nullptr) {
+            _preadTo(offset, end, sink);
+            return;
+          }
+          m_next = block;
+        }
+        _submitAhead(end);
+        idx = _find(block);
+        while (idx >= 0 && m_state[idx] == PENDING) {
+          if (!_reap()) {
+            idx = -1;
+          }
+        }
+        if (idx < 0 || m_res[idx] < 0 || block + m_res[idx] <= offset) {
+          CB_LOG(ERROR, "uring.read_failed").num("offset", offset).num("res", idx < 0 ? -1 : m_res[idx]);
+          sink.done();
+          return;
+        }
+        size_t n = std::min(block + m_res[idx], end) - offset;
+        sink.write(m_ctx->buffer(idx) + (offset - block), n);
+        if (offset + n == block + m_res[idx]) {
+          m_state[idx] = FREE;
+          _submitAhead(end);
+        }
+      }
+    private:
+      int _find(size_t block) const {
+        for (unsigned i = 0; i < UringContext::m_s_BufNum; ++i) {
+          if (m_state[i] != FREE && m_block[i] == block) {
+            return i;
+          }
+        }
+        return -1;
+      }
+      // 为[m_next, end)中还没有提交的块占用空闲缓冲区, 一次提交
+      void _submitAhead(size_t end) {
+        IoUring &ring = m_ctx->ring();
+        bool added = false;
+        size_t first = m_next;
+        for (unsigned i = 0; i < UringContext::m_s_BufNum && m_next < end; ++i) {
+          if (m_state[i] != FREE) {
+            continue;
+          }
+          struct io_uring_sqe *sqe = ring.getSqe();
+          if (sqe == nullptr) {
+            break;
+          }
+          sqe->opcode = IORING_OP_READ_FIXED;
+          sqe->fd = m_fd;
+          sqe->off = m_next;
+          sqe->addr = reinterpret_cast<unsigned long>(m_ctx->buffer(i));
+          sqe->len = UringContext::m_s_BufSize;
+          sqe->buf_index = i;
+          sqe->user_data = i;
+          m_state[i] = PENDING;
+          m_block[i] = m_next;
+          m_next += UringContext::m_s_BufSize;
+          ++m_inflight;
+          added = true;
+        }
+        if (added && !ring.submit()) {
+          // 本次准备的请求已被丢弃, 对应的缓冲区收回, 读到这些块时按出错处理
+          for (unsigned i = 0; i < UringContext::m_s_BufNum; ++i) {
+            if (m_state[i] == PENDING && m_block[i] >= first) {
+              m_state[i] = FREE;
+              --m_inflight;
+            }
+          }
+          m_next = first;
+        }
+      }
+      bool _reap() {
+        struct io_uring_cqe cqe;
+        for (;;) {
+          if (!m_ctx->ring().waitCqe(cqe)) {
+            return false;
+          }
+          // 丢弃不是本读者的完成事件(写请求的, 或者下标不是在途状态的)
+          unsigned idx = static_cast<unsigned>(cqe.user_data);
+          if ((cqe.user_data & UringContext::m_s_WriteTag) == 0 && idx < UringContext::m_s_BufNum && m_state[idx] == PENDING) {
+            m_res[idx] = cqe.res;
+            m_state[idx] = READY;
+            --m_inflight;
+            return true;
+          }
+        }
+      }
+      // 等待所有在途的读请求完成, 缓冲区才能交给别人使用
+      // 等不到时ring不再可用, 之后改用pread
+      void _drain() {
+        while (m_inflight > 0) {
+          if (!_reap()) {
+            m_ctx->invalidate();
+            m_ctx = nullptr;
+            m_inflight = 0;
+            break;
+          }
+        }
+        for (unsigned i = 0; i < UringContext::m_s_BufNum; ++i) {
+          m_state[i] = FREE;
+        }
+      }
+      void _preadTo(size_t offset, size_t end, httplib::DataSink &sink) {
+        char buf[m_s_PreadSize];
+        ssize_t ret = pread(m_fd, buf, std::min(end - offset, m_s_PreadSize), offset);
+        if (ret <= 0) {
+          sink.done();
+          return;
+        }
+        sink.write(buf, ret);
+      }
+    private:
+      int m_fd;
+      size_t m_size;
+      bool m_direct;
+      UringContext *m_ctx;
+      state m_state[UringContext::m_s_BufNum];
+      size_t m_block[UringContext::m_s_BufNum]; // 缓冲区对应的文件偏移
+      int m_res[UringContext::m_s_BufNum];      // 读取结果
+      size_t m_next;     // 下一个要提交的块
+      unsigned m_inflight;
+      static const size_t m_s_PreadSize = 65536;
+  };
+  const size_t UringReader::m_s_PreadSize;
+
+  class UringIO
+  {
+    public:
+      // 上传写入: 把src切片后批量提交写请求, 一次系统调用写多个片
+      // src已经在内存中, 直接使用它的地址而不是拷贝到注册缓冲区, 所以返回之前必须等到所有提交的请求完成
+      static bool writeFile(const std::string &name, const std::string &src) {
+        UringContext &ctx = UringContext::local();
+        if (!ctx.valid()) {
+          return MyUtil::writeFile(name, src);
+        }
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+          CB_LOG(ERROR, "uring.open_failed").str("path", name);
+          return false;
+        }
+        IoUring &ring = ctx.ring();
+        size_t off = 0, inflight = 0;
+        bool ok = true;
+        // 出错后不再提交新的片, 但仍然要等到已提交的片全部完成
+        while ((ok && off < src.size()) || inflight > 0) {
+          struct io_uring_sqe *sqe;
+          while (ok && off < src.size() && (sqe = ring.getSqe()) != nullptr) {
+            size_t len = std::min(src.size() - off, m_s_SliceSize);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->off = off;
+            sqe->addr = reinterpret_cast<unsigned long>(src.data() + off);
+            sqe->len = static_cast<unsigned>(len);
+            sqe->user_data = UringContext::m_s_WriteTag | off;
+            off += len;
+            ++inflight;
+          }
+          if (ring.unsubmitted() > 0) {
+            unsigned dropped = ring.unsubmitted();
+            if (!ring.submit()) {
+              // 没交给内核的片已被丢弃, 不会有完成事件
+              inflight -= dropped;
+              ok = false;
+            }
+          }
+          if (inflight == 0) {
+            continue;
+          }
+          struct io_uring_cqe cqe;
+          if (!ring.waitCqe(cqe)) {
+            // 等不到在途的片完成, 内核以后可能还会读src, 只能停用ring; 文件不完整, 由调用者丢弃
+            ctx.invalidate();
+            ok = false;
+            break;
+          }
+          if ((cqe.user_data & UringContext::m_s_WriteTag) == 0) {
+            continue; // 不是写请求的完成事件
+          }
+          --inflight;
+          size_t sliceOff = static_cast<size_t>(cqe.user_data & ~UringContext::m_s_WriteTag);
+          size_t len = std::min(src.size() - sliceOff, m_s_SliceSize);
+          if (cqe.res < 0) {
+            ok = false;
+          } else if (static_cast<size_t>(cqe.res) < len) {
+            // 短写很少出现, 剩下的部分同步写完
+            ok = ok && _pwriteAll(fd, src.data() + sliceOff + cqe.res, len - cqe.res, sliceOff + cqe.res);
+          }
+        }
+        close(fd);
+        if (!ok) {
+          CB_LOG(ERROR, "uring.write_failed").str("path", name);
+        }
+        return ok;
+      }
+    private:
+      static bool _pwriteAll(int fd, const char *data, size_t len, size_t off) {
+        while (len > 0) {
+          ssize_t ret = pwrite(fd, data, len, off);
+          if (ret < 0 && errno == EINTR) {
+            continue;
+          }
+          if (ret <= 0) {
+            return false;
+          }
+          data += ret;
+          len -= ret;
+          off += ret;
+        }
+        return true;
+      }
+    private:
+      static const size_t m_s_SliceSize = 1024 * 1024;
+  };
+  const size_t UringIO::m_s_SliceSize;
+}
+
+#endif /* _URINGIO_HPP_ */
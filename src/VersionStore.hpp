@@ -0,0 +1,684 @@
+#ifndef _VERSIONSTORE_HPP_
+#define _VERSIONSTORE_HPP_
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <initializer_list>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "DurableFile.hpp"
+#include "XXHash64.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+
+namespace CloudBackup {
+  // 文件的历史版本: 上传覆盖或替换一个文件之前, 旧内容保存为一个版本, 可以按版本号列出和下载
+  // versionDir下的目录:
+  //   meta/<前2位>/<路径的XXH64>  每个路径一个版本表: 第一行是路径, 第二行是下一个版本号的下限, 之后每行一个版本, 新版本追加在末尾
+  //   raw/<路径的XXH64>.<版本号>[.gz]  刚保存的版本: 旧文件的硬链接(不复制, versionDir必须和文件在同一个文件系统上), 段中的小文件复制一份
+  //   chunks/<前2位>/<内容的XXH64>[-n]  后台任务(maintain)把raw版本按内容切块, zlib压缩后按内容寻址存放,
+  //                                     同一文件的各个版本之间(以及不同文件之间)相同的块只存一份, 哈希冲突时加后缀-n
+  // 版本表的每行: 版本号 内容时间 被替换的时间 大小 哈希 状态 [块名:长度 ...]
+  // 上传只做一次硬链接和追加一行; 切块, 保留策略和块的回收都在后台任务中进行, 不阻塞上传
+  class VersionStore
+  {
+    public:
+      enum State { RAW, RAWGZ, CHUNKED };
+      struct Chunk
+      {
+        std::string m_name;
+        uint64_t m_size; // 压缩前的长度
+      };
+      struct Version
+      {
+        uint64_t m_id;
+        time_t m_mtime;    // 这个版本上传的时间
+        time_t m_replaced; // 被新内容替换的时间, 保留期限从这时开始计算
+        uint64_t m_size;
+        uint64_t m_hash;   // 0表示未知
+        State m_state;
+        std::vector<Chunk> m_chunks;
+        Version() : m_id(0), m_mtime(0), m_replaced(0), m_size(0), m_hash(0), m_state(RAW) {}
+      };
+      // 一次maintain的结果, 用于日志和监控
+      struct Stats
+      {
+        size_t m_chunked = 0;       // 切块的版本数
+        size_t m_expired = 0;       // 按保留策略删除的版本数
+        size_t m_newChunks = 0;
+        size_t m_sharedChunks = 0;  // 已经存在, 直接引用的块
+        size_t m_removedChunks = 0; // 不再被引用而删除的块
+        uint64_t m_chunkBytes = 0;  // 写入的块文件的字节数(压缩后)
+        uint64_t m_sharedBytes = 0; // 因为共享块而没有写入的字节数(压缩前)
+      };
+      // 按顺序读出一个版本的内容, 打开之后版本被后台任务转换或删除也不影响
+      class Reader
+      {
+        public:
+          Reader() : m_store(nullptr), m_fd(-1), m_gz(NULL), m_cached(npos) {}
+          Reader(const Reader &) = delete;
+          Reader &operator=(const Reader &) = delete;
+          ~Reader() {
+            if (m_gz != NULL) {
+              gzclose(m_gz);
+            } else if (m_fd >= 0) {
+              close(m_fd);
+            }
+          }
+          bool open(VersionStore &store, const std::string &path, const Version &version) {
+            m_store = &store;
+            m_version = version;
+            if (version.m_state == CHUNKED) {
+              uint64_t start = 0;
+              for (const Chunk &chunk : version.m_chunks) {
+                m_starts.push_back(start);
+                start += chunk.m_size;
+              }
+              return true;
+            }
+            m_fd = ::open(store._rawName(_key(path), version.m_id, version.m_state == RAWGZ).c_str(), O_RDONLY | O_CLOEXEC);
+            if (m_fd < 0) {
+              return false;
+            }
+            if (version.m_state == RAWGZ) {
+              m_gz = gzdopen(m_fd, "rb");
+              if (m_gz == NULL) {
+                return false;
+              }
+            }
+            return true;
+          }
+          uint64_t size() const {
+            return m_version.m_size;
+          }
+          // 读出从offset开始的len字节, 超出末尾的部分不返回
+          bool read(uint64_t offset, size_t len, std::string &dst) {
+            dst.clear();
+            len = static_cast<size_t>(std::min<uint64_t>(len, m_version.m_size - std::min(offset, m_version.m_size)));
+            if (m_version.m_state == RAW) {
+              dst.resize(len);
+              for (size_t done = 0; done < len; ) {
+                ssize_t n = pread(m_fd, &dst[done], len - done, offset + done);
+                if (n <= 0) {
+                  return false;
+                }
+                done += n;
+              }
+              return true;
+            }
+            if (m_version.m_state == RAWGZ) {
+              if (static_cast<uint64_t>(gztell(m_gz)) != offset && gzseek(m_gz, offset, SEEK_SET) < 0) {
+                return false;
+              }
+              dst.resize(len);
+              for (size_t done = 0; done < len; ) {
+                int n = gzread(m_gz, &dst[done], static_cast<unsigned>(len - done));
+                if (n <= 0) {
+                  return false;
+                }
+                done += n;
+              }
+              return true;
+            }
+            while (len > 0) {
+              size_t i = std::upper_bound(m_starts.begin(), m_starts.end(), offset) - m_starts.begin() - 1;
+              if (i != m_cached) {
+                if (!m_store->_readChunk(m_version.m_chunks[i], m_chunk)) {
+                  return false;
+                }
+                m_cached = i;
+              }
+              size_t begin = static_cast<size_t>(offset - m_starts[i]);
+              size_t n = std::min(len, m_chunk.size() - begin);
+              dst.append(m_chunk, begin, n);
+              offset += n;
+              len -= n;
+            }
+            return true;
+          }
+        private:
+          static const size_t npos = static_cast<size_t>(-1);
+          VersionStore *m_store;
+          Version m_version;
+          int m_fd;
+          gzFile m_gz;
+          std::vector<uint64_t> m_starts; // 各块在内容中的起始位置
+          size_t m_cached;                // m_chunk中是第几块
+          std::string m_chunk;
+      };
+
+      VersionStore() = default;
+      VersionStore(const VersionStore &) = delete;
+      VersionStore &operator=(const VersionStore &) = delete;
+
+      bool open(const std::string &dir) {
+        std::string root = dir;
+        while (root.size() > 1 && root.back() == '/') {
+          root.pop_back();
+        }
+        boost::system::error_code ec;
+        for (const char *sub : { "/meta", "/raw", "/chunks" }) {
+          boost::filesystem::create_directories(root + sub, ec);
+          if (ec) {
+            return false;
+          }
+        }
+        m_dir = root;
+        return true;
+      }
+      bool enabled() const {
+        return !m_dir.empty();
+      }
+      // 把path的当前内容(保存在file中, gz表示file是gzip文件)登记为一个版本, 用硬链接保存, 不复制
+      // 之后file的inode不能再被原地修改(只能被rename替换), 追加时先复制一份(见HttpServerModule::_appendTail)
+      // 需要落盘的路径追加到syncs, 由调用者在新内容替换旧文件之前落盘
+      bool preserveFile(const std::string &path, const std::string &file, bool gz, const Version &version,
+          std::vector<std::string> &syncs) {
+        return _preserve(path, version, gz ? RAWGZ : RAW, syncs, [&file](const std::string &raw) {
+          return link(file.c_str(), raw.c_str()) == 0;
+        });
+      }
+      // 内容不在单独的文件中(段中的小文件)时复制一份
+      bool preserveContent(const std::string &path, const std::string &content, const Version &version,
+          std::vector<std::string> &syncs) {
+        return _preserve(path, version, RAW, syncs, [&content](const std::string &raw) {
+          std::string tmp = DurableFile::tempName(raw);
+          if (!UringIO::writeFile(tmp, content) || rename(tmp.c_str(), raw.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+          }
+          return true;
+        });
+      }
+      // path的所有版本, 按版本号从小到大
+      bool list(const std::string &path, std::vector<Version> &versions) {
+        std::string key = _key(path), owner;
+        uint64_t next;
+        std::lock_guard<std::mutex> lock(_lock(key));
+        return _load(_metaName(key), owner, next, versions) && owner == path;
+      }
+      bool find(const std::string &path, uint64_t id, Version &version) {
+        std::vector<Version> versions;
+        if (!list(path, versions)) {
+          return false;
+        }
+        for (const Version &v : versions) {
+          if (v.m_id == id) {
+            version = v;
+            return true;
+          }
+        }
+        return false;
+      }
+      // 后台任务: 每个路径只保留最新的keep个版本和keepTime秒内被替换的版本, 其余的删除;
+      // 保留的raw版本切块存放; 最后删除不再被任何版本引用的块和残留的文件
+      void maintain(size_t keep, time_t keepTime, Stats &stats) {
+        time_t start = time(nullptr);
+        boost::system::error_code ec, statEc;
+        // 先列出所有版本表再逐个处理, 处理时替换版本表(临时文件和rename)不影响遍历
+        std::vector<std::string> keys;
+        for (boost::filesystem::recursive_directory_iterator it(m_dir + "/meta", ec), end; !ec && it != end; it.increment(ec)) {
+          std::string name = it->path().filename().string();
+          if (boost::filesystem::is_regular_file(it->path(), statEc) && name.find(".cbtmp") == std::string::npos) {
+            keys.push_back(name);
+          }
+        }
+        for (const std::string &key : keys) {
+          _maintainPath(key, keep, keepTime, stats);
+        }
+        _collect(start, stats);
+      }
+    private:
+      // 版本保存的公共部分: 持有路径的锁分配版本号, store(raw)把内容放到raw文件后追加版本表
+      template <typename Store>
+      bool _preserve(const std::string &path, const Version &version, State state, std::vector<std::string> &syncs, Store store) {
+        static Counter &preserved = Metrics::counter("cloudbackup_versions_preserved_total", "Old file contents kept as versions on overwrite");
+        std::string key = _key(path), meta = _metaName(key), owner;
+        uint64_t next = 1;
+        std::vector<Version> versions;
+        std::lock_guard<std::mutex> lock(_lock(key));
+        bool exists = _load(meta, owner, next, versions);
+        if (exists && owner != path) {
+          CB_LOG(ERROR, "version.key_collision").str("path", path).str("other", owner);
+          return false;
+        }
+        Version v = version;
+        v.m_id = versions.empty() ? next : std::max(next, versions.back().m_id + 1);
+        v.m_state = state;
+        v.m_chunks.clear();
+        std::string raw = _rawName(key, v.m_id, state == RAWGZ);
+        if (!store(raw)) {
+          CB_LOG(WARN, "version.preserve_failed").str("path", path).num("errno", errno);
+          return false;
+        }
+        // 新建(或者只写了一半第一行)的版本表从头写; 上次追加时崩溃留下的不完整的行先补上换行, 作为一行错误的行被忽略
+        std::string lines = exists ? "" : path + "\n" + std::to_string(next) + "\n";
+        if (exists && !_endsWithNewline(meta)) {
+          lines += "\n";
+        }
+        lines += _format(v);
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(meta.substr(0, meta.rfind('/')), ec);
+        int fd = ::open(meta.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (exists ? 0 : O_TRUNC), 0644);
+        bool ok = fd >= 0 && write(fd, lines.data(), lines.size()) == static_cast<ssize_t>(lines.size());
+        if (fd >= 0) {
+          close(fd);
+        }
+        if (!ok) {
+          CB_LOG(ERROR, "version.meta_write_failed").str("path", meta).num("errno", errno);
+          unlink(raw.c_str());
+          return false;
+        }
+        syncs.push_back(raw);
+        syncs.push_back(m_dir + "/raw");
+        syncs.push_back(meta);
+        syncs.push_back(meta.substr(0, meta.rfind('/')));
+        preserved.add(1);
+        return true;
+      }
+      void _maintainPath(const std::string &key, size_t keep, time_t keepTime, Stats &stats) {
+        std::string meta = _metaName(key), path;
+        uint64_t next;
+        std::vector<Version> versions;
+        {
+          std::lock_guard<std::mutex> lock(_lock(key));
+          if (!_load(meta, path, next, versions)) {
+            return;
+          }
+        }
+        // 切块不持锁, 期间同一路径的上传照常追加新版本
+        time_t now = time(nullptr);
+        std::vector<bool> kept = _retain(versions, keep, keepTime, now);
+        std::map<uint64_t, Version> chunked;
+        std::vector<std::string> created;
+        for (size_t i = 0; i < versions.size(); ++i) {
+          if (kept[i] && versions[i].m_state != CHUNKED) {
+            Version v = versions[i];
+            if (_chunkVersion(key, v, created, stats)) {
+              chunked[v.m_id] = v;
+            }
+          }
+        }
+        if (!created.empty()) {
+          std::set<std::string> dirs;
+          for (const std::string &file : created) {
+            dirs.insert(file.substr(0, file.rfind('/')));
+          }
+          created.insert(created.end(), dirs.begin(), dirs.end());
+          if (!DurableFile::syncPaths(created)) {
+            CB_LOG(ERROR, "version.chunk_sync_failed").str("path", path);
+            chunked.clear();
+          }
+        }
+        std::vector<std::string> garbage;
+        {
+          std::lock_guard<std::mutex> lock(_lock(key));
+          if (!_load(meta, path, next, versions)) {
+            return;
+          }
+          kept = _retain(versions, keep, keepTime, now);
+          std::vector<Version> rest;
+          for (size_t i = 0; i < versions.size(); ++i) {
+            Version &v = versions[i];
+            auto it = chunked.find(v.m_id);
+            bool converted = kept[i] && v.m_state != CHUNKED && it != chunked.end();
+            if (!kept[i] || converted) {
+              if (v.m_state != CHUNKED) {
+                garbage.push_back(_rawName(key, v.m_id, v.m_state == RAWGZ));
+              }
+              stats.m_expired += kept[i] ? 0 : 1;
+              stats.m_chunked += converted ? 1 : 0;
+            }
+            if (converted) {
+              rest.push_back(it->second);
+            } else if (kept[i]) {
+              rest.push_back(v);
+            }
+            next = std::max(next, v.m_id + 1);
+          }
+          // 版本都删除之后仍然保留版本表(只有路径和版本号下限), 版本号不重复使用
+          std::string content = path + "\n" + std::to_string(next) + "\n";
+          for (const Version &v : rest) {
+            content += _format(v);
+          }
+          if (!DurableFile::write(meta, content)) {
+            CB_LOG(ERROR, "version.meta_write_failed").str("path", meta).num("errno", errno);
+            return;
+          }
+        }
+        for (const std::string &file : garbage) {
+          unlink(file.c_str());
+        }
+      }
+      // versions按版本号从小到大; 最新的keep个和keepTime秒内被替换的保留
+      static std::vector<bool> _retain(const std::vector<Version> &versions, size_t keep, time_t keepTime, time_t now) {
+        std::vector<bool> kept(versions.size());
+        for (size_t i = 0; i < versions.size(); ++i) {
+          kept[i] = (versions.size() - i <= keep) || (keepTime > 0 && versions[i].m_replaced + keepTime > now);
+        }
+        return kept;
+      }
+      // 把raw版本的内容切块存放, 成功时version变为CHUNKED, 大小和哈希按实际内容更新; 新写的块文件追加到created
+      bool _chunkVersion(const std::string &key, Version &version, std::vector<std::string> &created, Stats &stats) {
+        std::string raw = _rawName(key, version.m_id, version.m_state == RAWGZ);
+        int fd = ::open(raw.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          CB_LOG(WARN, "version.raw_missing").str("path", raw);
+          return false;
+        }
+        std::vector<Chunk> chunks;
+        XXHash64 state;
+        uint64_t size = 0;
+        bool ok;
+        if (version.m_state == RAWGZ) {
+          int gzfd = dup(fd);
+          gzFile gz = gzfd < 0 ? NULL : gzdopen(gzfd, "rb");
+          if (gz == NULL && gzfd >= 0) {
+            close(gzfd);
+          }
+          ok = gz != NULL && _chunkStream([gz](char *buf, size_t len) {
+            return static_cast<ssize_t>(gzread(gz, buf, static_cast<unsigned>(len)));
+          }, chunks, state, size, created, stats);
+          if (gz != NULL) {
+            gzclose(gz);
+          }
+        } else {
+          ok = _chunkStream([fd](char *buf, size_t len) {
+            return ::read(fd, buf, len);
+          }, chunks, state, size, created, stats);
+        }
+        // 切块只读一次, 不留在页缓存中
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        if (!ok) {
+          CB_LOG(ERROR, "version.chunk_failed").str("path", raw);
+          return false;
+        }
+        version.m_state = CHUNKED;
+        version.m_chunks.swap(chunks);
+        version.m_size = size;
+        version.m_hash = state.digest();
+        return true;
+      }
+      // 按内容定义的切块(Gear哈希): 块长在m_s_MinChunk和m_s_MaxChunk之间, 平均约m_s_MinChunk+64KB
+      // 切点只由附近的内容决定, 文件中间插入或删除内容后, 前后未改动部分的块仍然相同
+      template <typename Read>
+      bool _chunkStream(Read read, std::vector<Chunk> &chunks, XXHash64 &state, uint64_t &size,
+          std::vector<std::string> &created, Stats &stats) {
+        std::string buf;
+        size_t begin = 0;
+        bool eof = false;
+        while (true) {
+          if (!eof && buf.size() - begin < m_s_MaxChunk) {
+            buf.erase(0, begin);
+            begin = 0;
+            size_t old = buf.size();
+            buf.resize(old + m_s_ReadSize);
+            ssize_t n = read(&buf[old], m_s_ReadSize);
+            if (n < 0) {
+              return false;
+            }
+            buf.resize(old + n);
+            eof = (n == 0);
+            continue;
+          }
+          if (begin == buf.size()) {
+            return true;
+          }
+          size_t len = _cut(buf.data() + begin, buf.size() - begin);
+          Chunk chunk;
+          if (!_storeChunk(buf.data() + begin, len, chunk, created, stats)) {
+            return false;
+          }
+          state.update(buf.data() + begin, len);
+          size += len;
+          chunks.push_back(chunk);
+          begin += len;
+        }
+      }
+      static size_t _cut(const char *data, size_t len) {
+        if (len <= m_s_MinChunk) {
+          return len;
+        }
+        const uint64_t *gear = _gear();
+        size_t end = m_s_MaxChunk;
+        if (len < end) {
+          end = len;
+        }
+        uint64_t h = 0;
+        for (size_t i = m_s_MinChunk; i < end; ++i) {
+          h = (h << 1) + gear[static_cast<uint8_t>(data[i])];
+          // 高16位取决于最近64个字节
+          if ((h >> 48) == 0) {
+            return i + 1;
+          }
+        }
+        return end;
+      }
+      static const uint64_t *_gear() {
+        struct Gear
+        {
+          uint64_t m_table[256];
+          Gear() {
+            for (uint32_t i = 0; i < 256; ++i) {
+              m_table[i] = XXHash64::hash(&i, sizeof(i), 0x43444331);
+            }
+          }
+        };
+        static Gear gear;
+        return gear.m_table;
+      }
+      // 按内容寻址存放一个块; 已经有内容相同的块时直接引用
+      bool _storeChunk(const char *data, size_t len, Chunk &chunk, std::vector<std::string> &created, Stats &stats) {
+        std::string base = XXHash64::toHex(XXHash64::hash(data, len)), existing;
+        chunk.m_size = len;
+        for (int n = 0; n < m_s_MaxCollisions; ++n) {
+          chunk.m_name = (n == 0) ? base : base + "-" + std::to_string(n);
+          std::string file = _chunkName(chunk.m_name);
+          if (access(file.c_str(), F_OK) == 0) {
+            if (_readChunk(chunk, existing) && existing.size() == len && memcmp(existing.data(), data, len) == 0) {
+              ++stats.m_sharedChunks;
+              stats.m_sharedBytes += len;
+              return true;
+            }
+            continue; // 哈希冲突(或者已经损坏的块), 换一个名字
+          }
+          uLongf zlen = compressBound(len);
+          std::string z(zlen, '\0');
+          if (compress2(reinterpret_cast<Bytef *>(&z[0]), &zlen, reinterpret_cast<const Bytef *>(data), len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return false;
+          }
+          z.resize(zlen);
+          boost::system::error_code ec;
+          boost::filesystem::create_directories(file.substr(0, file.rfind('/')), ec);
+          std::string tmp = DurableFile::tempName(file);
+          if (!UringIO::writeFile(tmp, z) || rename(tmp.c_str(), file.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+          }
+          created.push_back(file);
+          ++stats.m_newChunks;
+          stats.m_chunkBytes += zlen;
+          return true;
+        }
+        return false;
+      }
+      // 读出并解压一个块, 同时校验长度和块名中的哈希
+      bool _readChunk(const Chunk &chunk, std::string &dst) {
+        std::string z;
+        if (!_readAll(_chunkName(chunk.m_name), z)) {
+          return false;
+        }
+        dst.resize(chunk.m_size);
+        uLongf len = chunk.m_size;
+        if (uncompress(reinterpret_cast<Bytef *>(&dst[0]), &len, reinterpret_cast<const Bytef *>(z.data()), z.size()) != Z_OK
+            || len != chunk.m_size
+            || XXHash64::toHex(XXHash64::hash(dst)) != chunk.m_name.substr(0, 16)) {
+          CB_LOG(ERROR, "version.chunk_corrupt").str("chunk", chunk.m_name);
+          return false;
+        }
+        return true;
+      }
+      // 删除不再被任何版本引用的块(本轮开始之前写入的), 以及残留超过一小时的raw文件和临时文件
+      void _collect(time_t start, Stats &stats) {
+        std::set<std::string> chunks, raws;
+        boost::system::error_code ec, statEc;
+        for (boost::filesystem::recursive_directory_iterator it(m_dir + "/meta", ec), end; !ec && it != end; it.increment(ec)) {
+          std::string key = it->path().filename().string(), path;
+          uint64_t next;
+          std::vector<Version> versions;
+          {
+            std::lock_guard<std::mutex> lock(_lock(key));
+            if (!boost::filesystem::is_regular_file(it->path(), statEc) || !_load(it->path().string(), path, next, versions)) {
+              continue;
+            }
+          }
+          for (const Version &v : versions) {
+            if (v.m_state == CHUNKED) {
+              for (const Chunk &chunk : v.m_chunks) {
+                chunks.insert(chunk.m_name);
+              }
+            } else {
+              raws.insert(_rawName(key, v.m_id, v.m_state == RAWGZ));
+            }
+          }
+        }
+        // 遍历完一个目录再删除, 递归遍历前进时要stat当前项, 删掉之后会出错而提前结束
+        for (const char *sub : { "/meta", "/raw", "/chunks" }) {
+          std::vector<std::string> garbage;
+          for (boost::filesystem::recursive_directory_iterator it(m_dir + sub, ec), end; !ec && it != end; it.increment(ec)) {
+            struct stat buf;
+            std::string file = it->path().string(), name = it->path().filename().string();
+            if (stat(file.c_str(), &buf) != 0 || !S_ISREG(buf.st_mode)) {
+              continue;
+            }
+            bool stale = buf.st_ctime + m_s_StaleTime < start;
+            bool remove = (name.find(".cbtmp") != std::string::npos) ? stale
+              : (strcmp(sub, "/raw") == 0) ? (stale && raws.count(file) == 0)
+              : (strcmp(sub, "/chunks") == 0) ? (buf.st_mtime < start && chunks.count(name) == 0)
+              : false;
+            if (remove) {
+              garbage.push_back(file);
+            }
+          }
+          for (const std::string &file : garbage) {
+            if (unlink(file.c_str()) == 0 && strcmp(sub, "/chunks") == 0) {
+              ++stats.m_removedChunks;
+            }
+          }
+        }
+      }
+      // 版本表: 第一行路径, 第二行版本号下限, 之后每行一个版本; 没有换行符的最后一行是追加时崩溃留下的, 忽略
+      bool _load(const std::string &meta, std::string &path, uint64_t &next, std::vector<Version> &versions) {
+        versions.clear();
+        std::ifstream fin(meta);
+        std::string line;
+        if (!std::getline(fin, path) || !std::getline(fin, line)) {
+          return false;
+        }
+        next = strtoull(line.c_str(), nullptr, 10);
+        while (std::getline(fin, line) && !fin.eof()) {
+          if (line.empty()) {
+            continue;
+          }
+          std::istringstream ss(line);
+          Version v;
+          int state;
+          if (!(ss >> v.m_id >> v.m_mtime >> v.m_replaced >> v.m_size >> v.m_hash >> state)) {
+            CB_LOG(WARN, "version.meta_bad_line").str("path", meta).str("line", line);
+            continue;
+          }
+          v.m_state = static_cast<State>(state);
+          std::string item;
+          while (ss >> item) {
+            size_t colon = item.find(':');
+            v.m_chunks.push_back(Chunk{ item.substr(0, colon), strtoull(item.c_str() + colon + 1, nullptr, 10) });
+          }
+          versions.push_back(std::move(v));
+        }
+        return true;
+      }
+      static std::string _format(const Version &v) {
+        std::string line = std::to_string(v.m_id) + ' ' + std::to_string(v.m_mtime) + ' ' + std::to_string(v.m_replaced)
+          + ' ' + std::to_string(v.m_size) + ' ' + std::to_string(v.m_hash) + ' ' + std::to_string(static_cast<int>(v.m_state));
+        for (const Chunk &chunk : v.m_chunks) {
+          line += ' ' + chunk.m_name + ':' + std::to_string(chunk.m_size);
+        }
+        return line + '\n';
+      }
+      static bool _endsWithNewline(const std::string &file) {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat buf;
+        char last = '\n';
+        if (fd >= 0 && fstat(fd, &buf) == 0 && buf.st_size > 0 && pread(fd, &last, 1, buf.st_size - 1) != 1) {
+          last = '\n';
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+        return last == '\n';
+      }
+      static bool _readAll(const std::string &file, std::string &dst) {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat buf;
+        if (fd < 0 || fstat(fd, &buf) != 0) {
+          if (fd >= 0) {
+            close(fd);
+          }
+          return false;
+        }
+        dst.resize(buf.st_size);
+        size_t done = 0;
+        while (done < dst.size()) {
+          ssize_t n = pread(fd, &dst[done], dst.size() - done, done);
+          if (n <= 0) {
+            break;
+          }
+          done += n;
+        }
+        close(fd);
+        return done == dst.size();
+      }
+      static std::string _key(const std::string &path) {
+        return XXHash64::toHex(XXHash64::hash(path));
+      }
+      std::string _metaName(const std::string &key) const {
+        return m_dir + "/meta/" + key.substr(0, 2) + "/" + key;
+      }
+      std::string _rawName(const std::string &key, uint64_t id, bool gz) const {
+        return m_dir + "/raw/" + key + "." + std::to_string(id) + (gz ? ".gz" : "");
+      }
+      std::string _chunkName(const std::string &name) const {
+        return m_dir + "/chunks/" + name.substr(0, 2) + "/" + name;
+      }
+      // 同一路径的版本表的读改写互斥, 按路径哈希分到固定数量的锁上
+      std::mutex &_lock(const std::string &key) {
+        return m_locks[strtoull(key.substr(0, 4).c_str(), nullptr, 16) % m_s_Locks];
+      }
+    private:
+      std::string m_dir;
+      static const size_t m_s_Locks = 64;
+      std::mutex m_locks[m_s_Locks];
+      static const size_t m_s_MinChunk = 16 * 1024;
+      static const size_t m_s_MaxChunk = 256 * 1024;
+      static const size_t m_s_ReadSize = 1024 * 1024;
+      static const int m_s_MaxCollisions = 16;
+      static const time_t m_s_StaleTime = 3600;
+  };
+}
+
+#endif /* _VERSIONSTORE_HPP_ */
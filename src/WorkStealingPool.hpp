@@ -0,0 +1,218 @@
+#ifndef _WORKSTEALINGPOOL_HPP_
+#define _WORKSTEALINGPOOL_HPP_
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include "httplib.h"
+
+namespace CloudBackup {
+  // 有界的多生产者多消费者无锁队列(Vyukov), 每个工作线程一个
+  class TaskRing
+  {
+    struct Cell
+    {
+      std::atomic<size_t> m_seq;
+      std::function<void()> m_fn;
+    };
+    public:
+      explicit TaskRing(size_t capacity)
+        : m_cells(new Cell[capacity]), m_mask(capacity - 1), m_head(0), m_tail(0) {
+        for (size_t i = 0; i < capacity; ++i) {
+          m_cells[i].m_seq.store(i, std::memory_order_relaxed);
+        }
+      }
+      bool push(std::function<void()> &fn) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        for (;;) {
+          Cell &cell = m_cells[pos & m_mask];
+          size_t seq = cell.m_seq.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+          if (diff == 0) {
+            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              cell.m_fn = std::move(fn);
+              cell.m_seq.store(pos + 1, std::memory_order_release);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false; // 队列已满
+          } else {
+            pos = m_tail.load(std::memory_order_relaxed);
+          }
+        }
+      }
+      bool pop(std::function<void()> &fn) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        for (;;) {
+          Cell &cell = m_cells[pos & m_mask];
+          size_t seq = cell.m_seq.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+          if (diff == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+              fn = std::move(cell.m_fn);
+              cell.m_fn = nullptr;
+              cell.m_seq.store(pos + m_mask + 1, std::memory_order_release);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false; // 队列为空
+          } else {
+            pos = m_head.load(std::memory_order_relaxed);
+          }
+        }
+      }
+    private:
+      std::unique_ptr<Cell[]> m_cells;
+      size_t m_mask;
+      // 生产者和消费者分别修改tail和head, 用填充把它们隔开在不同的缓存行
+      char m_pad0[64];
+      std::atomic<size_t> m_head;
+      char m_pad1[64];
+      std::atomic<size_t> m_tail;
+      char m_pad2[64];
+  };
+
+  // 工作窃取线程池, 代替httplib::ThreadPool的单锁队列, 通过Server::new_task_queue使用
+  // enqueue轮流把任务放进各工作线程的无锁队列, 工作线程先取自己的队列, 空了再去别的队列窃取,
+  // 只有在所有队列都空时才在条件变量上休眠, 忙的时候提交和取任务都不需要加锁
+  class WorkStealingPool : public httplib::TaskQueue
+  {
+    public:
+      // n为0时按CPU核数决定线程数
+      explicit WorkStealingPool(size_t n = 0)
+        : m_shutdown(false), m_next(0), m_sleepers(0), m_pending(0),
+        m_executed(0), m_steals(0), m_overflows(0) {
+        if (n == 0) {
+          n = defaultThreadNum();
+        }
+        for (size_t i = 0; i < n; ++i) {
+          m_rings.emplace_back(new TaskRing(m_s_RingSize));
+        }
+        for (size_t i = 0; i < n; ++i) {
+          m_threads.emplace_back(&WorkStealingPool::_worker, this, i);
+        }
+      }
+      WorkStealingPool(const WorkStealingPool &) = delete;
+      ~WorkStealingPool() override = default;
+
+      void enqueue(std::function<void()> fn) override {
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+        size_t start = m_next.fetch_add(1, std::memory_order_relaxed);
+        bool pushed = false;
+        for (size_t i = 0; i < m_rings.size() && !pushed; ++i) {
+          pushed = m_rings[(start + i) % m_rings.size()]->push(fn);
+        }
+        if (!pushed) {
+          // 所有队列都满了, 放到加锁的溢出队列里
+          std::lock_guard<std::mutex> lock(m_overflowMutex);
+          m_overflow.push_back(std::move(fn));
+          m_overflows.fetch_add(1, std::memory_order_relaxed);
+        }
+        // 与_worker中的m_sleepers++配对, 保证不会丢失唤醒
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleepers.load(std::memory_order_relaxed) > 0) {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_cond.notify_one();
+        }
+      }
+      void shutdown() override {
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_shutdown = true;
+        }
+        m_cond.notify_all();
+        for (auto &thr : m_threads) {
+          thr.join();
+        }
+      }
+      // 等待执行的任务数
+      size_t depth() const {
+        return m_pending.load(std::memory_order_relaxed);
+      }
+      size_t executed() const {
+        return m_executed.load(std::memory_order_relaxed);
+      }
+      // 从其他线程队列中窃取到的任务数
+      size_t steals() const {
+        return m_steals.load(std::memory_order_relaxed);
+      }
+      // 因为队列满而进入溢出队列的任务数
+      size_t overflows() const {
+        return m_overflows.load(std::memory_order_relaxed);
+      }
+      size_t threadNum() const {
+        return m_threads.size();
+      }
+      // 工作线程会阻塞在网络和磁盘IO上, 所以线程数取核数的两倍, 且不少于httplib的默认值
+      static size_t defaultThreadNum() {
+        size_t n = 2 * std::thread::hardware_concurrency();
+        return std::max(n, static_cast<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT));
+      }
+    private:
+      bool _take(size_t self, std::function<void()> &fn) {
+        if (m_rings[self]->pop(fn)) {
+          return true;
+        }
+        for (size_t i = 1; i < m_rings.size(); ++i) {
+          if (m_rings[(self + i) % m_rings.size()]->pop(fn)) {
+            m_steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+        }
+        std::lock_guard<std::mutex> lock(m_overflowMutex);
+        if (m_overflow.empty()) {
+          return false;
+        }
+        fn = std::move(m_overflow.front());
+        m_overflow.pop_front();
+        return true;
+      }
+      void _worker(size_t self) {
+        std::function<void()> fn;
+        for (;;) {
+          if (_take(self, fn)) {
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            fn();
+            fn = nullptr;
+            m_executed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+          }
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_sleepers.fetch_add(1, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          // 登记休眠后再检查一次, 避免与enqueue竞争时错过任务
+          if (m_pending.load(std::memory_order_relaxed) == 0) {
+            if (m_shutdown) {
+              m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+              break;
+            }
+            m_cond.wait_for(lock, std::chrono::milliseconds(100));
+          }
+          m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+      }
+    private:
+      std::vector<std::unique_ptr<TaskRing>> m_rings;
+      std::vector<std::thread> m_threads;
+      std::list<std::function<void()>> m_overflow;
+      std::mutex m_overflowMutex;
+      std::mutex m_mutex; // 只用于线程休眠和唤醒
+      std::condition_variable m_cond;
+      bool m_shutdown;
+      std::atomic<size_t> m_next;
+      std::atomic<size_t> m_sleepers;
+      std::atomic<size_t> m_pending;
+      std::atomic<size_t> m_executed;
+      std::atomic<size_t> m_steals;
+      std::atomic<size_t> m_overflows;
+      // 必须是2的幂; 只按值使用, 不做类外定义, 这个头文件可以被多个源文件包含
+      static const size_t m_s_RingSize = 1024;
+  };
+}
+
+#endif /* _WORKSTEALINGPOOL_HPP_ */
@@ -0,0 +1,138 @@
+#ifndef _XXHASH64_HPP_
+#define _XXHASH64_HPP_
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+namespace CloudBackup {
+  // XXH64, 结果与xxHash官方实现相同, 可以边读边算
+  // 只用于发现内容变化和数据损坏, 不能防篡改
+  class XXHash64
+  {
+    public:
+      explicit XXHash64(uint64_t seed = 0) {
+        reset(seed);
+      }
+      void reset(uint64_t seed = 0) {
+        m_acc[0] = seed + m_s_Prime1 + m_s_Prime2;
+        m_acc[1] = seed + m_s_Prime2;
+        m_acc[2] = seed;
+        m_acc[3] = seed - m_s_Prime1;
+        m_seed = seed;
+        m_total = 0;
+        m_bufLen = 0;
+      }
+      void update(const void *data, size_t len) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        m_total += len;
+        if (m_bufLen + len < 32) {
+          memcpy(m_buf + m_bufLen, p, len);
+          m_bufLen += len;
+          return;
+        }
+        if (m_bufLen != 0) {
+          size_t fill = 32 - m_bufLen;
+          memcpy(m_buf + m_bufLen, p, fill);
+          _stripe(m_buf);
+          p += fill;
+          len -= fill;
+          m_bufLen = 0;
+        }
+        for (; len >= 32; p += 32, len -= 32) {
+          _stripe(p);
+        }
+        memcpy(m_buf, p, len);
+        m_bufLen = len;
+      }
+      uint64_t digest() const {
+        uint64_t h;
+        if (m_total >= 32) {
+          h = _rotl(m_acc[0], 1) + _rotl(m_acc[1], 7) + _rotl(m_acc[2], 12) + _rotl(m_acc[3], 18);
+          for (int i = 0; i < 4; ++i) {
+            h = (h ^ _round(0, m_acc[i])) * m_s_Prime1 + m_s_Prime4;
+          }
+        } else {
+          h = m_seed + m_s_Prime5;
+        }
+        h += m_total;
+        const unsigned char *p = m_buf;
+        size_t len = m_bufLen;
+        for (; len >= 8; p += 8, len -= 8) {
+          h ^= _round(0, _read64(p));
+          h = _rotl(h, 27) * m_s_Prime1 + m_s_Prime4;
+        }
+        if (len >= 4) {
+          h ^= static_cast<uint64_t>(_read32(p)) * m_s_Prime1;
+          h = _rotl(h, 23) * m_s_Prime2 + m_s_Prime3;
+          p += 4;
+          len -= 4;
+        }
+        for (; len > 0; ++p, --len) {
+          h ^= *p * m_s_Prime5;
+          h = _rotl(h, 11) * m_s_Prime1;
+        }
+        h ^= h >> 33;
+        h *= m_s_Prime2;
+        h ^= h >> 29;
+        h *= m_s_Prime3;
+        h ^= h >> 32;
+        return h;
+      }
+      static uint64_t hash(const void *data, size_t len, uint64_t seed = 0) {
+        XXHash64 state(seed);
+        state.update(data, len);
+        return state.digest();
+      }
+      static uint64_t hash(const std::string &data) {
+        return hash(data.data(), data.size());
+      }
+      // 16位十六进制, 用于日志和HTTP头
+      static std::string toHex(uint64_t h) {
+        static const char digits[] = "0123456789abcdef";
+        std::string res(16, '0');
+        for (int i = 15; i >= 0; --i, h >>= 4) {
+          res[i] = digits[h & 0xf];
+        }
+        return res;
+      }
+    private:
+      static uint64_t _rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+      }
+      static uint64_t _round(uint64_t acc, uint64_t input) {
+        acc += input * m_s_Prime2;
+        return _rotl(acc, 31) * m_s_Prime1;
+      }
+      // 按小端读取, 本项目只在x86/arm64小端机器上运行
+      static uint64_t _read64(const unsigned char *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+      }
+      static uint32_t _read32(const unsigned char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+      }
+      void _stripe(const unsigned char *p) {
+        m_acc[0] = _round(m_acc[0], _read64(p));
+        m_acc[1] = _round(m_acc[1], _read64(p + 8));
+        m_acc[2] = _round(m_acc[2], _read64(p + 16));
+        m_acc[3] = _round(m_acc[3], _read64(p + 24));
+      }
+    private:
+      uint64_t m_acc[4];
+      uint64_t m_seed;
+      uint64_t m_total;
+      unsigned char m_buf[32];
+      size_t m_bufLen;
+      static const uint64_t m_s_Prime1 = 0x9E3779B185EBCA87ULL;
+      static const uint64_t m_s_Prime2 = 0xC2B2AE3D27D4EB4FULL;
+      static const uint64_t m_s_Prime3 = 0x165667B19E3779F9ULL;
+      static const uint64_t m_s_Prime4 = 0x85EBCA77C2B2AE63ULL;
+      static const uint64_t m_s_Prime5 = 0x27D4EB2F165667C5ULL;
+  };
+}
+
+#endif /* _XXHASH64_HPP_ */
@@ -0,0 +1,66 @@
+// 客户端目录扫描的微基准测试: 原来的recursive_directory_iterator + is_directory + stat与DirScanner
+// 测试目录树生成在当前目录(见run_microbench.sh), 页缓存是热的, 测的是系统调用和CPU开销
+#include <fstream>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <benchmark/benchmark.h>
+#include "../MyUtil.hpp"
+#include "../DirScanner.hpp"
+
+namespace {
+  using CloudBackup::DirScanner;
+
+  // 生成dirs个目录, 每个目录files个小文件, 已经存在时直接使用
+  std::string scanTree(size_t dirs, size_t files) {
+    std::string root = "./scan_" + std::to_string(dirs) + "x" + std::to_string(files);
+    if (boost::filesystem::exists(root)) {
+      return root;
+    }
+    for (size_t d = 0; d < dirs; ++d) {
+      std::string dir = root + "/d" + std::to_string(d / 10) + "/d" + std::to_string(d);
+      boost::filesystem::create_directories(dir);
+      for (size_t f = 0; f < files; ++f) {
+        std::ofstream(dir + "/f" + std::to_string(f)) << f;
+      }
+    }
+    return root;
+  }
+
+  // 与原来的LocalFileManager::getUpdateFileList相同, 文件信息表为空, 所有文件都是新文件
+  void BM_DirScan_Boost(benchmark::State &state) {
+    std::string root = scanTree(state.range(0), state.range(1));
+    size_t count = 0;
+    for (auto _ : state) {
+      std::vector<std::string> files;
+      boost::filesystem::recursive_directory_iterator iter_begin(root), iter_end;
+      for (; iter_begin != iter_end; ++iter_begin) {
+        std::string filepath = iter_begin->path().string();
+        CloudBackup::MyUtil::DealPath(filepath);
+        struct stat buf;
+        if (!boost::filesystem::is_directory(filepath) && stat(filepath.c_str(), &buf) == 0) {
+          files.push_back(filepath);
+        }
+      }
+      count = files.size();
+    }
+    state.counters["files"] = static_cast<double>(count);
+    state.SetItemsProcessed(state.iterations() * count);
+  }
+  BENCHMARK(BM_DirScan_Boost)->Args({ 100, 100 })->Args({ 1000, 100 })->Unit(benchmark::kMillisecond);
+
+  // 第三个参数是线程数
+  void BM_DirScan_Parallel(benchmark::State &state) {
+    std::string root = scanTree(state.range(0), state.range(1));
+    DirScanner scanner(state.range(2));
+    size_t count = 0;
+    for (auto _ : state) {
+      std::vector<DirScanner::Entry> files;
+      scanner.scan(root, [](const std::string &, const struct stat &) { return true; }, files);
+      count = files.size();
+    }
+    state.counters["files"] = static_cast<double>(count);
+    state.SetItemsProcessed(state.iterations() * count);
+  }
+  BENCHMARK(BM_DirScan_Parallel)->Args({ 100, 100, 1 })->Args({ 1000, 100, 1 })->Args({ 1000, 100, 4 })
+    ->Unit(benchmark::kMillisecond);
+}
@@ -0,0 +1,382 @@
+// 压测用的libmysqlclient替身, 代替-lmysqlclient链接进CloudServer
+// 在进程内存中模拟user_info和user_auths两张表, 只支持mysqlHelper和服务器实际发出的几种sql:
+//   insert into <table> (`a`,`b`) values ('x',1)
+//   select <列>, <列> from <table> where a='x' and b='y'
+//   select utc_timestamp() / select md5('x') / select password('x')
+// 这样压测结果不受数据库网络延迟和负载的影响, 也不需要部署mysql
+#include <mysql/mysql.h>
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <openssl/evp.h>
+
+namespace {
+  typedef std::map<std::string, std::string> Row;
+
+  struct Table
+  {
+    std::vector<Row> m_rows;
+    std::string m_autoColumn; // 自增列, 为空表示没有
+  };
+
+  // 一次查询的结果集, 通过MYSQL_RES指针交给调用者
+  struct FakeResult
+  {
+    std::vector<std::string> m_names;
+    std::vector<MYSQL_FIELD> m_fields;
+    std::vector<std::vector<std::string>> m_rows;
+    std::vector<char *> m_row;
+    std::vector<unsigned long> m_lengths;
+    size_t m_fieldPos = 0;
+    size_t m_rowPos = 0;
+  };
+
+  struct Database
+  {
+    std::mutex m_mutex; // 保护下面的所有成员
+    std::map<std::string, Table> m_tables;
+    std::set<MYSQL *> m_conns; // mysql_init(NULL)分配的连接
+    // 自增id从100000开始, 压测用户的数据目录不会和真实用户混在一起
+    unsigned long long m_nextId = 100000;
+    Database() {
+      m_tables["user_info"].m_autoColumn = "user_id";
+      m_tables["user_auths"];
+    }
+  };
+  // 服务器的MysqlModule是静态对象, 构造时就会调用mysql_init, 
+  // 用函数内的静态变量保证在那之前已经初始化
+  Database &db() {
+    static Database s_db;
+    return s_db;
+  }
+
+  // 服务器的所有线程共用一个MYSQL连接, 查询结果和错误信息按线程保存,
+  // 避免并发请求之间互相取到对方的结果
+  thread_local FakeResult *t_result = nullptr;
+  thread_local my_ulonglong t_insertId = 0;
+  thread_local my_ulonglong t_affectedRows = 0;
+  thread_local std::string t_error;
+
+  std::string toHex(const unsigned char *data, size_t len, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string res;
+    for (size_t i = 0; i < len; ++i) {
+      res += digits[data[i] >> 4];
+      res += digits[data[i] & 0xf];
+    }
+    return res;
+  }
+  std::string digest(const EVP_MD *md, const std::string &src, bool upper) {
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(src.data(), src.size(), buf, &len, md, nullptr);
+    return toHex(buf, len, upper);
+  }
+  // 与mysql的PASSWORD()相同: '*' + HEX(SHA1(SHA1(pwd)))
+  std::string mysqlPassword(const std::string &pwd) {
+    unsigned char stage1[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(pwd.data(), pwd.size(), stage1, &len, EVP_sha1(), nullptr);
+    return "*" + digest(EVP_sha1(), std::string(reinterpret_cast<char *>(stage1), len), true);
+  }
+  std::string mysqlMd5(const std::string &src) {
+    return digest(EVP_md5(), src, false);
+  }
+
+  void skipSpace(const std::string &sql, size_t &pos) {
+    while (pos < sql.size() && isspace(static_cast<unsigned char>(sql[pos]))) {
+      ++pos;
+    }
+  }
+  bool consume(const std::string &sql, size_t &pos, const std::string &word) {
+    skipSpace(sql, pos);
+    if (sql.compare(pos, word.size(), word) != 0) {
+      return false;
+    }
+    pos += word.size();
+    return true;
+  }
+  // 读取一个标识符, 可以带反引号
+  std::string identifier(const std::string &sql, size_t &pos) {
+    skipSpace(sql, pos);
+    bool quoted = (pos < sql.size() && sql[pos] == '`');
+    if (quoted) {
+      ++pos;
+    }
+    size_t start = pos;
+    while (pos < sql.size() && (isalnum(static_cast<unsigned char>(sql[pos])) || sql[pos] == '_')) {
+      ++pos;
+    }
+    std::string res = sql.substr(start, pos - start);
+    if (quoted && pos < sql.size() && sql[pos] == '`') {
+      ++pos;
+    }
+    return res;
+  }
+  // 读取一个值, 'xxx'形式的字符串(反斜杠转义)或者不带引号的数字
+  bool value(const std::string &sql, size_t &pos, std::string &res) {
+    skipSpace(sql, pos);
+    res.clear();
+    if (pos < sql.size() && sql[pos] == '\'') {
+      for (++pos; pos < sql.size(); ++pos) {
+        if (sql[pos] == '\\' && pos + 1 < sql.size()) {
+          res += sql[++pos];
+        } else if (sql[pos] == '\'') {
+          ++pos;
+          return true;
+        } else {
+          res += sql[pos];
+        }
+      }
+      return false;
+    }
+    while (pos < sql.size() && (isalnum(static_cast<unsigned char>(sql[pos])) || sql[pos] == '-')) {
+      res += sql[pos++];
+    }
+    return !res.empty();
+  }
+
+  FakeResult *makeResult(const std::vector<std::string> &names) {
+    FakeResult *res = new FakeResult;
+    res->m_names = names;
+    res->m_fields.resize(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      memset(&res->m_fields[i], 0, sizeof(MYSQL_FIELD));
+      res->m_fields[i].name = const_cast<char *>(res->m_names[i].c_str());
+    }
+    return res;
+  }
+  // select f('x'), 列名就是sql中select之后的部分, 与mysql一致
+  bool selectFunction(const std::string &sql, size_t pos) {
+    std::string expr = sql.substr(pos);
+    std::string name = identifier(sql, pos), arg, val;
+    if (!consume(sql, pos, "(")) {
+      return false;
+    }
+    if (name == "utc_timestamp") {
+      char buf[32];
+      time_t now = time(nullptr);
+      struct tm tm;
+      gmtime_r(&now, &tm);
+      strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+      val = buf;
+    } else if ((name == "md5" || name == "password") && value(sql, pos, arg)) {
+      val = (name == "md5") ? mysqlMd5(arg) : mysqlPassword(arg);
+    } else {
+      return false;
+    }
+    if (!consume(sql, pos, ")")) {
+      return false;
+    }
+    t_result = makeResult(std::vector<std::string>(1, expr));
+    t_result->m_rows.push_back(std::vector<std::string>(1, val));
+    return true;
+  }
+  bool select(const std::string &sql, size_t pos) {
+    skipSpace(sql, pos);
+    size_t start = pos;
+    std::string first = identifier(sql, pos);
+    skipSpace(sql, pos);
+    if (pos < sql.size() && sql[pos] == '(') {
+      return selectFunction(sql, start);
+    }
+    std::vector<std::string> columns(1, first);
+    while (consume(sql, pos, ",")) {
+      columns.push_back(identifier(sql, pos));
+    }
+    if (!consume(sql, pos, "from")) {
+      return false;
+    }
+    std::string table = identifier(sql, pos);
+    std::vector<std::pair<std::string, std::string>> conds;
+    if (consume(sql, pos, "where")) {
+      do {
+        std::string col = identifier(sql, pos), val;
+        if (!consume(sql, pos, "=") || !value(sql, pos, val)) {
+          return false;
+        }
+        conds.emplace_back(col, val);
+      } while (consume(sql, pos, "and"));
+    }
+    t_result = makeResult(columns);
+    for (auto &row : db().m_tables[table].m_rows) {
+      bool match = true;
+      for (auto &cond : conds) {
+        auto it = row.find(cond.first);
+        match = match && it != row.end() && it->second == cond.second;
+      }
+      if (!match) {
+        continue;
+      }
+      std::vector<std::string> out;
+      for (auto &col : columns) {
+        out.push_back(row[col]);
+      }
+      t_result->m_rows.push_back(out);
+    }
+    return true;
+  }
+  bool insert(const std::string &sql, size_t pos) {
+    if (!consume(sql, pos, "into")) {
+      return false;
+    }
+    Table &table = db().m_tables[identifier(sql, pos)];
+    std::vector<std::string> columns;
+    if (!consume(sql, pos, "(")) {
+      return false;
+    }
+    do {
+      columns.push_back(identifier(sql, pos));
+    } while (consume(sql, pos, ","));
+    if (!consume(sql, pos, ")") || !consume(sql, pos, "values") || !consume(sql, pos, "(")) {
+      return false;
+    }
+    Row row;
+    for (size_t i = 0; i < columns.size(); ++i) {
+      if ((i > 0 && !consume(sql, pos, ",")) || !value(sql, pos, row[columns[i]])) {
+        return false;
+      }
+    }
+    if (!consume(sql, pos, ")")) {
+      return false;
+    }
+    if (!table.m_autoColumn.empty()) {
+      t_insertId = ++db().m_nextId;
+      row[table.m_autoColumn] = std::to_string(t_insertId);
+    }
+    table.m_rows.push_back(row);
+    t_affectedRows = 1;
+    return true;
+  }
+}
+
+extern "C" {
+
+MYSQL *mysql_init(MYSQL *mysql) {
+  std::lock_guard<std::mutex> lock(db().m_mutex);
+  if (mysql == nullptr) {
+    mysql = static_cast<MYSQL *>(calloc(1, sizeof(MYSQL)));
+    db().m_conns.insert(mysql);
+  }
+  return mysql;
+}
+
+void mysql_close(MYSQL *mysql) {
+  std::lock_guard<std::mutex> lock(db().m_mutex);
+  if (db().m_conns.erase(mysql) > 0) {
+    free(mysql);
+  }
+}
+
+int mysql_options(MYSQL *, enum mysql_option, const void *) {
+  return 0;
+}
+
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *, const char *, const char *,
+    const char *, unsigned int, const char *, unsigned long) {
+  return mysql;
+}
+
+unsigned long mysql_real_escape_string(MYSQL *, char *to, const char *from, unsigned long length) {
+  char *out = to;
+  for (unsigned long i = 0; i < length; ++i) {
+    if (from[i] == '\'' || from[i] == '\\') {
+      *out++ = '\\';
+    }
+    *out++ = from[i];
+  }
+  *out = '\0';
+  return static_cast<unsigned long>(out - to);
+}
+
+int mysql_real_query(MYSQL *, const char *query, unsigned long length) {
+  std::string sql(query, length);
+  size_t pos = 0;
+  bool ok = false;
+  std::lock_guard<std::mutex> lock(db().m_mutex);
+  delete t_result;
+  t_result = nullptr;
+  t_affectedRows = 0;
+  if (consume(sql, pos, "select")) {
+    ok = select(sql, pos);
+  } else if (consume(sql, pos, "insert")) {
+    ok = insert(sql, pos);
+  }
+  if (!ok) {
+    delete t_result;
+    t_result = nullptr;
+    t_error = "fake mysql: unsupported sql: " + sql;
+    return 1;
+  }
+  t_error.clear();
+  return 0;
+}
+
+int mysql_query(MYSQL *mysql, const char *query) {
+  return mysql_real_query(mysql, query, strlen(query));
+}
+
+unsigned int mysql_errno(MYSQL *) {
+  return t_error.empty() ? 0 : 1064;
+}
+
+const char *mysql_error(MYSQL *) {
+  return t_error.c_str();
+}
+
+MYSQL_RES *mysql_store_result(MYSQL *) {
+  FakeResult *res = t_result;
+  t_result = nullptr;
+  if (res == nullptr) {
+    t_error = "fake mysql: no result set";
+  }
+  return reinterpret_cast<MYSQL_RES *>(res);
+}
+
+MYSQL_FIELD *mysql_fetch_field(MYSQL_RES *result) {
+  FakeResult *res = reinterpret_cast<FakeResult *>(result);
+  if (res->m_fieldPos >= res->m_fields.size()) {
+    return nullptr;
+  }
+  return &res->m_fields[res->m_fieldPos++];
+}
+
+MYSQL_ROW mysql_fetch_row(MYSQL_RES *result) {
+  FakeResult *res = reinterpret_cast<FakeResult *>(result);
+  if (res->m_rowPos >= res->m_rows.size()) {
+    return nullptr;
+  }
+  std::vector<std::string> &row = res->m_rows[res->m_rowPos++];
+  res->m_row.clear();
+  res->m_lengths.clear();
+  for (auto &col : row) {
+    res->m_row.push_back(&col[0]);
+    res->m_lengths.push_back(col.size());
+  }
+  return res->m_row.data();
+}
+
+unsigned long *mysql_fetch_lengths(MYSQL_RES *result) {
+  return reinterpret_cast<FakeResult *>(result)->m_lengths.data();
+}
+
+void mysql_free_result(MYSQL_RES *result) {
+  delete reinterpret_cast<FakeResult *>(result);
+}
+
+my_ulonglong mysql_insert_id(MYSQL *) {
+  return t_insertId;
+}
+
+my_ulonglong mysql_affected_rows(MYSQL *) {
+  return t_affectedRows;
+}
+
+}
@@ -0,0 +1,212 @@
+// CloudServer压测客户端
+// 对每个(并发数, 文件大小)组合依次压测PUT /upload, GET /download, GET /list, POST /login,
+// 每组结果以一行JSON输出到标准输出, 便于保存下来和之后的结果做diff:
+//   {"tag":"thread","op":"upload","size":4096,"concurrency":8,"requests":200,"errors":0,
+//    "seconds":0.12,"rps":1666.7,"mbps":6.51,"p50_us":410,"p99_us":2300,"p999_us":3100,"max_us":3150}
+// 用法: LoadGen [-h host] [-p port] [-o ops] [-s sizes] [-c concurrency] [-n requests] [-u user] [-t tag]
+// 每个请求新建一个连接, 与CloudClient的行为一致
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include "../httplib.h"
+
+namespace {
+  struct Options
+  {
+    std::string m_host = "127.0.0.1";
+    int m_port = 9000;
+    std::vector<std::string> m_ops{ "upload", "download", "list", "login" };
+    std::vector<size_t> m_sizes{ 4096, 65536, 1048576 };
+    std::vector<size_t> m_concurrency{ 1, 8, 32 };
+    size_t m_requests = 200;
+    std::string m_user = "bench";
+    std::string m_password = "bench123";
+    std::string m_tag;
+  };
+
+  struct Session
+  {
+    std::string m_uid;
+    std::string m_cookie;
+  };
+
+  std::vector<std::string> split(const std::string &src) {
+    std::vector<std::string> res;
+    std::stringstream ss(src);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (!item.empty()) {
+        res.push_back(item);
+      }
+    }
+    return res;
+  }
+  std::vector<size_t> splitNum(const std::string &src) {
+    std::vector<size_t> res;
+    for (auto &item : split(src)) {
+      res.push_back(strtoul(item.c_str(), nullptr, 10));
+    }
+    return res;
+  }
+
+  // 注册压测用户(已存在时忽略)并登录, 从重定向地址/list/<uid>/中取得uid
+  bool login(const Options &opt, Session &session) {
+    httplib::Client cli(opt.m_host, opt.m_port);
+    httplib::Params params{ { "username", opt.m_user }, { "password", opt.m_password } };
+    cli.Post("/register", params);
+    auto res = cli.Post("/login", params);
+    if (!res || res->status / 100 != 3 || !res->has_header("Set-Cookie")) {
+      return false;
+    }
+    std::string location = res->get_header_value("Location");
+    if (location.compare(0, 6, "/list/") != 0) {
+      return false;
+    }
+    session.m_uid = location.substr(6, location.find('/', 6) - 6);
+    session.m_cookie = res->get_header_value("Set-Cookie");
+    return true;
+  }
+
+  // 用concurrency个线程一共发出requests个请求, fn返回false表示请求失败
+  void run(const Options &opt, const std::string &op, size_t size, size_t concurrency,
+      const std::function<bool(httplib::Client &, size_t)> &fn) {
+    std::atomic<size_t> next(0), errors(0);
+    std::vector<std::vector<uint64_t>> latencies(concurrency);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < concurrency; ++t) {
+      threads.emplace_back([&, t]() {
+        httplib::Client cli(opt.m_host, opt.m_port);
+        for (size_t i = next++; i < opt.m_requests; i = next++) {
+          auto begin = std::chrono::steady_clock::now();
+          bool ok = fn(cli, i);
+          auto end = std::chrono::steady_clock::now();
+          latencies[t].push_back(std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count());
+          if (!ok) {
+            ++errors;
+          }
+        }
+      });
+    }
+    for (auto &thr : threads) {
+      thr.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> all;
+    for (auto &lat : latencies) {
+      all.insert(all.end(), lat.begin(), lat.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) -> uint64_t {
+      if (all.empty()) {
+        return 0;
+      }
+      size_t rank = static_cast<size_t>(p * all.size() + 0.999999);
+      return all[std::min(all.size(), std::max<size_t>(rank, 1)) - 1];
+    };
+    bool transfer = (op == "upload" || op == "download");
+    double mbps = transfer ? opt.m_requests * static_cast<double>(size) / seconds / (1 << 20) : 0;
+    printf("{\"tag\":\"%s\",\"op\":\"%s\",\"size\":%zu,\"concurrency\":%zu,\"requests\":%zu,\"errors\":%zu,"
+        "\"seconds\":%.6f,\"rps\":%.1f,\"mbps\":%.2f,"
+        "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}\n",
+        opt.m_tag.c_str(), op.c_str(), transfer ? size : 0, concurrency, opt.m_requests, errors.load(),
+        seconds, opt.m_requests / seconds, mbps,
+        (unsigned long long)percentile(0.50), (unsigned long long)percentile(0.99),
+        (unsigned long long)percentile(0.999), (unsigned long long)(all.empty() ? 0 : all.back()));
+    fflush(stdout);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  Options opt;
+  int ch;
+  while ((ch = getopt(argc, argv, "h:p:o:s:c:n:u:t:")) != -1) {
+    switch (ch) {
+      case 'h': opt.m_host = optarg; break;
+      case 'p': opt.m_port = atoi(optarg); break;
+      case 'o': opt.m_ops = split(optarg); break;
+      case 's': opt.m_sizes = splitNum(optarg); break;
+      case 'c': opt.m_concurrency = splitNum(optarg); break;
+      case 'n': opt.m_requests = strtoul(optarg, nullptr, 10); break;
+      case 'u': opt.m_user = optarg; break;
+      case 't': opt.m_tag = optarg; break;
+      default:
+        std::cerr << "usage: " << argv[0] << " [-h host] [-p port] [-o upload,download,list,login]"
+          << " [-s sizes] [-c concurrency] [-n requests] [-u user] [-t tag]" << std::endl;
+        return 1;
+    }
+  }
+  // 服务器可能刚刚启动, 登录失败时重试几秒
+  Session session;
+  bool logged = false;
+  for (int i = 0; i < 50 && !(logged = login(opt, session)); ++i) {
+    usleep(100 * 1000);
+  }
+  if (!logged) {
+    std::cerr << "login " << opt.m_host << ":" << opt.m_port << " failed!" << std::endl;
+    return 1;
+  }
+  auto has = [&opt](const char *op) {
+    return std::find(opt.m_ops.begin(), opt.m_ops.end(), op) != opt.m_ops.end();
+  };
+  httplib::Headers cookie{ { "Cookie", session.m_cookie } };
+
+  for (size_t concurrency : opt.m_concurrency) {
+    for (size_t size : opt.m_sizes) {
+      // 每组使用独立的目录, /list列出的就是这一组上传的requests个文件
+      std::string dir = session.m_uid + "/bench/c" + std::to_string(concurrency) + "_s" + std::to_string(size) + "/";
+      std::string body(size, '\0');
+      for (size_t i = 0; i < size; ++i) {
+        body[i] = static_cast<char>('a' + i * 7 % 26);
+      }
+      auto upload = [&](httplib::Client &cli, size_t i) {
+        auto res = cli.Put(("/upload/" + dir + std::to_string(i)).c_str(), body, "application/octet-stream");
+        return res && res->status == 200;
+      };
+      if (has("upload")) {
+        run(opt, "upload", size, concurrency, upload);
+      } else if (has("download") || has("list")) {
+        // 没有压测upload时先准备好文件, 不计入结果
+        for (size_t i = 0; i < opt.m_requests; ++i) {
+          httplib::Client cli(opt.m_host, opt.m_port);
+          upload(cli, i);
+        }
+      }
+      if (has("download")) {
+        run(opt, "download", size, concurrency, [&](httplib::Client &cli, size_t i) {
+          size_t received = 0;
+          auto res = cli.Get(("/download/" + dir + std::to_string(i)).c_str(), httplib::Headers(),
+              [&received](const char *, size_t len) {
+                received += len;
+                return true;
+              });
+          return res && res->status == 200 && received == size;
+        });
+      }
+      if (has("list")) {
+        run(opt, "list", size, concurrency, [&](httplib::Client &cli, size_t) {
+          auto res = cli.Get(("/list/" + dir).c_str(), cookie);
+          return res && res->status == 200;
+        });
+      }
+    }
+    if (has("login")) {
+      httplib::Params params{ { "username", opt.m_user }, { "password", opt.m_password } };
+      run(opt, "login", 0, concurrency, [&](httplib::Client &cli, size_t) {
+        auto res = cli.Post("/login", params);
+        return res && res->status / 100 == 3 && res->has_header("Set-Cookie");
+      });
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,62 @@
+// 日志热路径的微基准测试: 记录线程上一条CB_LOG的开销(不包括后台线程的格式化和写出)
+#include <benchmark/benchmark.h>
+#include "../Logger.hpp"
+
+namespace {
+  using CloudBackup::Logger;
+  using CloudBackup::Metrics;
+
+  // 每个线程每记录这么多条就在计时之外写出一次, 测到的是被放入而不是被丢弃的记录
+  // 小于缓冲区(1024条)的一半, 也不会在计时期间触发后台线程的提前唤醒
+  const size_t s_flushEvery = 256;
+
+  // 后台线程写到/dev/null, 不影响benchmark的输出
+  void setup(const char *rateLimit) {
+    Logger::configure({ { "logFile", "/dev/null" }, { "logLevel", "info" }, { "logRateLimit", rateLimit } });
+  }
+  // 缓冲区满时记录被丢弃, 丢弃的比例作为计数器输出(丢弃路径比正常放入更快, 应当接近0), 多线程时只由第0个线程输出
+  void reportDropped(benchmark::State &state, uint64_t before) {
+    if (state.thread_index() == 0) {
+      uint64_t dropped = Metrics::counter("cloudbackup_log_dropped_total", "").value() - before;
+      state.counters["dropped"] = static_cast<double>(dropped) / (state.iterations() * state.threads());
+    }
+  }
+
+  // 与上传处理函数中的日志相同: 一个路径字段和一个数值字段
+  void BM_Logger_Line(benchmark::State &state) {
+    setup("0");
+    std::string path = "/upload/100001/bench/c8_s4096/123";
+    uint64_t before = Metrics::counter("cloudbackup_log_dropped_total", "").value();
+    size_t n = 0;
+    for (auto _ : state) {
+      CB_LOG(INFO, "http.upload").str("path", path).num("size", 4096);
+      if (++n % s_flushEvery == 0) {
+        state.PauseTiming();
+        Logger::flush();
+        state.ResumeTiming();
+      }
+    }
+    reportDropped(state, before);
+  }
+  BENCHMARK(BM_Logger_Line)->Threads(1)->Threads(4);
+
+  // 级别未开启时只有一次原子读
+  void BM_Logger_Disabled(benchmark::State &state) {
+    setup("0");
+    std::string path = "/upload/100001/bench/c8_s4096/123";
+    for (auto _ : state) {
+      CB_LOG(DEBUG, "http.upload").str("path", path).num("size", 4096);
+    }
+  }
+  BENCHMARK(BM_Logger_Disabled);
+
+  // 超过限速时只有计时和一次原子加
+  void BM_Logger_RateLimited(benchmark::State &state) {
+    setup("100");
+    std::string path = "/upload/100001/bench/c8_s4096/123";
+    for (auto _ : state) {
+      CB_LOG(INFO, "http.upload").str("path", path).num("size", 4096);
+    }
+  }
+  BENCHMARK(BM_Logger_RateLimited)->Threads(1)->Threads(4);
+}
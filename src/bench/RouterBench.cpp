@@ -0,0 +1,66 @@
+// 路由的微基准测试: 前缀树路由与逐个std::regex匹配的对比
+#include <regex>
+#include <benchmark/benchmark.h>
+#include "../Router.hpp"
+
+namespace {
+  const char *s_patterns[][2] = {
+    { "POST", "/register" },
+    { "POST", "/login" },
+    { "GET", "/logout" },
+    { "GET", "/profile" },
+    { "GET", "/clist/(.*)" },
+    { "GET", "/list/([0-9]*)/(.*)" },
+    { "GET", "/download/(.*)" },
+    { "PUT", "/upload/(.*)" },
+  };
+  const char *s_paths[] = {
+    "/list/10086/photos/2020/summer/beach.jpg",
+    "/download/10086/docs/report.pdf",
+    "/upload/10086/src/main.cpp",
+    "/clist/pub/",
+  };
+
+  void noop(const httplib::Request &, httplib::Response &) {}
+
+  void BM_RouterTrie(benchmark::State &state) {
+    CloudBackup::Router router;
+    for (auto &pat : s_patterns) {
+      std::string method(pat[0]);
+      if (method == "GET") {
+        router.Get(pat[1], noop);
+      } else if (method == "POST") {
+        router.Post(pat[1], noop);
+      } else {
+        router.Put(pat[1], noop);
+      }
+    }
+    const std::string path = s_paths[state.range(0)];
+    const std::string method = (state.range(0) == 2) ? "PUT" : "GET";
+    std::vector<std::string> params;
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(router.route(method, path, params));
+    }
+  }
+  BENCHMARK(BM_RouterTrie)->DenseRange(0, 3);
+
+  // httplib原来的做法: 按注册顺序逐个regex_match
+  void BM_RouterRegex(benchmark::State &state) {
+    std::vector<std::pair<std::string, std::regex>> handlers;
+    for (auto &pat : s_patterns) {
+      handlers.emplace_back(pat[0], std::regex(pat[1]));
+    }
+    const std::string path = s_paths[state.range(0)];
+    const std::string method = (state.range(0) == 2) ? "PUT" : "GET";
+    std::smatch matches;
+    for (auto _ : state) {
+      for (auto &h : handlers) {
+        if (h.first == method && std::regex_match(path, matches, h.second)) {
+          break;
+        }
+      }
+      benchmark::DoNotOptimize(matches);
+    }
+  }
+  BENCHMARK(BM_RouterRegex)->DenseRange(0, 3);
+}
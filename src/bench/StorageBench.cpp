@@ -0,0 +1,274 @@
+// 存储核心的微基准测试: CompressUtil, FileDataManager, ObjectCache和MyUtil::getConfig
+// 需要在有CBackup.cnf和srv_log.dat的目录中运行(见run_microbench.sh), 测试数据也生成在当前目录
+#include <cmath>
+#include <memory>
+#include <random>
+#include <fstream>
+#include <benchmark/benchmark.h>
+#include "../CloudBackupServer.hpp"
+
+namespace {
+  using CloudBackup::CompressUtil;
+  using CloudBackup::FileDataManager;
+  using CloudBackup::ObjectCache;
+
+  const size_t s_users = 100;
+  const size_t s_dirs = 100;
+
+  // 第i个合成文件的路径: 100个用户, 每个用户100个目录, 文件均匀分布在各个目录中
+  std::string syntheticPath(size_t i) {
+    return "/data/CloudBackup/" + std::to_string(100000 + i % s_users)
+      + "/d" + std::to_string(i / s_users % s_dirs) + "/f" + std::to_string(i);
+  }
+  // 生成n项的索引, 已经存在时直接使用
+  // 先写成旧格式的文件信息表(每个文件一行), 再加载一次转换成快照(.idx), 之后的加载只需要mmap
+  std::string indexFile(size_t n) {
+    std::string filename = "./index_" + std::to_string(n) + ".dat";
+    if (boost::filesystem::exists(filename + ".idx")) {
+      return filename;
+    }
+    {
+      std::ofstream fout(filename);
+      for (size_t i = 0; i < n; ++i) {
+        fout << syntheticPath(i) << ' ' << (i % 10 == 0) << ' ' << 1600000000 + i << ' ' << i * 37 % 1048576 << '\n';
+      }
+    }
+    FileDataManager convert(filename);
+    return filename;
+  }
+
+  // 同一时间只缓存一种规模的索引, 10^7项的索引会占用约2GB内存
+  struct IndexCache
+  {
+    size_t m_n = 0;
+    std::unique_ptr<FileDataManager> m_fdm;
+    std::vector<std::string> m_samples; // 随机抽取的已存在路径
+  };
+  IndexCache s_cache;
+
+  FileDataManager &cachedIndex(size_t n) {
+    if (s_cache.m_n != n || !s_cache.m_fdm) {
+      s_cache.m_fdm.reset();
+      s_cache.m_fdm.reset(new FileDataManager(indexFile(n)));
+      s_cache.m_n = n;
+      std::mt19937_64 rng(n);
+      s_cache.m_samples.clear();
+      for (int i = 0; i < 1024; ++i) {
+        s_cache.m_samples.push_back(syntheticPath(rng() % n));
+      }
+    }
+    return *s_cache.m_fdm;
+  }
+  void releaseIndex() {
+    s_cache.m_fdm.reset();
+    s_cache.m_n = 0;
+  }
+
+  // 启动时加载索引: 打开快照并重放(空的)日志
+  void BM_FileDataManager_Load(benchmark::State &state) {
+    releaseIndex();
+    std::string filename = indexFile(state.range(0));
+    for (auto _ : state) {
+      std::unique_ptr<FileDataManager> fdm(new FileDataManager(filename));
+      state.PauseTiming();
+      fdm.reset();
+      state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+  }
+  void BM_FileDataManager_Lookup(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(fdm.isExistFile(s_cache.m_samples[i++ & 1023]));
+    }
+  }
+  // 上传时的插入, 包括stat和追加一行日志(以及分摊的合并开销)
+  void BM_FileDataManager_Insert(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    const std::string probe = "./insert_probe";
+    CloudBackup::MyUtil::writeFile(probe, "probe");
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(fdm.insertData(probe));
+    }
+    fdm.deleteData(probe);
+  }
+  // 修改一项的状态并追加日志, 日志达到阈值时合并成新的快照, 合并的开销分摊在各次修改中
+  void BM_FileDataManager_Persist(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    const std::string &path = s_cache.m_samples[0];
+    for (auto _ : state) {
+      fdm.changeData(path);
+    }
+    if (state.iterations() % 2 == 1) {
+      fdm.changeData(path);
+    }
+  }
+  // 列出一个目录中的文件, 规模为n时每个目录有n/10^4个文件
+  void BM_FileDataManager_DirListLeaf(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    std::vector<std::string> list;
+    for (auto _ : state) {
+      fdm.getDirList("/data/CloudBackup/100000/d0", list);
+    }
+    state.SetItemsProcessed(state.iterations() * list.size());
+  }
+  // 列出用户根目录, 100个子目录, 主要是跳过子树的开销
+  void BM_FileDataManager_DirListRoot(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    std::vector<std::string> list;
+    for (auto _ : state) {
+      fdm.getDirList("/data/CloudBackup/100000", list);
+    }
+    state.SetItemsProcessed(state.iterations() * list.size());
+  }
+
+  // 后台压缩线程以前的做法: 复制出全部路径, 再逐个查询状态
+  void BM_FileDataManager_AllList(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    std::vector<std::string> list;
+    size_t normal = 0;
+    for (auto _ : state) {
+      fdm.getAllList(list);
+      normal = 0;
+      for (auto &path : list) {
+        normal += fdm.isCompressedFile(path) ? 0 : 1;
+      }
+    }
+    state.counters["matched"] = normal;
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+  }
+  // 分批scan, 只复制满足条件(未压缩且访问时间足够早)的路径, 合成数据中约1/2的项满足
+  void BM_FileDataManager_Scan(benchmark::State &state) {
+    FileDataManager &fdm = cachedIndex(state.range(0));
+    FileDataManager::ScanFilter filter;
+    filter.m_normalOnly = true;
+    filter.m_atimeBefore = 1600000000 + state.range(0) / 2;
+    std::vector<std::string> pending;
+    size_t matched = 0;
+    for (auto _ : state) {
+      std::string cursor;
+      matched = 0;
+      bool more = true;
+      while (more) {
+        pending.clear();
+        more = fdm.scan(cursor, 4096, filter, [&pending](boost::string_view path, const FileDataManager::FileData &) {
+          pending.emplace_back(path.data(), path.size());
+        });
+        matched += pending.size();
+      }
+    }
+    state.counters["matched"] = matched;
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+  }
+
+  // 按规模从小到大依次运行各项测试, 使每种规模的索引只需要构建一次
+  int registerIndexBenchmarks() {
+    for (int64_t n = 10000; n <= 10000000; n *= 10) {
+      benchmark::RegisterBenchmark("BM_FileDataManager_Load", BM_FileDataManager_Load)
+        ->Arg(n)->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_Lookup", BM_FileDataManager_Lookup)->Arg(n);
+      benchmark::RegisterBenchmark("BM_FileDataManager_DirListLeaf", BM_FileDataManager_DirListLeaf)
+        ->Arg(n)->Unit(benchmark::kMicrosecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_DirListRoot", BM_FileDataManager_DirListRoot)
+        ->Arg(n)->Unit(benchmark::kMicrosecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_AllList", BM_FileDataManager_AllList)
+        ->Arg(n)->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_Scan", BM_FileDataManager_Scan)
+        ->Arg(n)->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_Insert", BM_FileDataManager_Insert)
+        ->Arg(n)->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark("BM_FileDataManager_Persist", BM_FileDataManager_Persist)
+        ->Arg(n)->Unit(benchmark::kMillisecond);
+    }
+    return 0;
+  }
+  int s_indexRegistered = registerIndexBenchmarks();
+
+  // 16MB合成数据, 由少量单词和随机字节混合而成, 压缩率接近文本文件
+  const std::string &compressSource() {
+    static std::string filename;
+    if (filename.empty()) {
+      static const char *words[] = { "cloud", "backup", "file", "data", "server", "client",
+        "upload", "download", "the", "of", "and", "to", "/data/CloudBackup/", "\n" };
+      std::mt19937 rng(42);
+      std::string buf;
+      while (buf.size() < (16 << 20)) {
+        if (rng() % 8 == 0) {
+          buf += static_cast<char>(rng());
+        } else {
+          buf += words[rng() % (sizeof(words) / sizeof(words[0]))];
+          buf += ' ';
+        }
+      }
+      filename = "./compress_src.dat";
+      CloudBackup::MyUtil::writeFile(filename, buf);
+    }
+    return filename;
+  }
+  void BM_CompressUtil_Compress(benchmark::State &state) {
+    const std::string &src = compressSource();
+    for (auto _ : state) {
+      CompressUtil::compress(src, "./compress_dst.gz", state.range(0));
+    }
+    state.SetBytesProcessed(state.iterations() * boost::filesystem::file_size(src));
+    state.counters["ratio"] = static_cast<double>(boost::filesystem::file_size(src))
+      / boost::filesystem::file_size("./compress_dst.gz");
+  }
+  BENCHMARK(BM_CompressUtil_Compress)->Arg(1)->Arg(6)->Arg(9)->Unit(benchmark::kMillisecond);
+
+  // 解压速度按解压后的数据量计算
+  void BM_CompressUtil_Decompress(benchmark::State &state) {
+    const std::string &src = compressSource();
+    const std::string gz = "./decompress_src_" + std::to_string(state.range(0)) + ".gz";
+    CompressUtil::compress(src, gz, state.range(0));
+    for (auto _ : state) {
+      CompressUtil::decompress(gz, "./decompress_dst.dat");
+    }
+    state.SetBytesProcessed(state.iterations() * boost::filesystem::file_size(src));
+  }
+  BENCHMARK(BM_CompressUtil_Decompress)->Arg(1)->Arg(6)->Arg(9)->Unit(benchmark::kMillisecond);
+
+  void BM_MyUtil_GetConfig(benchmark::State &state) {
+    const char *item = state.range(0) == 0 ? "CloudServer" : "CloudClient";
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(CloudBackup::MyUtil::getConfig("./CBackup.cnf", item));
+    }
+  }
+  BENCHMARK(BM_MyUtil_GetConfig)->Arg(0)->Arg(1);
+
+  const size_t s_cacheKeys = 100000;
+  // 热点文件缓存: 10万个4KB的对象按近似Zipf分布访问, 缓存容量为range(0)MB, 未命中时放入
+  // 多线程同时访问, 各线程的分片锁竞争体现在耗时上, hit_ratio为命中率
+  void BM_ObjectCache_Zipf(benchmark::State &state) {
+    static ObjectCache *cache = nullptr;
+    static std::vector<std::string> keys;
+    static std::shared_ptr<const std::string> value;
+    if (state.thread_index() == 0) {
+      cache = new ObjectCache;
+      cache->configure(state.range(0) << 20, 65536);
+      for (size_t i = keys.size(); i < s_cacheKeys; ++i) {
+        keys.push_back(syntheticPath(i));
+      }
+      value = std::make_shared<const std::string>(4096, 'x');
+    }
+    std::mt19937 rng(state.thread_index());
+    // 1/u的分布: 第k个对象被访问的概率约与1/k成正比
+    std::uniform_real_distribution<double> uniform(0, std::log(static_cast<double>(s_cacheKeys)));
+    size_t hits = 0, lookups = 0;
+    for (auto _ : state) {
+      const std::string &key = keys[static_cast<size_t>(std::exp(uniform(rng))) - 1];
+      if (cache->get(key, 1)) {
+        ++hits;
+      } else {
+        cache->put(key, 1, value);
+      }
+      ++lookups;
+    }
+    state.counters["hit_ratio"] = benchmark::Counter(static_cast<double>(hits) / lookups, benchmark::Counter::kAvgThreads);
+    if (state.thread_index() == 0) {
+      delete cache;
+    }
+  }
+  BENCHMARK(BM_ObjectCache_Zipf)->Arg(16)->Arg(64)->ThreadRange(1, 8);
+}
@@ -0,0 +1,39 @@
+// 线程池的微基准测试: httplib::ThreadPool与WorkStealingPool的提交到执行开销
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include "../WorkStealingPool.hpp"
+
+namespace {
+  const size_t s_threads = 8;
+  const int s_batch = 1000;
+
+  // 一批任务从提交到全部执行完的时间, 模拟accept线程连续派发连接
+  template <typename Pool>
+  void runBatches(benchmark::State &state, Pool &pool) {
+    std::atomic<int> done(0);
+    for (auto _ : state) {
+      done = 0;
+      for (int i = 0; i < s_batch; ++i) {
+        pool.enqueue([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+      }
+      while (done.load(std::memory_order_relaxed) != s_batch) {
+        std::this_thread::yield();
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * s_batch);
+    pool.shutdown();
+  }
+
+  void BM_ThreadPool(benchmark::State &state) {
+    httplib::ThreadPool pool(s_threads);
+    runBatches(state, pool);
+  }
+  BENCHMARK(BM_ThreadPool)->UseRealTime();
+
+  void BM_WorkStealingPool(benchmark::State &state) {
+    CloudBackup::WorkStealingPool pool(s_threads);
+    runBatches(state, pool);
+    state.counters["steals"] = pool.steals();
+  }
+  BENCHMARK(BM_WorkStealingPool)->UseRealTime();
+}
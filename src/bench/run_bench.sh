@@ -0,0 +1,40 @@
+#!/bin/sh
+# CloudServer压测: 在临时目录中启动链接了FakeMysql的服务器, 对每种serverMode运行一次LoadGen,
+# 结果(每组一行JSON)输出到标准输出, 服务器日志保存为临时目录中的<mode>/server.log
+# 环境变量:
+#   BENCH_MODES  要压测的serverMode, 默认"thread epoll"
+#   BENCH_IO     ioBackend, 默认posix
+#   LOADGEN_ARGS 传给LoadGen的参数, 例如"-s 4096,1048576 -c 1,16 -n 500"
+# 服务器固定监听9000端口, 压测用户的文件写在/data/CloudBackup/100001下, 结束后删除
+set -e
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CONF="$BENCH_DIR/../../CBackup.cnf"
+MODES=${BENCH_MODES:-"thread epoll"}
+IO=${BENCH_IO:-posix}
+BENCH_UID=100001
+WORK=$(mktemp -d)
+SRV=""
+cleanup() {
+  [ -n "$SRV" ] && kill $SRV 2>/dev/null
+  rm -rf "$WORK" "/data/CloudBackup/$BENCH_UID"
+}
+trap cleanup EXIT
+
+for mode in $MODES; do
+  mkdir -p "$WORK/$mode"
+  cd "$WORK/$mode"
+  sed -e "s/^serverMode=.*/serverMode=$mode/" -e "s/^ioBackend=.*/ioBackend=$IO/" "$CONF" > CBackup.cnf
+  # 文件信息表必须是已经存在的文件
+  : > srv_log.dat
+  rm -rf "/data/CloudBackup/$BENCH_UID"
+  "$BENCH_DIR/CloudServerBench" > server.log 2>&1 &
+  SRV=$!
+  "$BENCH_DIR/LoadGen" -t "$mode" $LOADGEN_ARGS
+  if ! kill $SRV 2>/dev/null; then
+    echo "CloudServerBench ($mode) exited early, see server.log:" >&2
+    tail -n 20 server.log >&2
+    exit 1
+  fi
+  wait $SRV 2>/dev/null || true
+  SRV=""
+done
@@ -0,0 +1,11 @@
+#!/bin/sh
+# 运行微基准测试: 在临时目录中准备CBackup.cnf和srv_log.dat, 存储相关的测试数据也生成在这里
+# 参数原样传给MicroBench, 例如 --benchmark_filter=FileDataManager --benchmark_format=json
+set -e
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cp "$BENCH_DIR/../../CBackup.cnf" "$WORK/CBackup.cnf"
+: > "$WORK/srv_log.dat"
+cd "$WORK"
+"$BENCH_DIR/MicroBench" "$@"
@@ -268,6 +268,7 @@ struct Request {
   MultipartFormDataMap files;
   Ranges ranges;
   Match matches;
+  std::vector<std::string> path_params; // filled by a custom dispatcher
 
   // for client
   size_t redirect_count = CPPHTTPLIB_REDIRECT_MAX_COUNT;
@@ -446,6 +447,7 @@ public:
       const Request &, Response &, const ContentReader &content_reader)>;
   using Expect100ContinueHandler =
       std::function<int(const Request &, Response &)>;
+  using Dispatcher = std::function<bool(Request &, Response &)>;
 
   Server();
 
@@ -473,6 +475,7 @@ public:
 
   void set_error_handler(Handler handler);
   void set_logger(Logger logger);
+  void set_dispatcher(Dispatcher dispatcher);
 
   void set_expect_100_continue_handler(Expect100ContinueHandler handler);
 
@@ -484,10 +487,10 @@ public:
   int bind_to_any_port(const char *host, int socket_flags = 0);
   bool listen_after_bind();
 
-  bool listen(const char *host, int port, int socket_flags = 0);
+  virtual bool listen(const char *host, int port, int socket_flags = 0);
 
   bool is_running() const;
-  void stop();
+  virtual void stop();
 
   std::function<TaskQueue *(void)> new_task_queue;
 
@@ -500,6 +503,8 @@ protected:
   time_t read_timeout_sec_;
   time_t read_timeout_usec_;
   size_t payload_max_length_;
+  std::atomic<bool> is_running_;
+  std::atomic<socket_t> svr_sock_;
 
 private:
   using Handlers = std::vector<std::pair<std::regex, Handler>>;
@@ -514,6 +519,7 @@ private:
   bool routing(Request &req, Response &res, Stream &strm, bool last_connection);
   bool handle_file_request(Request &req, Response &res, bool head = false);
   bool dispatch_request(Request &req, Response &res, Handlers &handlers);
+  bool dispatch_request_with_dispatcher(Request &req, Response &res);
   bool dispatch_request_for_content_reader(Request &req, Response &res,
                                            ContentReader content_reader,
                                            HandlersForContentReader &handlers);
@@ -537,8 +543,6 @@ private:
 
   virtual bool process_and_close_socket(socket_t sock);
 
-  std::atomic<bool> is_running_;
-  std::atomic<socket_t> svr_sock_;
   std::vector<std::pair<std::string, std::string>> base_dirs_;
   std::map<std::string, std::string> file_extension_and_mimetype_map_;
   Handler file_request_handler_;
@@ -553,6 +557,7 @@ private:
   Handlers options_handlers_;
   Handler error_handler_;
   Logger logger_;
+  Dispatcher dispatcher_;
   Expect100ContinueHandler expect_100_continue_handler_;
 };
 
@@ -1864,6 +1869,11 @@ inline bool is_chunked_transfer_encoding(const Headers &headers) {
                      "chunked");
 }
 
+// Without zlib, a server request keeps its encoded body and the handler
+// decides what to do with it (e.g. store an uploaded gzip stream as is)
+inline bool keep_content_encoding(const Request &) { return true; }
+inline bool keep_content_encoding(const Response &) { return false; }
+
 template <typename T>
 bool read_content(Stream &strm, T &x, size_t payload_max_length, int &status,
                   Progress progress, ContentReceiver receiver) {
@@ -1889,7 +1899,8 @@ bool read_content(Stream &strm, T &x, size_t payload_max_length, int &status,
     };
   }
 #else
-  if (x.get_header_value("Content-Encoding") == "gzip") {
+  if (x.get_header_value("Content-Encoding") == "gzip" &&
+      !keep_content_encoding(x)) {
     status = 415;
     return false;
   }
@@ -2821,7 +2832,8 @@ inline bool SocketStream::is_readable() const {
 }
 
 inline bool SocketStream::is_writable() const {
-  return detail::select_write(sock_, 0, 0) > 0;
+  // Wait for the send buffer to drain instead of failing a large response
+  return detail::select_write(sock_, read_timeout_sec_, read_timeout_usec_) > 0;
 }
 
 inline ssize_t SocketStream::read(char *ptr, size_t size) {
@@ -2970,6 +2982,10 @@ inline void Server::set_error_handler(Handler handler) {
 
 inline void Server::set_logger(Logger logger) { logger_ = std::move(logger); }
 
+inline void Server::set_dispatcher(Dispatcher dispatcher) {
+  dispatcher_ = std::move(dispatcher);
+}
+
 inline void
 Server::set_expect_100_continue_handler(Expect100ContinueHandler handler) {
   expect_100_continue_handler_ = std::move(handler);
@@ -3447,6 +3463,11 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm,
     if (!read_content(strm, last_connection, req, res)) { return false; }
   }
 
+  // Custom dispatcher, tried before the regex handlers
+  if (dispatcher_ && dispatch_request_with_dispatcher(req, res)) {
+    return true;
+  }
+
   // Regular handler
   if (req.method == "GET" || req.method == "HEAD") {
     return dispatch_request(req, res, get_handlers_);
@@ -3466,6 +3487,20 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm,
   return false;
 }
 
+inline bool Server::dispatch_request_with_dispatcher(Request &req,
+                                                     Response &res) {
+  try {
+    return dispatcher_(req, res);
+  } catch (const std::exception &ex) {
+    res.status = 500;
+    res.set_header("EXCEPTION_WHAT", ex.what());
+  } catch (...) {
+    res.status = 500;
+    res.set_header("EXCEPTION_WHAT", "UNKNOWN");
+  }
+  return true;
+}
+
 inline bool Server::dispatch_request(Request &req, Response &res,
                                      Handlers &handlers) {
 
@@ -3903,16 +3938,23 @@ inline bool Client::write_request(Stream &strm, const Request &req,
       size_t offset = 0;
       size_t end_offset = req.content_length;
 
+      // Stop on a failed write instead of calling the provider forever
+      bool ok = true;
       DataSink data_sink;
       data_sink.write = [&](const char *d, size_t l) {
         auto written_length = strm.write(d, l);
+        if (written_length < 0) {
+          ok = false;
+          return;
+        }
         offset += static_cast<size_t>(written_length);
       };
       data_sink.is_writable = [&](void) { return strm.is_writable(); };
 
-      while (offset < end_offset) {
+      while (ok && offset < end_offset) {
         req.content_provider(offset, end_offset - offset, data_sink);
       }
+      if (!ok) { return false; }
     }
   } else {
     strm.write(req.body);
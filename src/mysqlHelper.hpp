@@ -650,7 +650,6 @@ namespace mysqlhelper
 
     _sLastSql = sSql;
 
-    printf("execute-->[%s]\n", sSql.c_str());
     int iRet = mysql_real_query(_pstMql, sSql.c_str(), sSql.length());
     if(iRet != 0)
     {
@@ -685,7 +684,6 @@ namespace mysqlhelper
 
     _sLastSql = sSql;
 
-    printf("query-->[%s]\n", sSql.c_str());
     int iRet = mysql_real_query(_pstMql, sSql.c_str(), sSql.length());
     if(iRet != 0)
     {